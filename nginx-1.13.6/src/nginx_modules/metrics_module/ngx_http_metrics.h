@@ -0,0 +1,30 @@
+#ifndef _NGX_HTTP_METRICS_H_INCLUDED_
+#define _NGX_HTTP_METRICS_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <ngx_metrics.h>
+
+/* a metrics_label dimension */
+
+typedef struct tag_ngx_http_metrics_label {
+	ngx_str_t name;
+	ngx_http_complex_value_t value;
+} ngx_http_metrics_label_t;
+
+ngx_array_t * ngx_http_metrics_peer_names(ngx_conf_t * cf);
+ngx_int_t ngx_http_metrics_init_peers(ngx_cycle_t * cycle);
+void ngx_http_metrics_account_peers(ngx_http_request_t * r);
+ngx_array_t * ngx_http_metrics_get_labels(void);
+
+#if (NGX_METRICS_BENCH)
+ngx_int_t ngx_http_metrics_bench_map(ngx_str_t * file , ngx_log_t * log , ngx_uint_t * nstates , size_t * size);
+ngx_http_output_header_filter_pt ngx_http_metrics_bench_filter(ngx_http_output_header_filter_pt * next);
+void ngx_http_metrics_bench_filter_done(ngx_http_output_header_filter_pt next);
+ngx_int_t ngx_http_metrics_bench_check_map(ngx_log_t * log);
+#endif
+
+
+#endif /* _NGX_HTTP_METRICS_H_INCLUDED_ */
@@ -0,0 +1,566 @@
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <ngx_http_metrics.h>
+
+#if (NGX_LINUX)
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
+#define NGX_HTTP_METRICS_BENCH_MAX_SIZES	8
+#define NGX_HTTP_METRICS_BENCH_MAX_PATTERNS	1000000
+#define NGX_HTTP_METRICS_BENCH_URIS	65536
+#define NGX_HTTP_METRICS_BENCH_REQUESTS	2000000
+#define NGX_HTTP_METRICS_BENCH_MISSES	10
+#define NGX_HTTP_METRICS_BENCH_URI_LEN	64
+#define NGX_HTTP_METRICS_BENCH_LINE_LEN	(NGX_INT_T_LEN + NGX_HTTP_METRICS_BENCH_URI_LEN + 8)
+#define NGX_HTTP_METRICS_BENCH_FILE	"logs/metrics_bench.idx"
+
+/*
+ * A request of a run: a uri under one of the patterns of the map, drawn
+ * with a Zipf or a uniform distribution, or under none of them, and a
+ * status from the mix of a typical site.
+ */
+typedef struct tag_ngx_http_metrics_bench_request {
+	ngx_str_t uri;
+	ngx_uint_t status;
+} ngx_http_metrics_bench_request_t;
+
+typedef struct tag_ngx_http_metrics_bench_conf {
+	ngx_flag_t enable;
+	ngx_uint_t sizes[NGX_HTTP_METRICS_BENCH_MAX_SIZES];
+	ngx_uint_t nsizes;
+	ngx_uint_t uris;
+	ngx_uint_t requests;
+	ngx_uint_t misses;
+	ngx_flag_t uniform;
+	ngx_str_t file;
+} ngx_http_metrics_bench_conf_t;
+
+static char * ngx_http_metrics_bench(ngx_conf_t * cf , ngx_command_t * cmd , void * conf);
+static void * ngx_http_metrics_bench_create_conf(ngx_conf_t * cf);
+static ngx_int_t ngx_http_metrics_bench_init_module(ngx_cycle_t * cycle);
+static ngx_int_t ngx_http_metrics_bench_run(ngx_cycle_t * cycle , ngx_http_metrics_bench_conf_t * bcf ,
+	ngx_http_request_t * r , ngx_http_metrics_bench_request_t * requests , double * cdf , int perf , ngx_uint_t npatterns);
+static ngx_int_t ngx_http_metrics_bench_write_map(ngx_http_metrics_bench_conf_t * bcf , ngx_uint_t npatterns ,
+	ngx_uint_t nslots , ngx_log_t * log);
+static u_char * ngx_http_metrics_bench_pattern(u_char * p , ngx_uint_t i);
+static ngx_uint_t ngx_http_metrics_bench_draw(double * cdf , ngx_uint_t n);
+static uint64_t ngx_http_metrics_bench_now(void);
+static int ngx_http_metrics_bench_perf_open(void);
+
+static ngx_uint_t ngx_http_metrics_bench_default_sizes[] = { 10 , 100 , 1000 , 10000 , 100000 };
+
+static ngx_command_t ngx_http_metrics_bench_commands[] = {
+    {
+    	ngx_string("metrics_bench"),
+    	NGX_HTTP_MAIN_CONF | NGX_CONF_ANY,
+    	ngx_http_metrics_bench,
+    	NGX_HTTP_MAIN_CONF_OFFSET,
+    	0,
+    	NULL
+    },
+    ngx_null_command
+};
+
+static ngx_http_module_t ngx_http_metrics_bench_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    NULL,                                  /* postconfiguration */
+    ngx_http_metrics_bench_create_conf,    /* create main configuration */
+    NULL,                                  /* init main configuration */
+    NULL,                                  /* create server configuration */
+    NULL,                                  /* merge server configuration */
+    NULL,                                  /* create location configuration */
+    NULL                                   /* merge location configuration */
+};
+
+ngx_module_t ngx_http_metrics_bench_module = {
+    NGX_MODULE_V1,
+    &ngx_http_metrics_bench_module_ctx,    /* module context */
+    ngx_http_metrics_bench_commands,       /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    ngx_http_metrics_bench_init_module,    /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+static void * ngx_http_metrics_bench_create_conf(ngx_conf_t * cf) {
+	return ngx_pcalloc(cf->pool , sizeof(ngx_http_metrics_bench_conf_t));
+}
+
+/*
+ * metrics_bench [sizes=number,...] [uris=number] [requests=number]
+ *     [misses=percent] [uniform] [file=path]
+ *
+ * Runs the header filter of the metrics module, with "nginx -t", over
+ * synthetic metrics maps of each size, in patterns, and prints the time
+ * and the cache misses per request and the throughput for each.  The
+ * filter runs with the configuration of the first server and the rest
+ * of the header filter chain cut off.  The top-K table is only set up
+ * in the workers and is left out.
+ */
+
+static char * ngx_http_metrics_bench(ngx_conf_t * cf , ngx_command_t * cmd , void * conf) {
+	ngx_http_metrics_bench_conf_t * bcf = (ngx_http_metrics_bench_conf_t *)conf;
+	ngx_str_t * value = cf->args->elts;
+	u_char * p , * last , * comma;
+	ngx_uint_t i;
+	ngx_int_t n;
+
+	if (bcf->enable) {
+		return "is duplicate";
+	}
+
+	bcf->enable = 1;
+	bcf->nsizes = sizeof(ngx_http_metrics_bench_default_sizes) / sizeof(ngx_uint_t);
+	ngx_memcpy(bcf->sizes , ngx_http_metrics_bench_default_sizes , sizeof(ngx_http_metrics_bench_default_sizes));
+	bcf->uris = NGX_HTTP_METRICS_BENCH_URIS;
+	bcf->requests = NGX_HTTP_METRICS_BENCH_REQUESTS;
+	bcf->misses = NGX_HTTP_METRICS_BENCH_MISSES;
+	ngx_str_set(&bcf->file , NGX_HTTP_METRICS_BENCH_FILE);
+
+	for (i = 1; i < cf->args->nelts; i++) {
+		if (ngx_strncmp(value[i].data , "sizes=" , 6) == 0) {
+			bcf->nsizes = 0;
+			last = value[i].data + value[i].len;
+
+			for (p = value[i].data + 6; p < last; p = comma + 1) {
+				comma = ngx_strlchr(p , last , ',');
+				if (comma == NULL) {
+					comma = last;
+				}
+
+				n = ngx_atoi(p , comma - p);
+				if (n <= 0 || n > NGX_HTTP_METRICS_BENCH_MAX_PATTERNS
+					|| bcf->nsizes == NGX_HTTP_METRICS_BENCH_MAX_SIZES)
+				{
+					goto invalid;
+				}
+
+				bcf->sizes[bcf->nsizes++] = n;
+			}
+
+			if (bcf->nsizes == 0) {
+				goto invalid;
+			}
+
+			continue;
+		}
+
+		if (ngx_strncmp(value[i].data , "uris=" , 5) == 0) {
+			n = ngx_atoi(value[i].data + 5 , value[i].len - 5);
+			if (n <= 0) {
+				goto invalid;
+			}
+
+			bcf->uris = n;
+			continue;
+		}
+
+		if (ngx_strncmp(value[i].data , "requests=" , 9) == 0) {
+			n = ngx_atoi(value[i].data + 9 , value[i].len - 9);
+			if (n <= 0) {
+				goto invalid;
+			}
+
+			bcf->requests = n;
+			continue;
+		}
+
+		if (ngx_strncmp(value[i].data , "misses=" , 7) == 0) {
+			n = ngx_atoi(value[i].data + 7 , value[i].len - 7);
+			if (n == NGX_ERROR || n > 100) {
+				goto invalid;
+			}
+
+			bcf->misses = n;
+			continue;
+		}
+
+		if (ngx_strcmp(value[i].data , "uniform") == 0) {
+			bcf->uniform = 1;
+			continue;
+		}
+
+		if (ngx_strncmp(value[i].data , "file=" , 5) == 0) {
+			bcf->file.data = value[i].data + 5;
+			bcf->file.len = value[i].len - 5;
+
+			if (bcf->file.len == 0) {
+				goto invalid;
+			}
+
+			continue;
+		}
+
+		goto invalid;
+	}
+
+	if (ngx_conf_full_name(cf->cycle , &bcf->file , 0) != NGX_OK) {
+		return NGX_CONF_ERROR;
+	}
+
+	return NGX_CONF_OK;
+
+invalid:
+
+	ngx_conf_log_error(NGX_LOG_EMERG , cf , 0 , "invalid parameter \"%V\"" , &value[i]);
+
+	return NGX_CONF_ERROR;
+}
+
+/*
+ * Runs once the metrics zone is set up, counting into the first shard of
+ * the zone of the configuration being tested, which no worker uses.
+ */
+
+static ngx_int_t ngx_http_metrics_bench_init_module(ngx_cycle_t * cycle) {
+	ngx_http_metrics_bench_conf_t * bcf = ngx_http_cycle_get_module_main_conf(cycle , ngx_http_metrics_bench_module);
+	ngx_metrics_conf_t * mcf = (ngx_metrics_conf_t *)ngx_get_conf(cycle->conf_ctx , ngx_metrics_module);
+	ngx_http_core_main_conf_t * cmcf;
+	ngx_http_core_srv_conf_t ** cscfp;
+	ngx_http_metrics_bench_request_t * requests;
+	ngx_http_request_t * r;
+	ngx_connection_t * c;
+	ngx_uint_t i , max;
+	double * cdf;
+	u_char * uris;
+	int perf;
+
+	if (bcf == NULL || !bcf->enable) {
+		return NGX_OK;
+	}
+
+	if (!ngx_test_config) {
+		ngx_log_error(NGX_LOG_WARN , cycle->log , 0 , "metrics_bench only runs with \"nginx -t\"");
+		return NGX_OK;
+	}
+
+
+	cmcf = ngx_http_cycle_get_module_main_conf(cycle , ngx_http_core_module);
+
+	if (mcf->sh == NULL || cmcf->servers.nelts == 0) {
+		ngx_log_error(NGX_LOG_WARN , cycle->log , 0 , "metrics_bench needs a metrics zone and a server");
+		return NGX_OK;
+	}
+
+	if (ngx_http_metrics_bench_check_map(cycle->log) != NGX_OK || ngx_metrics_topk_check(cycle->log) != NGX_OK
+		|| ngx_metrics_snapshot_check(mcf , &bcf->file , cycle->log) != NGX_OK)
+	{
+		return NGX_ERROR;
+	}
+
+	ngx_log_stderr(0 , "metrics bench: map lookups, top-k tables and snapshots check out");
+
+	cscfp = cmcf->servers.elts;
+
+	r = ngx_pcalloc(cycle->pool , sizeof(ngx_http_request_t));
+	c = ngx_pcalloc(cycle->pool , sizeof(ngx_connection_t));
+	if (r == NULL || c == NULL) {
+		return NGX_ERROR;
+	}
+
+	c->log = cycle->log;
+	r->connection = c;
+	r->main = r;
+	r->main_conf = cscfp[0]->ctx->main_conf;
+	r->srv_conf = cscfp[0]->ctx->srv_conf;
+	r->loc_conf = cscfp[0]->ctx->loc_conf;
+
+	r->ctx = ngx_pcalloc(cycle->pool , sizeof(void *) * ngx_http_max_module);
+	r->pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE , cycle->log);
+	if (r->ctx == NULL || r->pool == NULL) {
+		return NGX_ERROR;
+	}
+
+	for (max = 0 , i = 0; i < bcf->nsizes; i++) {
+		max = ngx_max(max , bcf->sizes[i]);
+	}
+
+	requests = ngx_alloc(bcf->uris * sizeof(ngx_http_metrics_bench_request_t) , cycle->log);
+	uris = ngx_alloc(bcf->uris * NGX_HTTP_METRICS_BENCH_URI_LEN , cycle->log);
+	cdf = ngx_alloc(max * sizeof(double) , cycle->log);
+	if (requests == NULL || uris == NULL || cdf == NULL) {
+		goto done;
+	}
+
+	for (i = 0; i < bcf->uris; i++) {
+		requests[i].uri.data = uris + i * NGX_HTTP_METRICS_BENCH_URI_LEN;
+	}
+
+	perf = ngx_http_metrics_bench_perf_open();
+
+	ngx_metrics_sh = mcf->sh;
+	ngx_metrics_shard = ngx_metrics_get_shard(mcf->sh , 0);
+
+	ngx_log_stderr(0 , "metrics bench: %ui requests over %ui %s uris, %ui%% of them in no pattern" ,
+		bcf->requests , bcf->uris , bcf->uniform ? "uniform" : "zipf" , bcf->misses);
+
+	for (i = 0; i < bcf->nsizes; i++) {
+		if (ngx_http_metrics_bench_run(cycle , bcf , r , requests , cdf , perf , bcf->sizes[i]) != NGX_OK) {
+			break;
+		}
+	}
+
+	ngx_metrics_shard = NULL;
+
+	if (perf != -1) {
+		(void)close(perf);
+	}
+
+done:
+
+	ngx_destroy_pool(r->pool);
+	ngx_free(requests);
+	ngx_free(uris);
+	ngx_free(cdf);
+
+	return NGX_OK;
+}
+
+static ngx_int_t ngx_http_metrics_bench_run(ngx_cycle_t * cycle , ngx_http_metrics_bench_conf_t * bcf ,
+	ngx_http_request_t * r , ngx_http_metrics_bench_request_t * requests , double * cdf , int perf , ngx_uint_t npatterns)
+{
+	ngx_http_output_header_filter_pt filter , next;
+	ngx_http_metrics_bench_request_t * rq;
+	ngx_uint_t i , k , n , nstates;
+	uint64_t start , elapsed , misses;
+	double total;
+	size_t size;
+	u_char * p;
+
+	if (ngx_http_metrics_bench_write_map(bcf , npatterns , ngx_metrics_sh->nslots , cycle->log) != NGX_OK) {
+		return NGX_ERROR;
+	}
+
+	if (ngx_http_metrics_bench_map(&bcf->file , cycle->log , &nstates , &size) != NGX_OK) {
+		return NGX_ERROR;
+	}
+
+	(void)ngx_delete_file(bcf->file.data);
+
+	for (total = 0 , k = 0; k < npatterns; k++) {
+		total += bcf->uniform ? 1.0 : 1.0 / (k + 1);
+		cdf[k] = total;
+	}
+
+	for (i = 0; i < bcf->uris; i++) {
+		rq = &requests[i];
+		p = rq->uri.data;
+
+		if ((ngx_uint_t)ngx_random() % 100 < bcf->misses) {
+			p = ngx_sprintf(p , "/static/%ui/app.css" , (ngx_uint_t)ngx_random() % 100000);
+
+		} else {
+			k = ngx_http_metrics_bench_draw(cdf , npatterns);
+
+			if (k % 4 != 3) {
+				p = ngx_cpymem(p , "/api" , 4);
+			}
+
+			p = ngx_http_metrics_bench_pattern(p , k);
+			p = ngx_sprintf(p , "item%ui" , (ngx_uint_t)ngx_random() % 100000);
+		}
+
+		rq->uri.len = p - rq->uri.data;
+
+		n = (ngx_uint_t)ngx_random() % 100;
+		rq->status = n < 85 ? NGX_HTTP_OK : n < 90 ? NGX_HTTP_NOT_MODIFIED : n < 97 ? NGX_HTTP_NOT_FOUND
+			: NGX_HTTP_SERVICE_UNAVAILABLE;
+	}
+
+	filter = ngx_http_metrics_bench_filter(&next);
+
+	/* one pass to warm up the caches and the branch predictors */
+
+	for (i = 0; i < bcf->uris; i++) {
+		r->uri = requests[i].uri;
+		r->headers_out.status = requests[i].status;
+
+		(void)filter(r);
+	}
+
+	ngx_reset_pool(r->pool);
+
+#if (NGX_LINUX)
+	if (perf != -1) {
+		(void)ioctl(perf , PERF_EVENT_IOC_RESET , 0);
+		(void)ioctl(perf , PERF_EVENT_IOC_ENABLE , 0);
+	}
+#endif
+
+	start = ngx_http_metrics_bench_now();
+
+	for (n = 0 , i = 0; n < bcf->requests; n++) {
+		r->uri = requests[i].uri;
+		r->headers_out.status = requests[i].status;
+
+		(void)filter(r);
+
+		if (++i == bcf->uris) {
+			i = 0;
+			ngx_reset_pool(r->pool);
+		}
+	}
+
+	elapsed = ngx_http_metrics_bench_now() - start;
+	misses = 0;
+
+	ngx_http_metrics_bench_filter_done(next);
+
+#if (NGX_LINUX)
+	if (perf != -1) {
+		(void)ioctl(perf , PERF_EVENT_IOC_DISABLE , 0);
+
+		if (read(perf , &misses , sizeof(uint64_t)) != sizeof(uint64_t)) {
+			misses = 0;
+		}
+	}
+#endif
+
+	ngx_reset_pool(r->pool);
+
+	if (elapsed == 0) {
+		elapsed = 1;
+	}
+
+	if (perf == -1) {
+		ngx_log_stderr(0 , "metrics bench: %7ui patterns %8ui states %7uz KB %6.2f ns/req %7.2f Mreq/s" ,
+			npatterns , nstates , size / 1024 , (double)elapsed / bcf->requests ,
+			(double)bcf->requests * 1000 / elapsed);
+
+	} else {
+		ngx_log_stderr(0 , "metrics bench: %7ui patterns %8ui states %7uz KB %6.2f ns/req %7.2f Mreq/s "
+			"%6.3f cache misses/req" ,
+			npatterns , nstates , size / 1024 , (double)elapsed / bcf->requests ,
+			(double)bcf->requests * 1000 / elapsed , (double)misses / bcf->requests);
+	}
+
+	return NGX_OK;
+}
+
+/*
+ * Every pattern is in two lines, for "200" and for "5xx", and every
+ * fourth pattern is anchored.
+ */
+
+static ngx_int_t ngx_http_metrics_bench_write_map(ngx_http_metrics_bench_conf_t * bcf , ngx_uint_t npatterns ,
+	ngx_uint_t nslots , ngx_log_t * log)
+{
+	ngx_fd_t fd;
+	ngx_uint_t i;
+	ssize_t n;
+	size_t len;
+	u_char * buf , * p , * line;
+
+	buf = ngx_alloc(npatterns * 2 * NGX_HTTP_METRICS_BENCH_LINE_LEN , log);
+	if (buf == NULL) {
+		return NGX_ERROR;
+	}
+
+	p = buf;
+
+	for (i = 0; i < npatterns; i++) {
+		line = p;
+
+		p = ngx_sprintf(p , "%ui\t%s" , i % nslots , (i % 4 == 3) ? "^" : "");
+		p = ngx_http_metrics_bench_pattern(p , i);
+		*p++ = '\t';
+
+		len = p - line;
+
+		p = ngx_cpymem(p , "200\n" , 4);
+		p = ngx_cpymem(p , line , len);
+		p = ngx_cpymem(p , "5xx\n" , 4);
+	}
+
+	fd = ngx_open_file(bcf->file.data , NGX_FILE_WRONLY , NGX_FILE_TRUNCATE , NGX_FILE_DEFAULT_ACCESS);
+	if (fd == NGX_INVALID_FILE) {
+		ngx_log_error(NGX_LOG_EMERG , log , ngx_errno , ngx_open_file_n " \"%V\" failed" , &bcf->file);
+		ngx_free(buf);
+
+		return NGX_ERROR;
+	}
+
+	n = ngx_write_fd(fd , buf , p - buf);
+	if (n != p - buf) {
+		ngx_log_error(NGX_LOG_EMERG , log , ngx_errno , ngx_write_fd_n " \"%V\" failed" , &bcf->file);
+	}
+
+	if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+		ngx_log_error(NGX_LOG_ALERT , log , ngx_errno , ngx_close_file_n " \"%V\" failed" , &bcf->file);
+	}
+
+	ngx_free(buf);
+
+	return n == p - buf ? NGX_OK : NGX_ERROR;
+}
+
+static u_char * ngx_http_metrics_bench_pattern(u_char * p , ngx_uint_t i) {
+	return ngx_sprintf(p , "/svc%ui/v%ui/res%ui/" , i % 37 , i % 3 + 1 , i);
+}
+
+static ngx_uint_t ngx_http_metrics_bench_draw(double * cdf , ngx_uint_t n) {
+	ngx_uint_t lo , hi , mid;
+	double u;
+
+	u = (double)ngx_random() / 2147483648.0 * cdf[n - 1];
+
+	for (lo = 0 , hi = n - 1; lo < hi; /* void */) {
+		mid = lo + (hi - lo) / 2;
+
+		if (cdf[mid] > u) {
+			hi = mid;
+		} else {
+			lo = mid + 1;
+		}
+	}
+
+	return lo;
+}
+
+static uint64_t ngx_http_metrics_bench_now(void) {
+#if (NGX_HAVE_CLOCK_MONOTONIC)
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC , &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+	struct timeval tv;
+
+	ngx_gettimeofday(&tv);
+
+	return (uint64_t)tv.tv_sec * 1000000000 + tv.tv_usec * 1000;
+#endif
+}
+
+/*
+ * The cache misses of the process in user space, where the kernel lets
+ * it count them.
+ */
+
+static int ngx_http_metrics_bench_perf_open(void) {
+#if (NGX_LINUX)
+	struct perf_event_attr attr;
+
+	ngx_memzero(&attr , sizeof(struct perf_event_attr));
+
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.size = sizeof(struct perf_event_attr);
+	attr.config = PERF_COUNT_HW_CACHE_MISSES;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+
+	return (int)syscall(__NR_perf_event_open , &attr , 0 , -1 , -1 , 0);
+#else
+	return -1;
+#endif
+}
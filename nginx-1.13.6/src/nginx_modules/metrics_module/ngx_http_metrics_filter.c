@@ -1,27 +1,71 @@
 #include <ngx_config.h>
 #include <ngx_core.h>
 #include <ngx_http.h>
-#include <pthread.h>
-#include <sys/mman.h>
+#include <ngx_http_metrics.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
-#include <sys/socket.h>  
-#include <netinet/in.h>  
-#include <arpa/inet.h>  
-#include <netdb.h>
 
 #define MAX_URL_CONFIG_SIZE 1024
 #define MAX_LINE_BUFFER	2048
 #define NGX_TRUE	1
-#define NGX_COLLECT_INTERVAL	1
+#define NGX_HTTP_METRICS_MAX_STATUS	600
+#define NGX_HTTP_METRICS_NCLASSES	6
+#define NGX_HTTP_METRICS_CLASS(c)	(NGX_HTTP_METRICS_MAX_STATUS + (c))
+#define NGX_HTTP_METRICS_ANCHOR	1
+#define NGX_HTTP_METRICS_NO_PATTERN	0xffffffff
+#define NGX_HTTP_METRICS_NO_SLOT	(NGX_METRICS_MAX_SLOTS + 1)
+#define NGX_HTTP_METRICS_MAP_FILE	"metrics.idx"
+#define NGX_HTTP_METRICS_MAP_CHECK	1000
+
+/* where a request is counted, and by which uri */
+
+#define NGX_HTTP_METRICS_RECORD_HEADER	0
+#define NGX_HTTP_METRICS_RECORD_LOG	1
+#define NGX_HTTP_METRICS_URI_NORMALIZED	0
+#define NGX_HTTP_METRICS_URI_ORIGINAL	1
+
+typedef struct tag_ngx_http_metrics_main_conf {
+	ngx_str_t file;
+	ngx_flag_t required;
+	ngx_msec_t check;
+	ngx_array_t * labels;
+	ngx_http_complex_value_t * heavy_key;
+	ngx_flag_t trace;
+} ngx_http_metrics_main_conf_t;
+
+/*
+ * A sampler traces one request in every, or as many as its rate allows
+ * with a burst, in the manner of a token bucket that keeps the time, in
+ * microseconds, at which the next request is due.  Its state is the
+ * worker's own.
+ */
+
+typedef struct tag_ngx_http_metrics_sampler {
+	ngx_uint_t every;
+	ngx_uint_t countdown;
+	uint64_t interval;
+	uint64_t burst;
+	uint64_t next;
+} ngx_http_metrics_sampler_t;
 
 typedef struct tag_ngx_http_metrics_filter_conf {
     ngx_flag_t enable;
+    ngx_flag_t topk;
+    ngx_uint_t slot;
+    ngx_uint_t record;
+    ngx_uint_t uri;
+    ngx_flag_t subrequests;
+    ngx_http_metrics_sampler_t * trace;
 }ngx_http_metrics_filter_conf_t;
 
+typedef struct tag_ngx_http_metrics_ctx {
+	ngx_uint_t slot;
+	ngx_metrics_trace_t * trace;
+} ngx_http_metrics_ctx_t;
+
 typedef struct tag_ngx_http_status_code_map {
 	int code;
 	int index;
@@ -32,21 +76,88 @@ typedef struct tag_ngx_http_metrics_map {
 	u_char * url;
 	ngx_http_status_code_map_t * status_code;
 	struct tag_ngx_http_metrics_map * next;
+	struct tag_ngx_http_metrics_map * hnext;
 } ngx_http_metrics_map_t;
 
+/*
+ * Aho-Corasick automaton compiled from the metrics map: every uri byte is
+ * one step through the transition table, so the lookup cost depends on the
+ * uri length only.  The status code selects a column in the dense
+ * pattern x code index table.  Patterns earlier in the map take precedence.
+ *
+ * A status class column is shared by the codes of the class that have
+ * no column of their own, and fills in the codes that do.  Anchored
+ * patterns start with a class no byte maps to, fed once before the uri.
+ * The regex patterns are one regex with a named group for each, run once
+ * per lookup.
+ *
+ * A compiled matcher is an immutable, versioned snapshot of the map.  The
+ * writers publish a new one through metrics_snapshot and retire the old.
+ */
+typedef struct tag_ngx_http_metrics_matcher {
+	ngx_uint_t version;
+	struct tag_ngx_http_metrics_matcher * retired;
+	ngx_uint_t nstates;
+	ngx_uint_t nclasses;
+	ngx_uint_t npatterns;
+	ngx_uint_t ncodes;
+	u_char class[256];
+	int16_t column[NGX_HTTP_METRICS_MAX_STATUS];
+	uint32_t * next;
+	uint32_t * output;
+	uint32_t * link;
+	int * index;
+#if (NGX_PCRE)
+	ngx_pool_t * pool;
+	ngx_regex_t * regex;
+	ngx_uint_t nregex;
+	uint32_t * regex_pattern;
+	int * regex_group;
+	int * captures;
+	int ncaptures;
+#endif
+} ngx_http_metrics_matcher_t;
+
 static ngx_http_output_body_filter_pt ngx_http_next_body_filter;
 static ngx_http_output_header_filter_pt ngx_http_next_header_filter;
 
-static int MAX_METRICS_NUM = 8;
-static int fd = -1;
-static char * mem_ptr = 0;
-static int is_fork = 0;
 static ngx_http_metrics_map_t * status_code_map = NULL;
-static char domain_name[MAX_LINE_BUFFER] = {0};
-static int udp_svr_socket = -1;
-static struct sockaddr_in addr;
+static ngx_http_metrics_matcher_t * volatile metrics_snapshot = NULL;
+static ngx_http_metrics_matcher_t * metrics_retired = NULL;
+static ngx_uint_t metrics_batch = 0;
+static ngx_http_metrics_map_t ** metrics_batch_hash = NULL;
+static ngx_uint_t metrics_batch_mask = 0;
+static ngx_file_uniq_t metrics_map_uniq = 0;
+static time_t metrics_map_mtime = 0;
+static off_t metrics_map_size = -1;
+static ngx_event_t metrics_map_check_ev;
+
+#if (NGX_PCRE)
+static ngx_pool_t * ngx_http_metrics_pcre_pool;
+static void * (ngx_libc_cdecl * ngx_http_metrics_old_pcre_malloc)(size_t size);
+static void (ngx_libc_cdecl * ngx_http_metrics_old_pcre_free)(void * p);
+#endif
+
+/* the traced requests alive in the worker */
+
+static ngx_uint_t metrics_traces = 0;
+
+static char * ngx_http_metrics_map(ngx_conf_t * cf , ngx_command_t * cmd , void * conf);
+static char * ngx_http_metrics_slot(ngx_conf_t * cf , ngx_command_t * cmd , void * conf);
+static char * ngx_http_metrics_label(ngx_conf_t * cf , ngx_command_t * cmd , void * conf);
+static char * ngx_http_metrics_trace(ngx_conf_t * cf , ngx_command_t * cmd , void * conf);
+
+static ngx_conf_enum_t ngx_http_metrics_record_phases[] = {
+	{ ngx_string("header") , NGX_HTTP_METRICS_RECORD_HEADER },
+	{ ngx_string("log") , NGX_HTTP_METRICS_RECORD_LOG },
+	{ ngx_null_string , 0 }
+};
 
-static pthread_rwlock_t rwlock;
+static ngx_conf_enum_t ngx_http_metrics_uris[] = {
+	{ ngx_string("normalized") , NGX_HTTP_METRICS_URI_NORMALIZED },
+	{ ngx_string("original") , NGX_HTTP_METRICS_URI_ORIGINAL },
+	{ ngx_null_string , 0 }
+};
 
 static ngx_command_t  ngx_http_metrics_filter_commands[] = {
     { 
@@ -57,27 +168,148 @@ static ngx_command_t  ngx_http_metrics_filter_commands[] = {
         offsetof(ngx_http_metrics_filter_conf_t , enable),
         NULL
     },
+    {
+    	ngx_string("metrics_topk"),
+    	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_FLAG,
+    	ngx_conf_set_flag_slot,
+    	NGX_HTTP_LOC_CONF_OFFSET,
+    	offsetof(ngx_http_metrics_filter_conf_t , topk),
+    	NULL
+    },
+    {
+    	ngx_string("metrics_record"),
+    	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+    	ngx_conf_set_enum_slot,
+    	NGX_HTTP_LOC_CONF_OFFSET,
+    	offsetof(ngx_http_metrics_filter_conf_t , record),
+    	&ngx_http_metrics_record_phases
+    },
+    {
+    	ngx_string("metrics_uri"),
+    	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+    	ngx_conf_set_enum_slot,
+    	NGX_HTTP_LOC_CONF_OFFSET,
+    	offsetof(ngx_http_metrics_filter_conf_t , uri),
+    	&ngx_http_metrics_uris
+    },
+    {
+    	ngx_string("metrics_subrequests"),
+    	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_FLAG,
+    	ngx_conf_set_flag_slot,
+    	NGX_HTTP_LOC_CONF_OFFSET,
+    	offsetof(ngx_http_metrics_filter_conf_t , subrequests),
+    	NULL
+    },
+    {
+    	ngx_string("metrics"),
+    	NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+    	ngx_http_metrics_slot,
+    	NGX_HTTP_LOC_CONF_OFFSET,
+    	0,
+    	NULL
+    },
+    {
+    	ngx_string("metrics_map"),
+    	NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE12,
+    	ngx_http_metrics_map,
+    	NGX_HTTP_MAIN_CONF_OFFSET,
+    	0,
+    	NULL
+    },
+    {
+    	ngx_string("metrics_label"),
+    	NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE2,
+    	ngx_http_metrics_label,
+    	NGX_HTTP_MAIN_CONF_OFFSET,
+    	0,
+    	NULL
+    },
+    {
+    	ngx_string("metrics_heavy_key"),
+    	NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE1,
+    	ngx_http_set_complex_value_slot,
+    	NGX_HTTP_MAIN_CONF_OFFSET,
+    	offsetof(ngx_http_metrics_main_conf_t , heavy_key),
+    	NULL
+    },
+    {
+    	ngx_string("metrics_trace"),
+    	NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_CONF_TAKE12,
+    	ngx_http_metrics_trace,
+    	NGX_HTTP_LOC_CONF_OFFSET,
+    	0,
+    	NULL
+    },
     ngx_null_command
 };
 
-static ngx_int_t ngx_http_init_metrics_map(ngx_log_t * log);
-static int ngx_http_get_metrics_index_by_url_code(u_char * url , int code , ngx_log_t * log);
+static void * ngx_http_metrics_create_main_conf(ngx_conf_t * cf);
+static char * ngx_http_metrics_init_main_conf(ngx_conf_t * cf , void * conf);
+static ngx_int_t ngx_http_metrics_filter_init_process(ngx_cycle_t * cycle);
+static void ngx_http_metrics_map_check_handler(ngx_event_t * ev);
+static ngx_int_t ngx_http_load_metrics_map(ngx_http_metrics_main_conf_t * mmcf , ngx_log_t * log);
+static void ngx_http_free_metrics_map(ngx_http_metrics_map_t * map);
+static int ngx_http_get_metrics_index_by_url_code(u_char * url , size_t len , int code , ngx_log_t * log);
+static ngx_http_metrics_matcher_t * ngx_http_compile_metrics_map(ngx_http_metrics_map_t * map , ngx_log_t * log);
+static ngx_int_t ngx_http_publish_metrics_map(ngx_log_t * log);
+static void ngx_http_reclaim_metrics_map(void);
+static int ngx_http_metrics_status(char * status);
+static int ngx_http_metrics_match(ngx_http_metrics_matcher_t * m , u_char * url , size_t len , int code , ngx_log_t * log);
+#if (NGX_PCRE)
+static ngx_int_t ngx_http_metrics_compile_regex(ngx_http_metrics_matcher_t * m , ngx_http_metrics_map_t * map ,
+	uint32_t * pattern , ngx_uint_t nregex , ngx_log_t * log);
+static ngx_int_t ngx_http_metrics_check_regex(ngx_pool_t * pool , u_char * url , ngx_log_t * log);
+static void ngx_http_metrics_pcre_malloc_init(ngx_pool_t * pool);
+static void ngx_http_metrics_pcre_malloc_done(void);
+static void * ngx_libc_cdecl ngx_http_metrics_pcre_malloc(size_t size);
+static void ngx_libc_cdecl ngx_http_metrics_pcre_free(void * p);
+static void ngx_http_metrics_free_study(void * data);
+static uint32_t ngx_http_metrics_match_regex(ngx_http_metrics_matcher_t * m , u_char * url , size_t len , int * index ,
+	uint32_t best , ngx_log_t * log);
+#endif
 static ngx_int_t ngx_http_metrics_filter_post_conf(ngx_conf_t * conf);
 static void * ngx_http_metrics_filter_create_conf(ngx_conf_t *cf);
 static char * ngx_http_metrics_filter_merge_conf(ngx_conf_t *cf,void*parent,void*child);
+static ngx_int_t ngx_http_metrics_add_variables(ngx_conf_t * cf);
+static ngx_int_t ngx_http_metrics_rate_variable(ngx_http_request_t * r , ngx_http_variable_value_t * v , uintptr_t data);
+
+/* the data of a rate variable is the word of the moving averages it reads */
+
+static ngx_http_variable_t ngx_http_metrics_variables[] = {
+	{ ngx_string("metrics_rate_1m") , NULL , ngx_http_metrics_rate_variable , NGX_METRICS_RATE_REQUESTS ,
+		NGX_HTTP_VAR_NOCACHEABLE , 0 },
+	{ ngx_string("metrics_rate_5m") , NULL , ngx_http_metrics_rate_variable , NGX_METRICS_RATE_REQUESTS + 1 ,
+		NGX_HTTP_VAR_NOCACHEABLE , 0 },
+	{ ngx_string("metrics_rate_15m") , NULL , ngx_http_metrics_rate_variable , NGX_METRICS_RATE_REQUESTS + 2 ,
+		NGX_HTTP_VAR_NOCACHEABLE , 0 },
+	{ ngx_string("metrics_latency_1m") , NULL , ngx_http_metrics_rate_variable , NGX_METRICS_RATE_TIME ,
+		NGX_HTTP_VAR_NOCACHEABLE , 0 },
+	{ ngx_string("metrics_latency_5m") , NULL , ngx_http_metrics_rate_variable , NGX_METRICS_RATE_TIME + 1 ,
+		NGX_HTTP_VAR_NOCACHEABLE , 0 },
+	{ ngx_string("metrics_latency_15m") , NULL , ngx_http_metrics_rate_variable , NGX_METRICS_RATE_TIME + 2 ,
+		NGX_HTTP_VAR_NOCACHEABLE , 0 },
+	{ ngx_null_string , NULL , NULL , 0 , 0 , 0 }
+};
 static ngx_int_t ngx_http_metrics_filter_body_filter(ngx_http_request_t *r, ngx_chain_t *in);
 static ngx_int_t ngx_http_metrics_filter_header_filter(ngx_http_request_t *r);
-static ngx_int_t ngx_http_metrics_filter_init_module(ngx_cycle_t * cycle);
-static ngx_int_t ngx_initialize_metrics(ngx_log_t * log);
-static ngx_int_t ngx_http_delete_metrics(u_char * url , int code , ngx_log_t * log);
+static ngx_int_t ngx_http_metrics_log_handler(ngx_http_request_t * r);
+static void ngx_http_metrics_account_labels(ngx_http_request_t * r , ngx_array_t * labels);
+static uint32_t ngx_http_metrics_client_hash(ngx_connection_t * c);
+static void ngx_http_metrics_account_heavy(ngx_http_request_t * r , ngx_http_complex_value_t * key , ngx_uint_t slot);
+static int ngx_http_metrics_record(ngx_http_request_t * r , ngx_http_metrics_filter_conf_t * mfcf , ngx_uint_t status);
+static ngx_int_t ngx_http_metrics_trace_handler(ngx_http_request_t * r);
+static void ngx_http_metrics_trace_cleanup(void * data);
+static ngx_http_metrics_ctx_t * ngx_http_metrics_get_ctx(ngx_http_request_t * r);
+static void ngx_http_metrics_trace_point(ngx_http_request_t * r , ngx_uint_t point);
+static void ngx_http_metrics_add_trace(ngx_http_request_t * r , ngx_http_metrics_ctx_t * ctx , ngx_msec_t ms);
+static ngx_msec_t ngx_http_metrics_elapsed(ngx_http_request_t * r);
 static ngx_int_t ngx_http_add_metrics(u_char * url , int code , int index , ngx_log_t * log);
-static ngx_int_t ngx_http_update_metrics(u_char * url , int code , int index , ngx_log_t * log);
 
 static ngx_http_module_t  ngx_http_metrics_filter_module_ctx = {
-    NULL,                                  /* preconfiguration */
+    ngx_http_metrics_add_variables,        /* preconfiguration */
     ngx_http_metrics_filter_post_conf,     /* postconfiguration */
-    NULL,                                  /* create main configuration */
-    NULL,                                  /* init main configuration */
+    ngx_http_metrics_create_main_conf,     /* create main configuration */
+    ngx_http_metrics_init_main_conf,       /* init main configuration */
     NULL,                                  /* create server configuration */
     NULL,                                  /* merge server configuration */
     ngx_http_metrics_filter_create_conf,   /* create location configuration */
@@ -90,8 +322,8 @@ ngx_module_t ngx_http_metrics_filter_modules = {
     ngx_http_metrics_filter_commands,            /* module directives */
     NGX_HTTP_MODULE,                       		 /* module type */
     NULL,         						   		 /* init master */
-    ngx_http_metrics_filter_init_module,         /* init module */
-    NULL,             					   		 /* init process */
+    NULL,                                        /* init module */
+    ngx_http_metrics_filter_init_process,        /* init process */
     NULL,                                  		 /* init thread */
     NULL,                                  		 /* exit thread */
     NULL,             					   		 /* exit process */
@@ -99,170 +331,147 @@ ngx_module_t ngx_http_metrics_filter_modules = {
     NGX_MODULE_V1_PADDING
 };
 
-static ngx_int_t ngx_http_delete_metrics(u_char * url , int code , ngx_log_t * log) {
-	if (-1 == pthread_rwlock_wrlock(&rwlock)) {
-		return NGX_ABORT;
-	}
-
-	ngx_http_metrics_map_t * header = status_code_map;
-	ngx_http_metrics_map_t * pre_hdr = header;
-	while (header != NULL) {
-		if (ngx_strstr(url , header->url) != 0) {
-			ngx_http_status_code_map_t * sc_map = header->status_code;
-			ngx_http_status_code_map_t * pre_sc_map = sc_map;
-			while (sc_map != NULL) {
-				if (sc_map->code == code) {
-					if (sc_map == header->status_code) {
-						if (header->status_code->next == NULL) {
-							header->status_code = NULL;
-						} else {
-							header->status_code = sc_map->next;
-						}
-					} else {
-						pre_sc_map->next = sc_map->next;
-					}
-
-					(void)free(sc_map);
-
-					if (header->status_code == NULL) {
-						if (status_code_map == header) {
-							status_code_map = header->next;
-						} else {
-							pre_hdr->next = header->next;
-						}
-						
-						(void)free(header);
-					}
-				
-					if (-1 == pthread_rwlock_unlock(&rwlock)) {
-						return NGX_ABORT;
-					}
-
-					ngx_log_error(NGX_LOG_INFO , log , 0 , "DEL->[uri:%s] [status:%d]" , url , code);
-					
-					return NGX_OK;
-				}
+/*
+ * A batch load hashes the uris it has read so far, so that a large map
+ * loads in linear time; single additions walk the list.
+ */
 
-				pre_sc_map = sc_map;
-				sc_map = sc_map->next;
-			}
+static ngx_http_metrics_map_t * ngx_http_find_metrics(u_char * url) {
+	ngx_http_metrics_map_t * header;
+
+	if (metrics_batch_hash != NULL) {
+		header = metrics_batch_hash[ngx_murmur_hash2(url , ngx_strlen(url)) & metrics_batch_mask];
+		while (header != NULL && ngx_strcmp(url , header->url) != 0) {
+			header = header->hnext;
 		}
 
-		pre_hdr = header;
-		header = header->next;
-	}	
+		return header;
+	}
 
-	if (-1 == pthread_rwlock_unlock(&rwlock)) {
-		return NGX_ABORT;
+	header = status_code_map;
+	while (header != NULL && ngx_strcmp(url , header->url) != 0) {
+		header = header->next;
 	}
-	
-	return NGX_OK;
+
+	return header;
 }
 
 static ngx_int_t ngx_http_add_metrics(u_char * url , int code , int index , ngx_log_t * log) {
-	if (ngx_http_get_metrics_index_by_url_code(url , code , log) >= 0) {
+	if (url[0] == '\0') {
 		return NGX_OK;
 	}
 
-	if (-1 == pthread_rwlock_wrlock(&rwlock)) {
-		return NGX_ABORT;
-	}
-
 	ngx_http_status_code_map_t * status_code = 
 			(ngx_http_status_code_map_t *)malloc(sizeof(ngx_http_status_code_map_t));
+	if (status_code == NULL) {
+		return NGX_ERROR;
+	}
 
 	status_code->code = code;
 	status_code->index = index;
 	status_code->next = NULL;
 
-	ngx_http_metrics_map_t * header = status_code_map;
-	while (header != NULL) {
-		if (ngx_strstr(url , header->url) != 0) {
-			status_code->next = header->status_code;
-			header->status_code = status_code;
+	ngx_http_metrics_map_t * header = ngx_http_find_metrics(url);
+	if (header != NULL) {
+		ngx_http_status_code_map_t * sc_map = header->status_code;
+		while (sc_map != NULL) {
+			if (sc_map->code == code) {
+				(void)free(status_code);
 
-			if (-1 == pthread_rwlock_unlock(&rwlock)) {
-				return NGX_ABORT;
+				return NGX_OK;
 			}
 
-			ngx_log_error(NGX_LOG_INFO , log , 0 , "ADD->[uri:%s] [status:%d]" , url , code);
+			sc_map = sc_map->next;
+		}
 
-			return NGX_OK;
- 		}
-		
-		header = header->next;
+		status_code->next = header->status_code;
+		header->status_code = status_code;
+
+		ngx_log_error(NGX_LOG_INFO , log , 0 , "ADD->[uri:%s] [status:%d]" , url , code);
+
+		return ngx_http_publish_metrics_map(log);
 	}
 
 	if (header == NULL) {
 		ngx_http_metrics_map_t * sc_map = (ngx_http_metrics_map_t *)malloc(sizeof(ngx_http_metrics_map_t));
+		if (sc_map == NULL || ngx_strlen(url) >= MAX_URL_CONFIG_SIZE) {
+			ngx_log_error(NGX_LOG_ERR , log , 0 , "cannot add metrics uri \"%s\"" , url);
+
+			(void)free(sc_map);
+			(void)free(status_code);
+
+			return NGX_ERROR;
+		}
+
 		sc_map->status_code = status_code;
 
 		sc_map->url = malloc(MAX_URL_CONFIG_SIZE);
+		if (sc_map->url == NULL) {
+			(void)free(sc_map);
+			(void)free(status_code);
+
+			return NGX_ERROR;
+		}
+
 		ngx_memset(sc_map->url , 0x00 , MAX_URL_CONFIG_SIZE);
 		ngx_memcpy(sc_map->url , url , ngx_strlen(url));
 		sc_map->next = status_code_map;
 		status_code_map = sc_map;
-	}
-	
-	if (-1 == pthread_rwlock_unlock(&rwlock)) {
-		return NGX_ABORT;
+		sc_map->hnext = NULL;
+
+		if (metrics_batch_hash != NULL) {
+			ngx_uint_t key = ngx_murmur_hash2(url , ngx_strlen(url)) & metrics_batch_mask;
+
+			sc_map->hnext = metrics_batch_hash[key];
+			metrics_batch_hash[key] = sc_map;
+		}
 	}
 
 	ngx_log_error(NGX_LOG_INFO , log , 0 , "ADD->[uri:%s] [status:%d]" , url , code);
 	
-	return NGX_OK;
+	return ngx_http_publish_metrics_map(log);
 }
 
-static ngx_int_t ngx_http_update_metrics(u_char * url , int code , int index , ngx_log_t * log){
-	if (-1 == pthread_rwlock_wrlock(&rwlock)) {
-		return NGX_ABORT;
-	}
-
-	ngx_http_metrics_map_t * header = status_code_map;
-	while (header != NULL) {
-		ngx_log_error(NGX_LOG_INFO , log , 0 , "UPDATE->[uri:%s] [status:%d] [pattern:%s]" , 
-			url , code , header->url);
-		if (ngx_strstr(url , header->url) != 0) {
-			ngx_http_status_code_map_t * sc_map = header->status_code;
-			while (sc_map != NULL) {
-				if (sc_map->code == code) {
-					sc_map->index = index;
-				
-					if (-1 == pthread_rwlock_unlock(&rwlock)) {
-						return NGX_ABORT;
-					}
-					
-					return NGX_OK;
-				}
+/*
+ * Reads the whole file into a new map and publishes it as one snapshot.
+ * The current map stays in use if the file cannot be read.
+ */
 
-				sc_map = sc_map->next;
-			}
-		}
+static ngx_int_t ngx_http_load_metrics_map(ngx_http_metrics_main_conf_t * mmcf , ngx_log_t * log) {
+	ngx_http_metrics_map_t * old = status_code_map;
+	ngx_file_info_t fi;
+	ngx_int_t rc = NGX_OK;
 
-		header = header->next;
-	}	
+	FILE *fp = fopen((char *)mmcf->file.data , "r");
+	if (fp == NULL || ngx_fd_info(fileno(fp) , &fi) == NGX_FILE_ERROR) {
+		ngx_log_error(NGX_LOG_ERR , log , ngx_errno , "cannot read metrics map \"%V\"" , &mmcf->file);
 
-	if (-1 == pthread_rwlock_unlock(&rwlock)) {
-		return NGX_ABORT;
+		if (fp != NULL) {
+			fclose(fp);
+		}
+
+		return NGX_ERROR;
 	}
-	
-	return NGX_OK;
 
-}
+	metrics_map_uniq = ngx_file_uniq(&fi);
+	metrics_map_mtime = ngx_file_mtime(&fi);
+	metrics_map_size = ngx_file_size(&fi);
 
-static ngx_int_t ngx_http_init_metrics_map(ngx_log_t * log) {
-	char * env = getenv("NGX_METRICS_DEFINE_FILE");
-	if (env == 0) {
-		env = "metrics.idx";
-	}
+	/* the whole file is one batch, published as a single snapshot */
 
-	FILE *fp = fopen(env , "r");
-	if (fp == NULL) {
-		ngx_log_error(NGX_LOG_ERR , log , 0 , "errno:%d" , errno);
+	status_code_map = NULL;
+	metrics_batch = 1;
 
-		return NGX_ABORT;
+	/* about one bucket per line, with the lines assumed 32 bytes long */
+
+	metrics_batch_mask = 64;
+	while (metrics_batch_mask < (ngx_uint_t)(metrics_map_size / 32)) {
+		metrics_batch_mask <<= 1;
 	}
 
+	metrics_batch_hash = ngx_calloc(metrics_batch_mask * sizeof(ngx_http_metrics_map_t *) , log);
+	metrics_batch_mask--;
+
 	char buffer[MAX_LINE_BUFFER] = {0};
 	while (fgets(buffer , MAX_LINE_BUFFER , fp) != NULL) {
 		
@@ -284,237 +493,1878 @@ static ngx_int_t ngx_http_init_metrics_map(ngx_log_t * log) {
 			(void)strcpy(status , token);
 		}
 
-		ngx_http_add_metrics((u_char *)url , atoi(status) , atoi(index) , log);
-		ngx_http_update_metrics((u_char *)url , atoi(status) , atoi(index) , log);
-		ngx_http_delete_metrics((u_char *)url , atoi(status) , log);
-		ngx_http_add_metrics((u_char *)url , atoi(status) , atoi(index) , log);
+		rc = ngx_http_add_metrics((u_char *)url , ngx_http_metrics_status(status) , atoi(index) , log);
+		if (rc != NGX_OK) {
+			break;
+		}
 	}
 
-	if (fp != NULL) {
-		fclose(fp);
-		fp = NULL;
-	}	
-	
+	fclose(fp);
+	fp = NULL;
+
+	metrics_batch = 0;
+
+	if (metrics_batch_hash != NULL) {
+		ngx_free(metrics_batch_hash);
+		metrics_batch_hash = NULL;
+	}
+
+	/* no lookup can be running here, in the master or in a worker's timer */
+
+	ngx_http_reclaim_metrics_map();
+
+	if (rc != NGX_OK || ngx_http_publish_metrics_map(log) != NGX_OK) {
+		ngx_http_free_metrics_map(status_code_map);
+		status_code_map = old;
+
+		return NGX_ERROR;
+	}
+
+	ngx_http_free_metrics_map(old);
+
 	return NGX_OK;
 }
 
-static int ngx_http_get_metrics_index_by_url_code(u_char * url , int code , ngx_log_t * log) {
-	if (-1 == pthread_rwlock_rdlock(&rwlock)) {
-		return NGX_ABORT;
-	}
+static void ngx_http_free_metrics_map(ngx_http_metrics_map_t * map) {
+	ngx_http_metrics_map_t * header;
+	ngx_http_status_code_map_t * sc_map;
 
-	ngx_http_metrics_map_t * header = status_code_map;
-	while (header != NULL) {
-		if (ngx_strstr(url , header->url) != 0) {
-			ngx_http_status_code_map_t * sc_map = header->status_code;
-			while (sc_map != NULL) {
-				if (sc_map->code == code) {
-					if (-1 == pthread_rwlock_unlock(&rwlock)) {
-						return NGX_ABORT;
-					}
-					return sc_map->index;
-				}
-						
-				sc_map = sc_map->next;
-			}
+	while (map != NULL) {
+		header = map;
+		map = map->next;
+
+		while (header->status_code != NULL) {
+			sc_map = header->status_code;
+			header->status_code = sc_map->next;
+			(void)free(sc_map);
 		}
-		
-		header = header->next;
-	}
 
-	if (-1 == pthread_rwlock_unlock(&rwlock)) {
-		return NGX_ABORT;
+		(void)free(header->url);
+		(void)free(header);
 	}
-	
-	return NGX_ERROR;
 }
 
-static void * collector(void * args) {
-	ngx_log_t * log = (ngx_log_t *)args;
+static ngx_int_t ngx_http_publish_metrics_map(ngx_log_t * log) {
+	ngx_http_metrics_matcher_t * snapshot , * old;
 
-	char ip[MAX_LINE_BUFFER] = {0};
-	char * env = getenv("NGX_METRICS_COLLECTOR_IP");
-	if (env != NULL) {
-		(void)strcpy(ip , env);
-	} else {
-		return 0;
+	if (metrics_batch) {
+		return NGX_OK;
 	}
 
-	int port = -1;
-	env = getenv("NGX_METRICS_COLLECTOR_PORT");
-	if (env == NULL) {
-		return 0;
-	} else {
-		port = atoi(env);
+	snapshot = ngx_http_compile_metrics_map(status_code_map , log);
+	if (snapshot == NULL) {
+		return NGX_ERROR;
 	}
-	
-	bzero(&addr , sizeof(addr));
-	addr.sin_family = AF_INET;  
-    addr.sin_addr.s_addr = inet_addr(ip);  
-    addr.sin_port = htons(port);
-
-	udp_svr_socket = socket(AF_INET , SOCK_DGRAM , 0);
-	if (udp_svr_socket == -1) {
-		ngx_log_error(NGX_LOG_ERR , log , 0 , "create udp socket failed." );
-		
-		return 0;
+
+	old = metrics_snapshot;
+	snapshot->version = (old == NULL) ? 1 : old->version + 1;
+
+	/* the snapshot must be complete before readers can reach it */
+
+	ngx_memory_barrier();
+
+	metrics_snapshot = snapshot;
+
+	if (old != NULL) {
+		old->retired = metrics_retired;
+		metrics_retired = old;
 	}
 
-	int is_e = 0;
-	struct stat buf;
-	if (stat("metrics.dat" , &buf) == -1) {
-		is_e = 1;
+	ngx_log_error(NGX_LOG_INFO , log , 0 , "metrics map v%ui: %ui patterns, %ui states, %ui codes" , 
+		snapshot->version , snapshot->npatterns , snapshot->nstates , snapshot->ncodes);
+
+	return NGX_OK;
+}
+
+/*
+ * Snapshots are only read by the worker's own event loop, and a lookup
+ * never outlives the header filter call, so retired snapshots are freed
+ * at the start of the next call where no reader can still hold one.
+ */
+
+static void ngx_http_reclaim_metrics_map(void) {
+	ngx_http_metrics_matcher_t * retired;
+
+	while (metrics_retired != NULL) {
+		retired = metrics_retired;
+		metrics_retired = retired->retired;
+
+#if (NGX_PCRE)
+		if (retired->pool != NULL) {
+			ngx_destroy_pool(retired->pool);
+		}
+#endif
+
+		ngx_free(retired);
 	}
+}
 
-	if (fd == -1) {
-		fd = open("metrics.dat" , O_RDWR | O_CREAT);
-		if (fd == -1) {
-			ngx_log_error(NGX_LOG_ERR , log , 0 , "open file failed.%s" , strerror(errno));
-				
-			return NULL;
+static ngx_http_metrics_matcher_t * ngx_http_compile_metrics_map(ngx_http_metrics_map_t * map , ngx_log_t * log) {
+	u_char class[256];
+	int16_t column[NGX_HTTP_METRICS_MAX_STATUS];
+	int16_t status_class[NGX_HTTP_METRICS_NCLASSES];
+	u_char * p;
+	uint32_t * next , * fail , * output , * link , * queue , * pattern , * child , * sibling , * edge , * tmp , * e , s , t;
+	ngx_uint_t i , c , n , nclasses , ncodes , nstates , npatterns , nregex , maxstates , head , tail;
+	ngx_int_t code;
+	size_t size;
+	int * index;
+	ngx_http_metrics_map_t * header;
+	ngx_http_status_code_map_t * sc_map;
+	ngx_http_metrics_matcher_t * m;
+
+	ngx_memzero(class , sizeof(class));
+	ngx_memset(column , 0xff , sizeof(column));
+	ngx_memset(status_class , 0xff , sizeof(status_class));
+
+	n = 0;
+	nclasses = NGX_HTTP_METRICS_ANCHOR + 1;
+	ncodes = 0;
+	nregex = 0;
+	maxstates = 1;
+
+	for (header = map; header != NULL; header = header->next) {
+		n++;
+
+		for (sc_map = header->status_code; sc_map != NULL; sc_map = sc_map->next) {
+			code = sc_map->code;
+
+			if (code >= 0 && code < NGX_HTTP_METRICS_MAX_STATUS && column[code] == -1) {
+				column[code] = (int16_t)ncodes++;
+
+			} else if (code >= NGX_HTTP_METRICS_CLASS(0) && code < NGX_HTTP_METRICS_CLASS(NGX_HTTP_METRICS_NCLASSES)
+				&& status_class[code - NGX_HTTP_METRICS_MAX_STATUS] == -1)
+			{
+				status_class[code - NGX_HTTP_METRICS_MAX_STATUS] = (int16_t)ncodes++;
+			}
+		}
+
+		if (header->url[0] == '~') {
+			nregex++;
+			continue;
 		}
 
-		if (is_e == 1) {
-			int init = 0;
-			write(fd , &init , MAX_METRICS_NUM * 4);
+		for (p = header->url + (header->url[0] == '^'); *p != '\0'; p++) {
+			if (class[*p] == 0) {
+				class[*p] = (u_char)nclasses++;
+			}
 		}
-	}	
 
-	mem_ptr = (char *)mmap(0 , MAX_METRICS_NUM * 4 , PROT_READ | PROT_WRITE , MAP_SHARED , fd , 0);
-	if (mem_ptr == MAP_FAILED) {
-		close(fd);
-		fd = -1;
+		maxstates += p - header->url;
 	}
-	
-	if (is_e == 1) {
-		(void)memset(mem_ptr , 0x00 , MAX_METRICS_NUM * 4);
-	}
-
-	while (NGX_TRUE) {	
-		sleep(NGX_COLLECT_INTERVAL);
-
-		int i = 0;
-		for (;i < MAX_METRICS_NUM;i ++) {
-			if (udp_svr_socket != -1) {
-				ngx_log_error(NGX_LOG_INFO , log , 0 , "counter:%s_%d_%d" , domain_name , *((int *)(mem_ptr + i * 4)) , i);
-				if (*((int *)(mem_ptr + i * 4))  > 0) {
-					char data[MAX_LINE_BUFFER] = {0};
-					(void)sprintf(data , "%s_%d_%d_%d" , domain_name , *((int *)(mem_ptr + i * 4)) , i , (int)time(0));
-					if (-1 == sendto(udp_svr_socket , data , 
-						sizeof(data) , 0 , (struct sockaddr *)&addr , sizeof(addr))) {
-						ngx_log_error(NGX_LOG_ERR , log , 0 , "%s" , "send to server failed, %s" , data);	
-					} else {
-						ngx_log_error(NGX_LOG_DEBUG , log , 0 , "send to server[%s:%d] successfully. %s" , 
-							ip , port , data);
-					}
-				}
+
+	/* the codes without a column of their own share the one of their class */
+
+	for (c = 0; c < NGX_HTTP_METRICS_MAX_STATUS; c++) {
+		if (column[c] == -1) {
+			column[c] = status_class[c / 100];
+		}
+	}
+
+	/*
+	 * the trie is built sparse first, the children of a state in a list
+	 * ended by 0, so that only its states, not the bound on them, get a
+	 * row of the dense transition table
+	 */
+
+	tmp = ngx_alloc((maxstates * 6 + n + 1) * sizeof(uint32_t) , log);
+	if (tmp == NULL) {
+		return NULL;
+	}
+
+	child = tmp;
+	sibling = child + maxstates;
+	edge = sibling + maxstates;
+	output = edge + maxstates;
+	fail = output + maxstates;
+	queue = fail + maxstates;
+	pattern = queue + maxstates;
+
+	nstates = 1;
+	npatterns = 0;
+	child[0] = 0;
+	output[0] = NGX_HTTP_METRICS_NO_PATTERN;
+
+	for (header = map, i = 0; header != NULL; header = header->next, i++) {
+		if (header->url[0] == '~') {
+#if (NGX_PCRE)
+			pattern[i] = (uint32_t)npatterns++;
+#else
+			ngx_log_error(NGX_LOG_WARN , log , 0 , "metrics map pattern \"%s\" needs PCRE, ignored" , header->url);
+			pattern[i] = NGX_HTTP_METRICS_NO_PATTERN;
+#endif
+			continue;
+		}
+
+		s = 0;
+
+		for (p = header->url; *p != '\0'; p++) {
+			c = (p == header->url && *p == '^') ? NGX_HTTP_METRICS_ANCHOR : class[*p];
+
+			for (t = child[s]; t != 0 && edge[t] != c; t = sibling[t]) { /* void */ }
+
+			if (t == 0) {
+				t = (uint32_t)nstates++;
+				child[t] = 0;
+				edge[t] = (uint32_t)c;
+				sibling[t] = child[s];
+				child[s] = t;
+				output[t] = NGX_HTTP_METRICS_NO_PATTERN;
 			}
+
+			s = t;
 		}
 
-		(void)memset(mem_ptr , 0x00 , MAX_METRICS_NUM * 4);
+		if (s == 0) {
+			pattern[i] = NGX_HTTP_METRICS_NO_PATTERN;
+			continue;
+		}
+
+		if (output[s] == NGX_HTTP_METRICS_NO_PATTERN) {
+			output[s] = (uint32_t)npatterns++;
+		}
+
+		pattern[i] = output[s];
 	}
 
-	if (fd != -1) {
-		close(fd);
-		fd = -1;
+	size = sizeof(ngx_http_metrics_matcher_t) 
+		+ nstates * nclasses * sizeof(uint32_t) 
+		+ nstates * 2 * sizeof(uint32_t) 
+		+ npatterns * ncodes * sizeof(int);
+
+	m = ngx_alloc(size , log);
+	if (m == NULL) {
+		ngx_free(tmp);
+
+		return NULL;
 	}
-	
-	(void)munmap(mem_ptr , MAX_METRICS_NUM * 4);
 
-	if (udp_svr_socket != -1) {
-		close(udp_svr_socket);
-		udp_svr_socket = -1;
+	m->version = 0;
+	m->retired = NULL;
+	m->nstates = nstates;
+	m->nclasses = nclasses;
+	m->npatterns = npatterns;
+	m->ncodes = ncodes;
+	ngx_memcpy(m->class , class , sizeof(class));
+	ngx_memcpy(m->column , column , sizeof(column));
+
+#if (NGX_PCRE)
+	m->pool = NULL;
+	m->nregex = 0;
+
+	if (nregex && ngx_http_metrics_compile_regex(m , map , pattern , nregex , log) != NGX_OK) {
+		if (m->pool != NULL) {
+			ngx_destroy_pool(m->pool);
+		}
+
+		ngx_free(m);
+		ngx_free(tmp);
+
+		return NULL;
 	}
-	
-	return 0;
+#endif
+
+	m->next = (uint32_t *)(m + 1);
+	m->output = m->next + nstates * nclasses;
+	m->link = m->output + nstates;
+	m->index = (int *)(m->link + nstates);
+
+	/* the dense table: 0 in it means "no edge" until it is filled */
+
+	next = m->next;
+	link = m->link;
+
+	ngx_memzero(next , nstates * nclasses * sizeof(uint32_t));
+
+	for (s = 0; s < nstates; s++) {
+		for (t = child[s]; t != 0; t = sibling[t]) {
+			next[s * nclasses + edge[t]] = t;
+		}
+	}
+
+	/* breadth-first: failure links, output links and the missing transitions */
+
+	fail[0] = 0;
+	link[0] = 0;
+	head = 0;
+	tail = 0;
+
+	for (c = 0; c < nclasses; c++) {
+		s = next[c];
+		if (s != 0) {
+			fail[s] = 0;
+			link[s] = 0;
+			queue[tail++] = s;
+		}
+	}
+
+	while (head < tail) {
+		s = queue[head++];
+
+		for (c = 0; c < nclasses; c++) {
+			e = &next[s * nclasses + c];
+			if (*e == 0) {
+				*e = next[fail[s] * nclasses + c];
+				continue;
+			}
+
+			fail[*e] = next[fail[s] * nclasses + c];
+			link[*e] = (output[fail[*e]] != NGX_HTTP_METRICS_NO_PATTERN) ? fail[*e] : link[fail[*e]];
+			queue[tail++] = *e;
+		}
+	}
+
+	ngx_memcpy(m->output , output , nstates * sizeof(uint32_t));
+	ngx_memset(m->index , 0xff , npatterns * ncodes * sizeof(int));
+
+	for (header = map, i = 0; header != NULL; header = header->next, i++) {
+		if (pattern[i] == NGX_HTTP_METRICS_NO_PATTERN) {
+			continue;
+		}
+
+		index = &m->index[pattern[i] * ncodes];
+
+		/* the codes first, then the classes for the codes they leave */
+
+		for (sc_map = header->status_code; sc_map != NULL; sc_map = sc_map->next) {
+			if (sc_map->code >= 0 && sc_map->code < NGX_HTTP_METRICS_MAX_STATUS && index[column[sc_map->code]] == -1) {
+				index[column[sc_map->code]] = sc_map->index;
+			}
+		}
+
+		for (sc_map = header->status_code; sc_map != NULL; sc_map = sc_map->next) {
+			code = sc_map->code - NGX_HTTP_METRICS_MAX_STATUS;
+			if (code < 0 || code >= NGX_HTTP_METRICS_NCLASSES) {
+				continue;
+			}
+
+			for (c = code * 100; c < (ngx_uint_t)code * 100 + 100; c++) {
+				if (column[c] != -1 && index[column[c]] == -1) {
+					index[column[c]] = sc_map->index;
+				}
+			}
+		}
+	}
+
+	ngx_free(tmp);
+
+	return m;
 }
 
-static ngx_int_t ngx_initialize_metrics(ngx_log_t * log) {
-	char * env = getenv("NGX_METRICS_DOMAIN");
-	if (env == NULL || strlen(env) > 512) {
-		(void)strcpy(domain_name , "unknown");
-	} else {
-		(void)strcpy(domain_name , env);
+static int ngx_http_metrics_match(ngx_http_metrics_matcher_t * m , u_char * url , size_t len , int code , ngx_log_t * log) {
+	u_char * p , * last;
+	uint32_t s , o , best;
+	ngx_uint_t c;
+	int * index;
+
+	if (m == NULL || code < 0 || code >= NGX_HTTP_METRICS_MAX_STATUS || m->column[code] == -1) {
+		return NGX_ERROR;
 	}
 
-	pthread_t tid;
-	if (pthread_create(&tid , 0 , collector , log) == -1) {
-		ngx_log_error(NGX_LOG_ERR , log , 0 , "create collector thread failed." );
-		
-		return NGX_ABORT;
+	index = m->index + m->column[code];
+	best = NGX_HTTP_METRICS_NO_PATTERN;
+	s = 0;
+	c = NGX_HTTP_METRICS_ANCHOR;
+
+	for (p = url , last = url + len; /* void */ ; p++) {
+		s = m->next[s * m->nclasses + c];
+
+		o = (m->output[s] != NGX_HTTP_METRICS_NO_PATTERN) ? s : m->link[s];
+		while (o != 0) {
+			if (m->output[o] < best && index[m->output[o] * m->ncodes] != -1) {
+				best = m->output[o];
+			}
+
+			o = m->link[o];
+		}
+
+		if (p == last) {
+			break;
+		}
+
+		c = m->class[*p];
 	}
 
-	return NGX_OK;
+#if (NGX_PCRE)
+	best = ngx_http_metrics_match_regex(m , url , len , index , best , log);
+#endif
+
+	if (best == NGX_HTTP_METRICS_NO_PATTERN) {
+		return NGX_ERROR;
+	}
+
+	return index[best * m->ncodes];
+}
+
+static int ngx_http_get_metrics_index_by_url_code(u_char * url , size_t len , int code , ngx_log_t * log) {
+	return ngx_http_metrics_match(metrics_snapshot , url , len , code , log);
 }
 
-static ngx_int_t ngx_http_metrics_filter_init_module(ngx_cycle_t * cycle) {
-	ngx_log_error(NGX_LOG_INFO , cycle->log , 0 , "<initialize metrics filter module>");
+#if (NGX_PCRE)
+
+/*
+ * PCRE allocates through pcre_malloc, which the regex module points at a
+ * pool only while it compiles a regex of its own, so the map points it at
+ * the pool of the matcher while it compiles and studies its regexes.
+ */
 
-	return ngx_initialize_metrics(cycle->log);
+static void ngx_http_metrics_pcre_malloc_init(ngx_pool_t * pool) {
+	ngx_http_metrics_pcre_pool = pool;
+
+	ngx_http_metrics_old_pcre_malloc = pcre_malloc;
+	ngx_http_metrics_old_pcre_free = pcre_free;
+
+	pcre_malloc = ngx_http_metrics_pcre_malloc;
+	pcre_free = ngx_http_metrics_pcre_free;
 }
 
-static void* ngx_http_metrics_filter_create_conf(ngx_conf_t *cf){	
-    ngx_http_metrics_filter_conf_t  * mycf = (ngx_http_metrics_filter_conf_t  *)
-		ngx_pcalloc(cf->pool, sizeof(ngx_http_metrics_filter_conf_t));
-    if (mycf == NULL) {
-        return NULL;
-    }
+static void ngx_http_metrics_pcre_malloc_done(void) {
+	pcre_malloc = ngx_http_metrics_old_pcre_malloc;
+	pcre_free = ngx_http_metrics_old_pcre_free;
 
-    mycf->enable = NGX_CONF_UNSET;
-	
-    return mycf;
+	ngx_http_metrics_pcre_pool = NULL;
 }
 
-static char * ngx_http_metrics_filter_merge_conf(ngx_conf_t *cf,void*parent,void*child) {
-    ngx_http_metrics_filter_conf_t *prev = (ngx_http_metrics_filter_conf_t *)parent;
-    ngx_http_metrics_filter_conf_t *conf = (ngx_http_metrics_filter_conf_t *)child;
+static void * ngx_libc_cdecl ngx_http_metrics_pcre_malloc(size_t size) {
+	return ngx_http_metrics_pcre_pool != NULL ? ngx_palloc(ngx_http_metrics_pcre_pool , size) : NULL;
+}
 
-    ngx_conf_merge_value(conf->enable, prev->enable, 1);
+static void ngx_libc_cdecl ngx_http_metrics_pcre_free(void * p) {
+	return;
+}
 
-    return NGX_CONF_OK;
+static void ngx_http_metrics_free_study(void * data) {
+	ngx_regex_t * re = data;
+
+	if (re->extra != NULL) {
+		pcre_free_study(re->extra);
+	}
 }
 
-static ngx_int_t ngx_http_metrics_filter_header_filter(ngx_http_request_t *r) {
-	if (is_fork == 0) {
-		if (ngx_http_init_metrics_map(r->connection->log) != NGX_OK) {
-			return NGX_ABORT;
+/*
+ * Every regex pattern of the map is first compiled on its own: one that
+ * does not compile, or that refers to groups, which are numbered anew in
+ * the regex of the map, is ignored.  The others are lookaheads from the
+ * start of the uri that may fail, "(?:(?=.*?(?<metrics_K>regex))|)", in
+ * one regex whose match sets the group of each pattern found anywhere in
+ * the uri, and the earliest one in the map wins as for the other patterns.
+ * That is one call into PCRE per lookup, though it still scans the uri
+ * once for each pattern.  "~*" makes a pattern caseless.
+ */
+
+static ngx_int_t ngx_http_metrics_compile_regex(ngx_http_metrics_matcher_t * m , ngx_http_metrics_map_t * map ,
+	uint32_t * pattern , ngx_uint_t nregex , ngx_log_t * log)
+{
+	ngx_http_metrics_map_t * header;
+	ngx_pool_cleanup_t * cln;
+	ngx_pool_t * temp;
+	ngx_regex_t * re;
+	const char * errstr;
+	u_char * src , * p , * name;
+	ngx_uint_t i , k , caseless;
+	ngx_int_t n;
+	size_t len;
+	int erroff , captures , named , size , opt;
+
+	m->pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE , log);
+	if (m->pool == NULL) {
+		return NGX_ERROR;
+	}
+
+	len = sizeof("(?s)\\A");
+
+	for (header = map; header != NULL; header = header->next) {
+		if (header->url[0] == '~') {
+			len += sizeof("(?:(?=.*?(?<metrics_>(?i)))|)") - 1 + NGX_INT_T_LEN + ngx_strlen(header->url);
 		}
-		
-		if (fd == -1) {
-			fd = open("metrics.dat" , O_RDWR);
-			if (fd == -1) {
-				return NGX_ABORT;
-			}
+	}
+
+	src = ngx_pnalloc(m->pool , len);
+	m->regex_pattern = ngx_palloc(m->pool , nregex * sizeof(uint32_t));
+	m->regex_group = ngx_palloc(m->pool , nregex * sizeof(int));
+	temp = ngx_create_pool(NGX_DEFAULT_POOL_SIZE , log);
+	if (src == NULL || m->regex_pattern == NULL || m->regex_group == NULL || temp == NULL) {
+		if (temp != NULL) {
+			ngx_destroy_pool(temp);
 		}
 
-		mem_ptr = (char *)mmap(0 , MAX_METRICS_NUM * 4 , PROT_READ | PROT_WRITE , MAP_SHARED , fd , 0);
-		if (mem_ptr == MAP_FAILED) {
-			close(fd);
-			fd = -1;
+		return NGX_ERROR;
+	}
+
+	p = ngx_cpymem(src , "(?s)\\A" , sizeof("(?s)\\A") - 1);
+
+	for (header = map , i = 0 , k = 0; header != NULL; header = header->next , i++) {
+		if (header->url[0] != '~') {
+			continue;
+		}
 
-			return NGX_ABORT;
+		if (ngx_http_metrics_check_regex(temp , header->url , log) != NGX_OK) {
+			pattern[i] = NGX_HTTP_METRICS_NO_PATTERN;
+			continue;
 		}
 
-		is_fork = 1;
+		caseless = (header->url[1] == '*');
+
+		p = ngx_sprintf(p , "(?:(?=.*?(?<metrics_%ui>%s%s))|)" , k , caseless ? "(?i)" : "" , header->url + 1 + caseless);
+
+		m->regex_pattern[k] = pattern[i];
+		m->regex_group[k++] = -1;
 	}
 
-	int index = ngx_http_get_metrics_index_by_url_code(r->uri.data , r->headers_out.status , r->connection->log);	
-	if (index > MAX_METRICS_NUM || index == -1) {
-		return ngx_http_next_header_filter(r);
-	} else {
-		int * pos = (int *)(mem_ptr + index * 4);
-		*pos += 1;
+	ngx_destroy_pool(temp);
+
+	*p = '\0';
+
+	if (k == 0) {
+		return NGX_OK;
 	}
 
-    return ngx_http_next_header_filter(r);
-}
+	re = ngx_pcalloc(m->pool , sizeof(ngx_regex_t));
+	cln = ngx_pool_cleanup_add(m->pool , 0);
+	if (re == NULL || cln == NULL) {
+		return NGX_ERROR;
+	}
 
+	ngx_http_metrics_pcre_malloc_init(m->pool);
 
-static ngx_int_t ngx_http_metrics_filter_body_filter(ngx_http_request_t *r, ngx_chain_t *in) {
-    return ngx_http_next_body_filter(r, in);
-}
+	re->code = pcre_compile((const char *)src , 0 , &errstr , &erroff , NULL);
+
+	ngx_http_metrics_pcre_malloc_done();
+
+	if (re->code == NULL) {
+		ngx_log_error(NGX_LOG_ERR , log , 0 , "metrics map regex patterns ignored: pcre_compile() failed: %s" , errstr);
+
+		for (header = map , i = 0; header != NULL; header = header->next , i++) {
+			if (header->url[0] == '~') {
+				pattern[i] = NGX_HTTP_METRICS_NO_PATTERN;
+			}
+		}
+
+		return NGX_OK;
+	}
+
+	/* the study, with the JIT code, is freed with the matcher */
+
+	opt = 0;
+
+#if (NGX_HAVE_PCRE_JIT)
+	opt = PCRE_STUDY_JIT_COMPILE;
+#endif
+
+	cln->handler = ngx_http_metrics_free_study;
+	cln->data = re;
+
+	ngx_http_metrics_pcre_malloc_init(m->pool);
+
+	re->extra = pcre_study(re->code , opt , &errstr);
+
+	ngx_http_metrics_pcre_malloc_done();
+
+	if (errstr != NULL) {
+		ngx_log_error(NGX_LOG_WARN , log , 0 , "metrics map regex patterns: pcre_study() failed: %s" , errstr);
+	}
+
+	if (pcre_fullinfo(re->code , NULL , PCRE_INFO_CAPTURECOUNT , &captures) != 0
+		|| pcre_fullinfo(re->code , NULL , PCRE_INFO_NAMECOUNT , &named) != 0
+		|| pcre_fullinfo(re->code , NULL , PCRE_INFO_NAMEENTRYSIZE , &size) != 0
+		|| pcre_fullinfo(re->code , NULL , PCRE_INFO_NAMETABLE , &name) != 0)
+	{
+		ngx_log_error(NGX_LOG_ERR , log , 0 , "metrics map regex patterns: pcre_fullinfo() failed");
+		return NGX_ERROR;
+	}
+
+	m->regex = re;
+	m->ncaptures = (captures + 1) * 3;
+	m->captures = ngx_palloc(m->pool , m->ncaptures * sizeof(int));
+	if (m->captures == NULL) {
+		return NGX_ERROR;
+	}
+
+	/* the name table: group:16, big endian, and the name of the group */
+
+	for (i = 0; i < (ngx_uint_t)named; i++ , name += size) {
+		if (ngx_strncmp(&name[2] , "metrics_" , 8) != 0) {
+			continue;
+		}
+
+		n = ngx_atoi(&name[10] , ngx_strlen(&name[10]));
+		if (n != NGX_ERROR && (ngx_uint_t)n < k) {
+			m->regex_group[n] = 2 * (name[0] << 8 | name[1]);
+		}
+	}
+
+	m->nregex = k;
+
+	ngx_log_error(NGX_LOG_INFO , log , 0 , "metrics map: %ui regex patterns" , k);
+
+	return NGX_OK;
+}
+
+/*
+ * A regex pattern may not refer to a group, by number, by name or by
+ * recursion, nor use a verb or a condition, all of which would act on
+ * the regex of the map rather than on the pattern.
+ */
+
+static ngx_int_t ngx_http_metrics_check_regex(ngx_pool_t * pool , u_char * url , ngx_log_t * log) {
+	const char * errstr;
+	ngx_uint_t caseless;
+	u_char * src , * p;
+	pcre * code;
+	int erroff , n;
+
+	caseless = (url[1] == '*');
+	src = url + 1 + caseless;
+
+	ngx_http_metrics_pcre_malloc_init(pool);
+
+	code = pcre_compile((const char *)src , caseless ? PCRE_CASELESS : 0 , &errstr , &erroff , NULL);
+
+	ngx_http_metrics_pcre_malloc_done();
+
+	if (code == NULL) {
+		ngx_log_error(NGX_LOG_WARN , log , 0 , "metrics map pattern \"%s\" ignored: %s at \"%s\"" , url , errstr ,
+			src + erroff);
+		return NGX_DECLINED;
+	}
+
+	if (pcre_fullinfo(code , NULL , PCRE_INFO_BACKREFMAX , &n) != 0 || n != 0) {
+		ngx_log_error(NGX_LOG_WARN , log , 0 , "metrics map pattern \"%s\" ignored: it has backreferences" , url);
+		return NGX_DECLINED;
+	}
+
+	if (pcre_fullinfo(code , NULL , PCRE_INFO_NAMECOUNT , &n) != 0 || n != 0) {
+		ngx_log_error(NGX_LOG_WARN , log , 0 , "metrics map pattern \"%s\" ignored: it has named groups" , url);
+		return NGX_DECLINED;
+	}
+
+	/* what the compiler does not report: verbs, subroutine calls and conditions */
+
+	for (p = src; *p != '\0'; p++) {
+		if (*p == '\\') {
+			if (p[1] == 'Q') {
+				for (p += 2; *p != '\0' && !(p[0] == '\\' && p[1] == 'E'); p++) { /* void */ }
+
+				if (*p == '\0') {
+					break;
+				}
+
+			} else if (p[1] == 'g' && (p[2] == '<' || p[2] == '\'')) {
+				goto refused;
+			}
+
+			if (p[1] != '\0') {
+				p++;
+			}
+
+			continue;
+		}
+
+		if (*p == '[') {
+			p += (p[1] == '^') ? 2 : 1;
+
+			for (p += (*p == ']'); *p != '\0' && *p != ']'; p++) {
+				if (*p == '\\' && p[1] != '\0') {
+					p++;
+				}
+			}
+
+			if (*p == '\0') {
+				break;
+			}
+
+			continue;
+		}
+
+		if (*p == '(' && (p[1] == '*' || (p[1] == '?' && (p[2] == 'R' || p[2] == '(' || p[2] == '+' || p[2] == '&'
+			|| (p[2] == 'P' && p[3] == '>') || (p[2] >= '0' && p[2] <= '9')
+			|| (p[2] == '-' && p[3] >= '0' && p[3] <= '9')))))
+		{
+			goto refused;
+		}
+	}
+
+	return NGX_OK;
+
+refused:
+
+	ngx_log_error(NGX_LOG_WARN , log , 0 , "metrics map pattern \"%s\" ignored: \"%s\" is not supported" , url , p);
+
+	return NGX_DECLINED;
+}
+
+/*
+ * Runs the regex of the map once, unless the patterns found already come
+ * before all of the regex patterns.
+ */
+
+static uint32_t ngx_http_metrics_match_regex(ngx_http_metrics_matcher_t * m , u_char * url , size_t len , int * index ,
+	uint32_t best , ngx_log_t * log)
+{
+	ngx_str_t s;
+	ngx_uint_t k;
+	int rc , group;
+
+	if (m->nregex == 0 || m->regex_pattern[0] >= best) {
+		return best;
+	}
+
+	s.data = url;
+	s.len = len;
+
+	rc = ngx_regex_exec(m->regex , &s , m->captures , m->ncaptures);
+	if (rc < 0) {
+		if (rc != NGX_REGEX_NO_MATCHED) {
+			ngx_log_error(NGX_LOG_ALERT , log , 0 , ngx_regex_exec_n " failed: %i on \"%V\"" , rc , &s);
+		}
+
+		return best;
+	}
+
+	for (k = 0; k < m->nregex && m->regex_pattern[k] < best; k++) {
+		group = m->regex_group[k];
+
+		if (group >= 0 && group / 2 < rc && m->captures[group] != -1
+			&& index[m->regex_pattern[k] * m->ncodes] != -1)
+		{
+			return m->regex_pattern[k];
+		}
+	}
+
+	return best;
+}
+
+#endif
+
+/*
+ * A status is a code or a class, "2xx", counted for the codes of the
+ * class no other row of the pattern names.
+ */
+
+static int ngx_http_metrics_status(char * status) {
+	if (status[0] >= '0' && status[0] < '0' + NGX_HTTP_METRICS_NCLASSES
+		&& (status[1] == 'x' || status[1] == 'X') && (status[2] == 'x' || status[2] == 'X')
+		&& (status[3] == '\0' || isspace((u_char)status[3])))
+	{
+		return NGX_HTTP_METRICS_CLASS(status[0] - '0');
+	}
+
+	return atoi(status);
+}
+
+/*
+ * metrics_map file [check=time|off]
+ *
+ * Every line of the file is "slot<TAB>pattern<TAB>status".  The pattern
+ * matches anywhere in the uri, or at its start with "^pattern"; "~regex"
+ * and "~*regex" are regular expressions, with PCRE only.  The status is a
+ * code or a class, "5xx".
+ */
+
+static char * ngx_http_metrics_map(ngx_conf_t * cf , ngx_command_t * cmd , void * conf) {
+	ngx_http_metrics_main_conf_t * mmcf = (ngx_http_metrics_main_conf_t *)conf;
+	ngx_str_t * value = cf->args->elts;
+	ngx_str_t s;
+
+	if (mmcf->file.data != NULL) {
+		return "is duplicate";
+	}
+
+	mmcf->file = value[1];
+	mmcf->required = 1;
+
+	if (ngx_conf_full_name(cf->cycle , &mmcf->file , 1) != NGX_OK) {
+		return NGX_CONF_ERROR;
+	}
+
+	if (cf->args->nelts == 3) {
+		if (ngx_strcmp(value[2].data , "check=off") == 0) {
+			mmcf->check = 0;
+
+			return NGX_CONF_OK;
+		}
+
+		if (ngx_strncmp(value[2].data , "check=" , 6) != 0) {
+			ngx_conf_log_error(NGX_LOG_EMERG , cf , 0 , "invalid parameter \"%V\"" , &value[2]);
+
+			return NGX_CONF_ERROR;
+		}
+
+		s.data = value[2].data + 6;
+		s.len = value[2].len - 6;
+
+		mmcf->check = ngx_parse_time(&s , 0);
+		if (mmcf->check == (ngx_msec_t) NGX_ERROR) {
+			ngx_conf_log_error(NGX_LOG_EMERG , cf , 0 , "invalid parameter \"%V\"" , &value[2]);
+
+			return NGX_CONF_ERROR;
+		}
+	}
+
+	return NGX_CONF_OK;
+}
+
+static void * ngx_http_metrics_create_main_conf(ngx_conf_t * cf) {
+	ngx_http_metrics_main_conf_t * mmcf = ngx_pcalloc(cf->pool , sizeof(ngx_http_metrics_main_conf_t));
+	if (mmcf == NULL) {
+		return NULL;
+	}
+
+	mmcf->check = NGX_CONF_UNSET_MSEC;
+
+	return mmcf;
+}
+
+/*
+ * Without the metrics_map directive the file is named by the environment
+ * of the master, as the module always did; the workers do not inherit it.
+ */
+
+static char * ngx_http_metrics_init_main_conf(ngx_conf_t * cf , void * conf) {
+	ngx_http_metrics_main_conf_t * mmcf = (ngx_http_metrics_main_conf_t *)conf;
+	char * env;
+
+	ngx_conf_init_msec_value(mmcf->check , NGX_HTTP_METRICS_MAP_CHECK);
+
+	if (mmcf->file.data != NULL) {
+		return NGX_CONF_OK;
+	}
+
+	env = getenv("NGX_METRICS_DEFINE_FILE");
+	if (env == NULL) {
+		env = NGX_HTTP_METRICS_MAP_FILE;
+	}
+
+	mmcf->file.len = ngx_strlen(env);
+	mmcf->file.data = ngx_pnalloc(cf->pool , mmcf->file.len + 1);
+	if (mmcf->file.data == NULL) {
+		return NGX_CONF_ERROR;
+	}
+
+	(void)ngx_cpystrn(mmcf->file.data , (u_char *)env , mmcf->file.len + 1);
+
+	return NGX_CONF_OK;
+}
+
+/*
+ * The map is loaded with the configuration, before the workers are
+ * forked; every worker then polls the file and reloads it on change from
+ * a timer, never from a request.
+ */
+
+/*
+ * metrics slot | off
+ *
+ * Counts every response of the location into the slot, whatever its uri
+ * and status; "off" cancels a slot inherited from an enclosing location,
+ * leaving its requests to the metrics map.
+ */
+
+static char * ngx_http_metrics_slot(ngx_conf_t * cf , ngx_command_t * cmd , void * conf) {
+	ngx_http_metrics_filter_conf_t * mfcf = (ngx_http_metrics_filter_conf_t *)conf;
+	ngx_str_t * value = cf->args->elts;
+	ngx_int_t n;
+
+	if (mfcf->slot != NGX_CONF_UNSET_UINT) {
+		return "is duplicate";
+	}
+
+	if (ngx_strcmp(value[1].data , "off") == 0) {
+		mfcf->slot = NGX_HTTP_METRICS_NO_SLOT;
+
+		return NGX_CONF_OK;
+	}
+
+	n = ngx_atoi(value[1].data , value[1].len);
+	if (n == NGX_ERROR || n >= NGX_METRICS_MAX_SLOTS) {
+		ngx_conf_log_error(NGX_LOG_EMERG , cf , 0 , "invalid metrics slot \"%V\"" , &value[1]);
+
+		return NGX_CONF_ERROR;
+	}
+
+	mfcf->slot = n;
+
+	return NGX_CONF_OK;
+}
+
+/*
+ * metrics_label name value
+ *
+ * Adds a dimension to the labeled counters; the value is evaluated at the
+ * end of every request, and the values of all the dimensions together
+ * make the label set the request is counted into.
+ */
+
+static char * ngx_http_metrics_label(ngx_conf_t * cf , ngx_command_t * cmd , void * conf) {
+	ngx_http_metrics_main_conf_t * mmcf = (ngx_http_metrics_main_conf_t *)conf;
+	ngx_str_t * value = cf->args->elts;
+	ngx_http_compile_complex_value_t ccv;
+	ngx_http_metrics_label_t * label;
+	ngx_uint_t i;
+	u_char c;
+
+	if (mmcf->labels == NULL) {
+		mmcf->labels = ngx_array_create(cf->pool , 4 , sizeof(ngx_http_metrics_label_t));
+		if (mmcf->labels == NULL) {
+			return NGX_CONF_ERROR;
+		}
+	}
+
+	/* a prometheus label name, not one of the reserved ones */
+
+	if (value[1].len == 0 || value[1].data[0] == '_' || (value[1].data[0] >= '0' && value[1].data[0] <= '9')) {
+		goto invalid;
+	}
+
+	for (i = 0; i < value[1].len; i++) {
+		c = ngx_tolower(value[1].data[i]);
+
+		if (c != '_' && (c < '0' || c > '9') && (c < 'a' || c > 'z')) {
+			goto invalid;
+		}
+	}
+
+	label = mmcf->labels->elts;
+
+	for (i = 0; i < mmcf->labels->nelts; i++) {
+		if (label[i].name.len == value[1].len && ngx_strncmp(label[i].name.data , value[1].data , value[1].len) == 0) {
+			ngx_conf_log_error(NGX_LOG_EMERG , cf , 0 , "duplicate metrics label \"%V\"" , &value[1]);
+
+			return NGX_CONF_ERROR;
+		}
+	}
+
+	label = ngx_array_push(mmcf->labels);
+	if (label == NULL) {
+		return NGX_CONF_ERROR;
+	}
+
+	label->name = value[1];
+
+	ngx_memzero(&ccv , sizeof(ngx_http_compile_complex_value_t));
+
+	ccv.cf = cf;
+	ccv.value = &value[2];
+	ccv.complex_value = &label->value;
+
+	if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+		return NGX_CONF_ERROR;
+	}
+
+	return NGX_CONF_OK;
+
+invalid:
+
+	ngx_conf_log_error(NGX_LOG_EMERG , cf , 0 , "invalid metrics label name \"%V\"" , &value[1]);
+
+	return NGX_CONF_ERROR;
+}
+
+/*
+ * metrics_trace off | every=number | rate=number r/s|r/m [burst=number]
+ *
+ * Samples requests into the trace rings of the metrics zone, one in every
+ * number of them or at most at the rate, per worker.  The sample is taken
+ * once the request header is read, before the location is known, so the
+ * sampler is the one of the server.
+ */
+
+static char * ngx_http_metrics_trace(ngx_conf_t * cf , ngx_command_t * cmd , void * conf) {
+	ngx_http_metrics_filter_conf_t * mfcf = (ngx_http_metrics_filter_conf_t *)conf;
+	ngx_http_metrics_main_conf_t * mmcf;
+	ngx_http_metrics_sampler_t * s;
+	ngx_str_t * value = cf->args->elts;
+	ngx_uint_t i , scale;
+	ngx_int_t n;
+	size_t len;
+	u_char * p;
+
+	if (mfcf->trace != NGX_CONF_UNSET_PTR) {
+		return "is duplicate";
+	}
+
+	if (ngx_strcmp(value[1].data , "off") == 0) {
+		if (cf->args->nelts != 2) {
+			i = 2;
+			goto invalid;
+		}
+
+		mfcf->trace = NULL;
+
+		return NGX_CONF_OK;
+	}
+
+	s = ngx_pcalloc(cf->pool , sizeof(ngx_http_metrics_sampler_t));
+	if (s == NULL) {
+		return NGX_CONF_ERROR;
+	}
+
+	for (i = 1; i < cf->args->nelts; i++) {
+		if (ngx_strncmp(value[i].data , "every=" , 6) == 0) {
+			n = ngx_atoi(value[i].data + 6 , value[i].len - 6);
+			if (n <= 0) {
+				goto invalid;
+			}
+
+			s->every = n;
+			s->countdown = n;
+
+			continue;
+		}
+
+		if (ngx_strncmp(value[i].data , "rate=" , 5) == 0) {
+			len = value[i].len;
+			p = value[i].data + len - 3;
+			scale = 1;
+
+			if (ngx_strncmp(p , "r/s" , 3) == 0) {
+				len -= 3;
+
+			} else if (ngx_strncmp(p , "r/m" , 3) == 0) {
+				scale = 60;
+				len -= 3;
+			}
+
+			n = ngx_atoi(value[i].data + 5 , len - 5);
+			if (n <= 0) {
+				goto invalid;
+			}
+
+			s->interval = (uint64_t)1000000 * scale / n;
+
+			continue;
+		}
+
+		if (ngx_strncmp(value[i].data , "burst=" , 6) == 0) {
+			n = ngx_atoi(value[i].data + 6 , value[i].len - 6);
+			if (n == NGX_ERROR) {
+				goto invalid;
+			}
+
+			s->burst = n;
+
+			continue;
+		}
+
+		goto invalid;
+	}
+
+	if ((s->every == 0) == (s->interval == 0)) {
+		ngx_conf_log_error(NGX_LOG_EMERG , cf , 0 , "either \"every\" or \"rate\" must be set");
+
+		return NGX_CONF_ERROR;
+	}
+
+	if (s->every && s->burst) {
+		ngx_conf_log_error(NGX_LOG_EMERG , cf , 0 , "\"burst\" needs \"rate\"");
+
+		return NGX_CONF_ERROR;
+	}
+
+	s->burst *= s->interval;
+	mfcf->trace = s;
+
+	mmcf = ngx_http_conf_get_module_main_conf(cf , ngx_http_metrics_filter_modules);
+	mmcf->trace = 1;
+
+	return NGX_CONF_OK;
+
+invalid:
+
+	ngx_conf_log_error(NGX_LOG_EMERG , cf , 0 , "invalid parameter \"%V\"" , &value[i]);
+
+	return NGX_CONF_ERROR;
+}
+
+ngx_array_t * ngx_http_metrics_get_labels(void) {
+	ngx_http_metrics_main_conf_t * mmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle , ngx_http_metrics_filter_modules);
+
+	return mmcf != NULL ? mmcf->labels : NULL;
+}
+
+static ngx_int_t ngx_http_metrics_add_variables(ngx_conf_t * cf) {
+	ngx_http_variable_t * var , * v;
+
+	for (v = ngx_http_metrics_variables; v->name.len; v++) {
+		var = ngx_http_add_variable(cf , &v->name , v->flags);
+		if (var == NULL) {
+			return NGX_ERROR;
+		}
+
+		var->get_handler = v->get_handler;
+		var->data = v->data;
+	}
+
+	return NGX_OK;
+}
+
+/*
+ * $metrics_rate_1m, 5m and 15m are the requests per second of the slot of
+ * the request and $metrics_latency_1m, 5m and 15m their average time in
+ * ms, as of the last export interval.  The slot is the one bound to the
+ * location or, once the response header is out, the one it was counted
+ * in; without one, or outside the rate slots, the variables are not found.
+ */
+
+static ngx_int_t ngx_http_metrics_rate_variable(ngx_http_request_t * r , ngx_http_variable_value_t * v , uintptr_t data) {
+	ngx_http_metrics_filter_conf_t * mfcf = ngx_http_get_module_loc_conf(r , ngx_http_metrics_filter_modules);
+	ngx_http_metrics_ctx_t * ctx = ngx_http_get_module_ctx(r , ngx_http_metrics_filter_modules);
+	ngx_atomic_uint_t value;
+	ngx_uint_t slot;
+	u_char * p;
+
+	if (mfcf->slot != NGX_HTTP_METRICS_NO_SLOT) {
+		slot = mfcf->slot;
+	} else if (ctx != NULL) {
+		slot = ctx->slot;
+	} else {
+		slot = NGX_HTTP_METRICS_NO_SLOT;
+	}
+
+	if (ngx_metrics_sh == NULL || slot >= ngx_metrics_sh->nrates) {
+		v->not_found = 1;
+
+		return NGX_OK;
+	}
+
+	if (data < NGX_METRICS_RATE_TIME) {
+		value = ngx_metrics_rate(ngx_metrics_sh , slot , data - NGX_METRICS_RATE_REQUESTS);
+	} else {
+		value = ngx_metrics_rate_latency(ngx_metrics_sh , slot , data - NGX_METRICS_RATE_TIME);
+	}
+
+	p = ngx_pnalloc(r->pool , NGX_ATOMIC_T_LEN + 4);
+	if (p == NULL) {
+		return NGX_ERROR;
+	}
+
+	v->len = ngx_sprintf(p , "%uA.%03uA" , value / 1000 , value % 1000) - p;
+	v->valid = 1;
+	v->no_cacheable = 1;
+	v->not_found = 0;
+	v->data = p;
+
+	return NGX_OK;
+}
+
+static ngx_int_t ngx_http_metrics_filter_init_process(ngx_cycle_t * cycle) {
+	ngx_http_metrics_main_conf_t * mmcf = ngx_http_cycle_get_module_main_conf(cycle , ngx_http_metrics_filter_modules);
+
+	if (mmcf == NULL || (ngx_process != NGX_PROCESS_WORKER && ngx_process != NGX_PROCESS_SINGLE)) {
+		return NGX_OK;
+	}
+
+	if (ngx_http_metrics_init_peers(cycle) != NGX_OK) {
+		return NGX_ERROR;
+	}
+
+	ngx_metrics_start_export(cycle);
+
+	if (mmcf->check == 0) {
+		return NGX_OK;
+	}
+
+	metrics_map_check_ev.handler = ngx_http_metrics_map_check_handler;
+	metrics_map_check_ev.data = mmcf;
+	metrics_map_check_ev.log = cycle->log;
+	metrics_map_check_ev.cancelable = 1;
+
+	ngx_add_timer(&metrics_map_check_ev , mmcf->check);
+
+	return NGX_OK;
+}
+
+static void ngx_http_metrics_map_check_handler(ngx_event_t * ev) {
+	ngx_http_metrics_main_conf_t * mmcf = ev->data;
+	ngx_file_info_t fi;
+
+	if (ngx_exiting) {
+		return;
+	}
+
+	if (ngx_file_info(mmcf->file.data , &fi) != NGX_FILE_ERROR
+		&& (ngx_file_uniq(&fi) != metrics_map_uniq || ngx_file_mtime(&fi) != metrics_map_mtime
+			|| ngx_file_size(&fi) != metrics_map_size)) {
+		ngx_log_error(NGX_LOG_NOTICE , ev->log , 0 , "metrics map \"%V\" changed, reloading" , &mmcf->file);
+
+		(void)ngx_http_load_metrics_map(mmcf , ev->log);
+	}
+
+	ngx_add_timer(ev , mmcf->check);
+}
+
+static void* ngx_http_metrics_filter_create_conf(ngx_conf_t *cf){	
+    ngx_http_metrics_filter_conf_t  * mycf = (ngx_http_metrics_filter_conf_t  *)
+		ngx_pcalloc(cf->pool, sizeof(ngx_http_metrics_filter_conf_t));
+    if (mycf == NULL) {
+        return NULL;
+    }
+
+    mycf->enable = NGX_CONF_UNSET;
+    mycf->topk = NGX_CONF_UNSET;
+    mycf->slot = NGX_CONF_UNSET_UINT;
+    mycf->record = NGX_CONF_UNSET_UINT;
+    mycf->uri = NGX_CONF_UNSET_UINT;
+    mycf->subrequests = NGX_CONF_UNSET;
+    mycf->trace = NGX_CONF_UNSET_PTR;
+	
+    return mycf;
+}
+
+static char * ngx_http_metrics_filter_merge_conf(ngx_conf_t *cf,void*parent,void*child) {
+    ngx_http_metrics_filter_conf_t *prev = (ngx_http_metrics_filter_conf_t *)parent;
+    ngx_http_metrics_filter_conf_t *conf = (ngx_http_metrics_filter_conf_t *)child;
+
+    ngx_conf_merge_value(conf->enable, prev->enable, 1);
+    ngx_conf_merge_value(conf->topk, prev->topk, 0);
+    ngx_conf_merge_uint_value(conf->slot, prev->slot, NGX_HTTP_METRICS_NO_SLOT);
+    ngx_conf_merge_uint_value(conf->record, prev->record, NGX_HTTP_METRICS_RECORD_HEADER);
+    ngx_conf_merge_uint_value(conf->uri, prev->uri, NGX_HTTP_METRICS_URI_NORMALIZED);
+    ngx_conf_merge_value(conf->subrequests, prev->subrequests, 0);
+    ngx_conf_merge_ptr_value(conf->trace, prev->trace, NULL);
+
+    return NGX_CONF_OK;
+}
+
+/*
+ * Counts the request into the slot of its location or the one the map
+ * gives its uri and status, and into the top-K table.  The original uri
+ * is the one of the request line, without the arguments, before any
+ * internal redirect; subrequests have only their own.
+ */
+
+static int ngx_http_metrics_record(ngx_http_request_t * r , ngx_http_metrics_filter_conf_t * mfcf , ngx_uint_t status) {
+	ngx_str_t uri = r->uri;
+	u_char * p;
+	int index;
+
+	if (mfcf->uri == NGX_HTTP_METRICS_URI_ORIGINAL && r == r->main && r->unparsed_uri.len) {
+		uri = r->unparsed_uri;
+
+		p = ngx_strlchr(uri.data , uri.data + uri.len , '?');
+		if (p != NULL) {
+			uri.len = p - uri.data;
+		}
+	}
+
+	/* a slot bound to the location takes the place of the map */
+
+	if (mfcf->slot != NGX_HTTP_METRICS_NO_SLOT) {
+		index = (int)mfcf->slot;
+	} else {
+		index = ngx_http_get_metrics_index_by_url_code(uri.data , uri.len , (int)status , r->connection->log);
+	}
+
+	if (index >= 0) {
+		ngx_metrics_count(index);
+	}
+
+	if (mfcf->topk) {
+		ngx_metrics_topk_count(uri.data , uri.len , status);
+	}
+
+	return index;
+}
+
+/*
+ * With "metrics_record header" the main request is counted here, with the
+ * status of the response it sends.  Subrequests are only counted, into
+ * the slots of their own locations, with "metrics_subrequests on".  A
+ * traced request notes when its response header is sent.
+ */
+
+static ngx_int_t ngx_http_metrics_filter_header_filter(ngx_http_request_t *r) {
+	ngx_http_metrics_filter_conf_t * mfcf;
+	ngx_http_metrics_ctx_t * ctx;
+	int index;
+
+	if (metrics_retired != NULL) {
+		ngx_http_reclaim_metrics_map();
+	}
+
+	mfcf = ngx_http_get_module_loc_conf(r , ngx_http_metrics_filter_modules);
+
+	if (metrics_traces && r == r->main) {
+		ngx_http_metrics_trace_point(r , NGX_METRICS_TRACE_SEND);
+	}
+
+	if (r != r->main ? !mfcf->subrequests : mfcf->record == NGX_HTTP_METRICS_RECORD_LOG) {
+		return ngx_http_next_header_filter(r);
+	}
+
+	index = ngx_http_metrics_record(r , mfcf , r->headers_out.status);
+
+	if (index >= 0 && r == r->main) {
+		ctx = ngx_http_metrics_get_ctx(r);
+
+		if (ctx == NULL) {
+			ctx = ngx_pcalloc(r->pool , sizeof(ngx_http_metrics_ctx_t));
+			if (ctx != NULL) {
+				ngx_http_set_ctx(r , ctx , ngx_http_metrics_filter_modules);
+			}
+		}
+
+		if (ctx != NULL) {
+			ctx->slot = index;
+		}
+	}
+
+    return ngx_http_next_header_filter(r);
+}
+
+/*
+ * Counts the main request with "metrics_record log", once and with its
+ * final status, whatever internal redirects and error pages it went
+ * through.  Then accounts the bytes of the request, its client and heavy
+ * hitter key, and records its request and upstream response times into
+ * the latency histograms of its slot.  The upstream peers are accounted
+ * for every request, and of subrequests logged with log_subrequest.  A
+ * traced request goes to the trace ring, counted or not.
+ */
+
+static ngx_int_t ngx_http_metrics_log_handler(ngx_http_request_t * r) {
+	ngx_http_metrics_main_conf_t * mmcf = ngx_http_get_module_main_conf(r , ngx_http_metrics_filter_modules);
+	ngx_http_metrics_filter_conf_t * mfcf = ngx_http_get_module_loc_conf(r , ngx_http_metrics_filter_modules);
+	ngx_http_metrics_ctx_t * ctx , logged;
+	ngx_http_upstream_state_t * state;
+	ngx_msec_int_t ms;
+	ngx_uint_t i , status;
+	int index;
+
+	ngx_http_metrics_account_peers(r);
+
+	if (r != r->main) {
+		return NGX_OK;
+	}
+
+	if (mmcf->labels != NULL) {
+		ngx_http_metrics_account_labels(r , mmcf->labels);
+	}
+
+	ctx = ngx_http_metrics_get_ctx(r);
+
+	if (mfcf->record == NGX_HTTP_METRICS_RECORD_LOG) {
+		status = r->err_status ? r->err_status : r->headers_out.status;
+
+		index = ngx_http_metrics_record(r , mfcf , status);
+
+		if (ctx != NULL) {
+			ctx->slot = (index >= 0) ? (ngx_uint_t)index : NGX_HTTP_METRICS_NO_SLOT;
+
+		} else if (index >= 0) {
+			logged.slot = index;
+			logged.trace = NULL;
+			ctx = &logged;
+		}
+	}
+
+	if (ctx == NULL) {
+		return NGX_OK;
+	}
+
+	ms = ngx_http_metrics_elapsed(r);
+
+	if (ctx->trace != NULL) {
+		ngx_http_metrics_add_trace(r , ctx , (ngx_msec_t)ms);
+	}
+
+	if (ctx->slot == NGX_HTTP_METRICS_NO_SLOT) {
+		return NGX_OK;
+	}
+
+	ngx_metrics_add(ctx->slot , NGX_METRICS_BYTES_SENT , (ngx_atomic_int_t)r->connection->sent);
+	ngx_metrics_add(ctx->slot , NGX_METRICS_BYTES_RECEIVED , (ngx_atomic_int_t)r->request_length);
+	ngx_metrics_unique(ctx->slot , ngx_http_metrics_client_hash(r->connection));
+
+	if (ngx_metrics_sh != NULL && ctx->slot < ngx_metrics_sh->nheavy) {
+		ngx_http_metrics_account_heavy(r , mmcf->heavy_key , ctx->slot);
+	}
+
+	ngx_metrics_observe(ctx->slot , NGX_METRICS_HIST_REQUEST , (ngx_msec_t)ms);
+
+	if (r->upstream_states == NULL || r->upstream_states->nelts == 0) {
+		return NGX_OK;
+	}
+
+	ms = 0;
+	state = r->upstream_states->elts;
+
+	for (i = 0; i < r->upstream_states->nelts; i++) {
+		if (state[i].status) {
+			ms += ngx_max((ngx_msec_int_t)state[i].response_time , 0);
+		}
+	}
+
+	ngx_metrics_observe(ctx->slot , NGX_METRICS_HIST_UPSTREAM , (ngx_msec_t)ms);
+
+	return NGX_OK;
+}
+
+/*
+ * The milliseconds since the request started.
+ */
+
+static ngx_msec_t ngx_http_metrics_elapsed(ngx_http_request_t * r) {
+	ngx_time_t * tp = ngx_timeofday();
+	ngx_msec_int_t ms = (ngx_msec_int_t)((tp->sec - r->start_sec) * 1000 + (tp->msec - r->start_msec));
+
+	return (ngx_msec_t)ngx_max(ms , 0);
+}
+
+static ngx_inline ngx_uint_t ngx_http_metrics_sample(ngx_http_metrics_sampler_t * s) {
+	uint64_t now;
+
+	if (s->every) {
+		if (--s->countdown) {
+			return 0;
+		}
+
+		s->countdown = s->every;
+
+		return 1;
+	}
+
+	now = (uint64_t)ngx_current_msec * 1000;
+
+	if (s->next > now + s->burst) {
+		return 0;
+	}
+
+	s->next = ngx_max(s->next , now) + s->interval;
+
+	return 1;
+}
+
+/*
+ * Samples the main request, once its header is read, for a trace.  An
+ * unsampled request costs the countdown or the clock comparison of the
+ * sampler, and nothing more anywhere else.
+ */
+
+static ngx_int_t ngx_http_metrics_trace_handler(ngx_http_request_t * r) {
+	ngx_http_metrics_filter_conf_t * mfcf = ngx_http_get_module_loc_conf(r , ngx_http_metrics_filter_modules);
+	ngx_http_metrics_ctx_t * ctx;
+	ngx_pool_cleanup_t * cln;
+	ngx_metrics_trace_t * t;
+	ngx_uint_t i;
+
+	if (mfcf->trace == NULL || !ngx_http_metrics_sample(mfcf->trace)
+		|| ngx_http_get_module_ctx(r , ngx_http_metrics_filter_modules) != NULL) {
+		return NGX_DECLINED;
+	}
+
+	ctx = ngx_pcalloc(r->pool , sizeof(ngx_http_metrics_ctx_t));
+	t = ngx_pcalloc(r->pool , sizeof(ngx_metrics_trace_t));
+	if (ctx == NULL || t == NULL) {
+		return NGX_DECLINED;
+	}
+
+	cln = ngx_pool_cleanup_add(r->pool , 0);
+	if (cln == NULL) {
+		return NGX_DECLINED;
+	}
+
+	for (i = 0; i < NGX_METRICS_TRACE_POINTS; i++) {
+		t->time[i] = NGX_METRICS_TRACE_NONE;
+	}
+
+	t->start = (uint64_t)r->start_sec * 1000 + r->start_msec;
+	t->time[NGX_METRICS_TRACE_HEADER] = (uint32_t)ngx_http_metrics_elapsed(r);
+
+	ctx->slot = NGX_HTTP_METRICS_NO_SLOT;
+	ctx->trace = t;
+
+	cln->handler = ngx_http_metrics_trace_cleanup;
+	cln->data = ctx;
+	metrics_traces++;
+
+	ngx_http_set_ctx(r , ctx , ngx_http_metrics_filter_modules);
+
+	return NGX_DECLINED;
+}
+
+static void ngx_http_metrics_trace_cleanup(void * data) {
+	metrics_traces--;
+}
+
+/*
+ * An internal redirect clears the module contexts; the context of a
+ * traced request is found again through its pool cleanup, as the realip
+ * module does, and there is none to look for while no traced request is
+ * alive in the worker.
+ */
+
+static ngx_http_metrics_ctx_t * ngx_http_metrics_get_ctx(ngx_http_request_t * r) {
+	ngx_http_metrics_ctx_t * ctx = ngx_http_get_module_ctx(r , ngx_http_metrics_filter_modules);
+	ngx_pool_cleanup_t * cln;
+
+	if (ctx != NULL || metrics_traces == 0) {
+		return ctx;
+	}
+
+	for (cln = r->pool->cleanup; cln != NULL; cln = cln->next) {
+		if (cln->handler == ngx_http_metrics_trace_cleanup) {
+			ctx = cln->data;
+			ngx_http_set_ctx(r , ctx , ngx_http_metrics_filter_modules);
+
+			return ctx;
+		}
+	}
+
+	return NULL;
+}
+
+static void ngx_http_metrics_trace_point(ngx_http_request_t * r , ngx_uint_t point) {
+	ngx_http_metrics_ctx_t * ctx = ngx_http_metrics_get_ctx(r);
+
+	if (ctx == NULL || ctx->trace == NULL || ctx->trace->time[point] != NGX_METRICS_TRACE_NONE) {
+		return;
+	}
+
+	ctx->trace->time[point] = (uint32_t)ngx_http_metrics_elapsed(r);
+}
+
+/*
+ * Completes the trace with the final status, the times of the last
+ * upstream try and the uri of the request line, without the arguments,
+ * and writes it to the ring.  An upstream time never reached is
+ * (ngx_msec_t) -1, which stays NGX_METRICS_TRACE_NONE.
+ */
+
+static void ngx_http_metrics_add_trace(ngx_http_request_t * r , ngx_http_metrics_ctx_t * ctx , ngx_msec_t ms) {
+	ngx_metrics_trace_t * t = ctx->trace;
+	ngx_http_upstream_state_t * state;
+	ngx_str_t uri = r->unparsed_uri;
+	u_char * p;
+
+	t->slot = (uint32_t)ctx->slot;
+	t->status = (uint16_t)(r->err_status ? r->err_status : r->headers_out.status);
+	t->time[NGX_METRICS_TRACE_DONE] = (uint32_t)ms;
+	t->sent = r->connection->sent;
+	t->received = r->request_length;
+
+	if (r->upstream_states != NULL && r->upstream_states->nelts) {
+		state = (ngx_http_upstream_state_t *)r->upstream_states->elts + r->upstream_states->nelts - 1;
+
+		t->tries = (uint16_t)ngx_min(r->upstream_states->nelts , 0xffff);
+		t->time[NGX_METRICS_TRACE_CONNECT] = (uint32_t)state->connect_time;
+		t->time[NGX_METRICS_TRACE_FIRST_BYTE] = (uint32_t)state->header_time;
+		t->time[NGX_METRICS_TRACE_LAST_BYTE] = (uint32_t)state->response_time;
+	}
+
+	p = ngx_strlchr(uri.data , uri.data + uri.len , '?');
+	if (p != NULL) {
+		uri.len = p - uri.data;
+	}
+
+	t->len = (uint16_t)ngx_min(uri.len , NGX_METRICS_TRACE_URI_LEN);
+	ngx_memcpy(t->uri , uri.data , t->len);
+
+	ngx_metrics_trace_add(t);
+}
+
+/*
+ * Hashes the client address, without the port, for the distinct clients.
+ */
+
+static uint32_t ngx_http_metrics_client_hash(ngx_connection_t * c) {
+	switch (c->sockaddr->sa_family) {
+
+#if (NGX_HAVE_INET6)
+	case AF_INET6:
+		return ngx_murmur_hash2(((struct sockaddr_in6 *)c->sockaddr)->sin6_addr.s6_addr , 16);
+#endif
+
+	case AF_INET:
+		return ngx_murmur_hash2((u_char *)&((struct sockaddr_in *)c->sockaddr)->sin_addr , 4);
+
+	default:
+		return ngx_murmur_hash2(c->addr_text.data , c->addr_text.len);
+	}
+}
+
+/*
+ * Counts the request for its heavy hitter key, metrics_heavy_key or the
+ * client address without it.
+ */
+
+static void ngx_http_metrics_account_heavy(ngx_http_request_t * r , ngx_http_complex_value_t * key , ngx_uint_t slot) {
+	ngx_str_t value;
+
+	if (key == NULL) {
+		value = r->connection->addr_text;
+
+	} else if (ngx_http_complex_value(r , key , &value) != NGX_OK) {
+		return;
+	}
+
+	if (value.len == 0) {
+		return;
+	}
+
+	ngx_metrics_heavy_count(slot , value.data , value.len);
+}
+
+/*
+ * Counts the request into its label set.  The set is found by its key,
+ * the values of the labels, each as length:8 | value, with values cut at
+ * 255 bytes; a key that does not fit counts into the overflow set.
+ */
+
+static void ngx_http_metrics_account_labels(ngx_http_request_t * r , ngx_array_t * labels) {
+	ngx_http_metrics_label_t * label = labels->elts;
+	u_char key[NGX_METRICS_LABELS_KEY_LEN];
+	u_char * p = key , * end = key + NGX_METRICS_LABELS_KEY_LEN;
+	ngx_uint_t i , id;
+	ngx_str_t value;
+	size_t len;
+
+	for (i = 0; i < labels->nelts; i++) {
+		if (ngx_http_complex_value(r , &label[i].value , &value) != NGX_OK) {
+			return;
+		}
+
+		len = ngx_min(value.len , 255);
+
+		if ((size_t)(end - p) < 1 + len) {
+			p = NULL;
+			break;
+		}
+
+		*p++ = (u_char)len;
+		p = ngx_cpymem(p , value.data , len);
+	}
+
+	id = p != NULL ? ngx_metrics_labels_intern(key , p - key) : NGX_METRICS_LABELS_OVERFLOW;
+
+	ngx_metrics_label_add(id , NGX_METRICS_REQUESTS , 1);
+	ngx_metrics_label_add(id , NGX_METRICS_BYTES_SENT , (ngx_atomic_int_t)r->connection->sent);
+	ngx_metrics_label_add(id , NGX_METRICS_BYTES_RECEIVED , (ngx_atomic_int_t)r->request_length);
+}
+
+#if (NGX_METRICS_BENCH)
+
+static ngx_int_t ngx_http_metrics_bench_next(ngx_http_request_t * r) {
+	return NGX_OK;
+}
+
+/*
+ * For metrics_bench, with "nginx -t" only: loads a map file the way
+ * metrics_map does and publishes it, and cuts the header filter chain
+ * after this filter, returning the filter.  The cut is undone with
+ * ngx_http_metrics_bench_filter_done() once the run is over.
+ */
+
+ngx_int_t ngx_http_metrics_bench_map(ngx_str_t * file , ngx_log_t * log , ngx_uint_t * nstates , size_t * size) {
+	ngx_http_metrics_main_conf_t mmcf;
+	ngx_http_metrics_matcher_t * m;
+
+	ngx_memzero(&mmcf , sizeof(ngx_http_metrics_main_conf_t));
+	mmcf.file = *file;
+
+	if (ngx_http_load_metrics_map(&mmcf , log) != NGX_OK) {
+		return NGX_ERROR;
+	}
+
+	m = metrics_snapshot;
+
+	*nstates = m->nstates;
+	*size = sizeof(ngx_http_metrics_matcher_t) + m->nstates * m->nclasses * sizeof(uint32_t)
+		+ m->nstates * 2 * sizeof(uint32_t) + m->npatterns * m->ncodes * sizeof(int);
+
+	return NGX_OK;
+}
+
+ngx_http_output_header_filter_pt ngx_http_metrics_bench_filter(ngx_http_output_header_filter_pt * next) {
+	*next = ngx_http_next_header_filter;
+	ngx_http_next_header_filter = ngx_http_metrics_bench_next;
+
+	return ngx_http_metrics_filter_header_filter;
+}
+
+void ngx_http_metrics_bench_filter_done(ngx_http_output_header_filter_pt next) {
+	ngx_http_next_header_filter = next;
+}
+
+/*
+ * A map in the order of precedence, which is the reverse of a map file,
+ * and the slots it must give.  Its trie has 35 states, fewer than its
+ * pattern bytes, so a table sized by the bound on the states shows.
+ */
+
+#define NGX_HTTP_METRICS_BENCH_STATES	35
+
+typedef struct tag_ngx_http_metrics_bench_line {
+	char * url;
+	char * status;
+	int index;
+} ngx_http_metrics_bench_line_t;
+
+typedef struct tag_ngx_http_metrics_bench_case {
+	char * uri;
+	int code;
+	int index;
+} ngx_http_metrics_bench_case_t;
+
+static ngx_http_metrics_bench_line_t ngx_http_metrics_bench_lines[] = {
+	{ "/api/v2/users" , "200" , 10 },
+	{ "^/api/" , "200" , 11 },
+	{ "^/api/" , "4xx" , 12 },
+	{ "^/api/" , "404" , 13 },
+	{ "/v2/" , "200" , 14 },
+	{ "/v2/" , "5xx" , 15 },
+	{ "users" , "200" , 16 },
+	{ "users" , "304" , 17 },
+	{ "/static/" , "200" , 18 },
+	{ NULL , NULL , 0 }
+};
+
+static ngx_http_metrics_bench_case_t ngx_http_metrics_bench_cases[] = {
+	/* the earliest of the overlapping patterns, whatever their length */
+	{ "/api/v2/users/1" , 200 , 10 },
+	{ "/api/v2/items" , 200 , 11 },
+	{ "/x/v2/users" , 200 , 14 },
+
+	/* anchored at the start of the uri only */
+	{ "/api/" , 200 , 11 },
+	{ "/x/api/v2/items" , 200 , 14 },
+	{ "/x/api/" , 403 , NGX_ERROR },
+
+	/* a code before its class, and the later patterns for the codes without a row */
+	{ "/api/v2/items" , 404 , 13 },
+	{ "/api/v2/items" , 403 , 12 },
+	{ "/api/v2/items" , 503 , 15 },
+	{ "/x/v2/users" , 304 , 17 },
+	{ "/x/api/v2/items" , 404 , NGX_ERROR },
+	{ "/api/v2/users" , 302 , NGX_ERROR },
+	{ "/api/" , 999 , NGX_ERROR },
+
+	/* failure links, and prefixes of a pattern */
+	{ "/ususers" , 200 , 16 },
+	{ "/static/app.css" , 200 , 18 },
+	{ "/static" , 200 , NGX_ERROR },
+	{ "" , 200 , NGX_ERROR },
+	{ NULL , 0 , 0 }
+};
+
+ngx_int_t ngx_http_metrics_bench_check_map(ngx_log_t * log) {
+	ngx_http_metrics_map_t map[sizeof(ngx_http_metrics_bench_lines) / sizeof(ngx_http_metrics_bench_line_t)];
+	ngx_http_status_code_map_t codes[sizeof(ngx_http_metrics_bench_lines) / sizeof(ngx_http_metrics_bench_line_t)];
+	ngx_http_metrics_bench_line_t * line;
+	ngx_http_metrics_bench_case_t * test;
+	ngx_http_metrics_matcher_t * m;
+	ngx_uint_t i , n;
+	ngx_int_t rc;
+	int index;
+
+	for (n = 0 , i = 0 , line = ngx_http_metrics_bench_lines; line->url != NULL; i++ , line++) {
+		if (n == 0 || ngx_strcmp(map[n - 1].url , line->url) != 0) {
+			map[n].url = (u_char *)line->url;
+			map[n].status_code = NULL;
+			map[n].next = NULL;
+			map[n].hnext = NULL;
+
+			if (n > 0) {
+				map[n - 1].next = &map[n];
+			}
+
+			n++;
+		}
+
+		codes[i].code = ngx_http_metrics_status(line->status);
+		codes[i].index = line->index;
+		codes[i].next = map[n - 1].status_code;
+		map[n - 1].status_code = &codes[i];
+	}
+
+	m = ngx_http_compile_metrics_map(map , log);
+	if (m == NULL) {
+		return NGX_ERROR;
+	}
+
+	rc = NGX_OK;
+
+	if (m->nstates != NGX_HTTP_METRICS_BENCH_STATES || m->output != m->next + m->nstates * m->nclasses) {
+		ngx_log_error(NGX_LOG_EMERG , log , 0 , "metrics bench: the map has %ui states, expected %d" ,
+			m->nstates , NGX_HTTP_METRICS_BENCH_STATES);
+		rc = NGX_ERROR;
+	}
+
+	for (test = ngx_http_metrics_bench_cases; test->uri != NULL; test++) {
+		index = ngx_http_metrics_match(m , (u_char *)test->uri , ngx_strlen(test->uri) , test->code , log);
+		if (index != test->index) {
+			ngx_log_error(NGX_LOG_EMERG , log , 0 , "metrics bench: \"%s\" %d gives slot %d, expected %d" ,
+				test->uri , test->code , index , test->index);
+			rc = NGX_ERROR;
+		}
+	}
+
+#if (NGX_PCRE)
+	if (m->pool != NULL) {
+		ngx_destroy_pool(m->pool);
+	}
+#endif
+
+	ngx_free(m);
+
+	return rc;
+}
+
+#endif
+
+static ngx_int_t ngx_http_metrics_filter_body_filter(ngx_http_request_t *r, ngx_chain_t *in) {
+    return ngx_http_next_body_filter(r, in);
+}
+
+static ngx_int_t ngx_http_metrics_filter_post_conf(ngx_conf_t * conf) {
+	ngx_http_core_main_conf_t * cmcf = ngx_http_conf_get_module_main_conf(conf , ngx_http_core_module);
+	ngx_http_metrics_main_conf_t * mmcf;
+	ngx_http_handler_pt * h;
+	ngx_array_t * names;
+
+	if (ngx_metrics_add_zone(conf) == NULL) {
+		return NGX_ERROR;
+	}
+
+	names = ngx_http_metrics_peer_names(conf);
+	if (names == NULL) {
+		return NGX_ERROR;
+	}
+
+	ngx_metrics_reserve_rows(conf , NGX_METRICS_ROWS_PEERS , names);
+
+	mmcf = ngx_http_conf_get_module_main_conf(conf , ngx_http_metrics_filter_modules);
+
+	if (mmcf->labels != NULL) {
+		ngx_metrics_reserve_labels(conf , NGX_METRICS_DEFAULT_LABELS);
+	}
+
+	h = ngx_array_push(&cmcf->phases[NGX_HTTP_LOG_PHASE].handlers);
+	if (h == NULL) {
+		return NGX_ERROR;
+	}
+
+	*h = ngx_http_metrics_log_handler;
+
+	if (mmcf->trace) {
+		ngx_metrics_reserve_traces(conf , NGX_METRICS_DEFAULT_TRACES);
+
+		h = ngx_array_push(&cmcf->phases[NGX_HTTP_POST_READ_PHASE].handlers);
+		if (h == NULL) {
+			return NGX_ERROR;
+		}
+
+		*h = ngx_http_metrics_trace_handler;
+	}
+
+	if (ngx_http_load_metrics_map(mmcf , conf->log) != NGX_OK) {
+		if (mmcf->required) {
+			return NGX_ERROR;
+		}
+
+		ngx_log_error(NGX_LOG_WARN , conf->log , 0 , "no metrics map, requests are not counted");
+	}
 
-static ngx_int_t ngx_http_metrics_filter_post_conf(ngx_conf_t * conf) {
 	ngx_http_next_header_filter=ngx_http_top_header_filter;
 	ngx_http_top_header_filter=ngx_http_metrics_filter_header_filter;	
 
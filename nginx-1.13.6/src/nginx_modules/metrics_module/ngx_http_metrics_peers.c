@@ -0,0 +1,220 @@
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <ngx_http_metrics.h>
+
+/*
+ * The upstream states of a request only name their peer, by a pointer to
+ * the name in the round robin peer that served it.  The peers are walked
+ * in the order of the upstream blocks, backup peers after the primary
+ * ones, and given the row of their labels in the zone, then looked up by
+ * that pointer in a sorted table.
+ */
+typedef struct tag_ngx_http_metrics_peer_key {
+	ngx_str_t * name;
+	ngx_uint_t index;
+} ngx_http_metrics_peer_key_t;
+
+static ngx_int_t ngx_http_metrics_walk_peers(ngx_http_upstream_main_conf_t * umcf , ngx_str_t ** table ,
+	ngx_array_t * names);
+static int ngx_libc_cdecl ngx_http_metrics_peer_key_cmp(const void * one , const void * two);
+static ngx_int_t ngx_http_metrics_find_peer(ngx_str_t * name);
+
+static ngx_http_metrics_peer_key_t * ngx_http_metrics_peer_keys = NULL;
+static ngx_uint_t ngx_http_metrics_npeers = 0;
+
+/*
+ * Returns the labels of the upstream peers of the configuration, in the
+ * order they are walked in.
+ */
+
+ngx_array_t * ngx_http_metrics_peer_names(ngx_conf_t * cf) {
+	ngx_array_t * names = ngx_array_create(cf->pool , 4 , sizeof(ngx_str_t));
+
+	if (names == NULL
+		|| ngx_http_metrics_walk_peers(ngx_http_conf_get_module_main_conf(cf , ngx_http_upstream_module) , NULL , names)
+			== NGX_ERROR) {
+		return NULL;
+	}
+
+	return names;
+}
+
+/*
+ * Builds the peer table of the worker, once the upstream zones have
+ * moved their peers to shared memory.  A peer without a row in a full
+ * zone is not accounted.
+ */
+
+ngx_int_t ngx_http_metrics_init_peers(ngx_cycle_t * cycle) {
+	ngx_http_upstream_main_conf_t * umcf = ngx_http_cycle_get_module_main_conf(cycle , ngx_http_upstream_module);
+	ngx_metrics_conf_t * mcf = (ngx_metrics_conf_t *)ngx_get_conf(cycle->conf_ctx , ngx_metrics_module);
+	ngx_str_t ** peers , * names;
+	ngx_uint_t i , k , n;
+	ngx_int_t row;
+
+	if (umcf == NULL || mcf->sh == NULL || mcf->rows[NGX_METRICS_ROWS_PEERS] == NULL) {
+		return NGX_OK;
+	}
+
+	n = ngx_min(mcf->rows[NGX_METRICS_ROWS_PEERS]->nelts , (ngx_uint_t)ngx_http_metrics_walk_peers(umcf , NULL , NULL));
+	if (n == 0) {
+		return NGX_OK;
+	}
+
+	peers = ngx_palloc(cycle->pool , n * sizeof(ngx_str_t *));
+	ngx_http_metrics_peer_keys = ngx_palloc(cycle->pool , n * sizeof(ngx_http_metrics_peer_key_t));
+
+	if (peers == NULL || ngx_http_metrics_peer_keys == NULL) {
+		return NGX_ERROR;
+	}
+
+	(void)ngx_http_metrics_walk_peers(umcf , peers , NULL);
+
+	names = mcf->rows[NGX_METRICS_ROWS_PEERS]->elts;
+
+	for (i = 0 , k = 0; i < n; i++) {
+		row = ngx_metrics_row(mcf->shpool , mcf->sh , NGX_METRICS_ROWS_PEERS , names[i].data , names[i].len);
+		if (row == NGX_ERROR) {
+			continue;
+		}
+
+		ngx_http_metrics_peer_keys[k].name = peers[i];
+		ngx_http_metrics_peer_keys[k].index = row;
+		k++;
+	}
+
+	if (k < n) {
+		ngx_log_error(NGX_LOG_WARN , cycle->log , 0 , "metrics zone has no room for %ui upstream peers, not counted" ,
+			n - k);
+	}
+
+	ngx_qsort(ngx_http_metrics_peer_keys , k , sizeof(ngx_http_metrics_peer_key_t) , ngx_http_metrics_peer_key_cmp);
+
+	ngx_http_metrics_npeers = k;
+
+	return NGX_OK;
+}
+
+/*
+ * Counts the peers and, if asked, keeps their names or adds their
+ * labels to names.
+ */
+
+static ngx_int_t ngx_http_metrics_walk_peers(ngx_http_upstream_main_conf_t * umcf , ngx_str_t ** table ,
+	ngx_array_t * names) {
+	ngx_http_upstream_srv_conf_t ** uscfp = umcf->upstreams.elts;
+	ngx_http_upstream_rr_peers_t * peers;
+	ngx_http_upstream_rr_peer_t * peer;
+	ngx_uint_t i , n = 0;
+	ngx_str_t * label;
+
+	for (i = 0; i < umcf->upstreams.nelts; i++) {
+		for (peers = uscfp[i]->peer.data; peers != NULL; peers = peers->next) {
+			for (peer = peers->peer; peer != NULL; peer = peer->next) {
+				if (table != NULL) {
+					table[n] = &peer->name;
+				}
+
+				if (names != NULL) {
+					label = ngx_array_push(names);
+					if (label == NULL) {
+						return NGX_ERROR;
+					}
+
+					label->len = sizeof("upstream=\"\",peer=\"\"") - 1 + uscfp[i]->host.len + peer->name.len;
+					label->data = ngx_pnalloc(names->pool , label->len);
+					if (label->data == NULL) {
+						return NGX_ERROR;
+					}
+
+					(void)ngx_sprintf(label->data , "upstream=\"%V\",peer=\"%V\"" , &uscfp[i]->host , &peer->name);
+				}
+
+				n++;
+			}
+		}
+	}
+
+	return n;
+}
+
+static int ngx_libc_cdecl ngx_http_metrics_peer_key_cmp(const void * one , const void * two) {
+	const ngx_http_metrics_peer_key_t * a = one , * b = two;
+
+	if (a->name == b->name) {
+		return 0;
+	}
+
+	return (uintptr_t)a->name < (uintptr_t)b->name ? -1 : 1;
+}
+
+static ngx_int_t ngx_http_metrics_find_peer(ngx_str_t * name) {
+	ngx_uint_t lo = 0 , hi = ngx_http_metrics_npeers , mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+
+		if (ngx_http_metrics_peer_keys[mid].name == name) {
+			return ngx_http_metrics_peer_keys[mid].index;
+		}
+
+		if ((uintptr_t)ngx_http_metrics_peer_keys[mid].name < (uintptr_t)name) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return NGX_ERROR;
+}
+
+/*
+ * Accounts every upstream attempt of the request to the peer that served
+ * it: the request, a 5xx or failed attempt as an error, the bytes read
+ * and the connect, header and response times that were reached.  An
+ * attempt cut short by the client has no status and no response time.
+ * Peers resolved at run time are not in the table and are not accounted.
+ */
+
+void ngx_http_metrics_account_peers(ngx_http_request_t * r) {
+	ngx_http_upstream_state_t * state;
+	ngx_uint_t i;
+	ngx_int_t peer;
+
+	if (r->upstream_states == NULL || ngx_http_metrics_npeers == 0) {
+		return;
+	}
+
+	state = r->upstream_states->elts;
+
+	for (i = 0; i < r->upstream_states->nelts; i++) {
+		if (state[i].peer == NULL) {
+			continue;
+		}
+
+		peer = ngx_http_metrics_find_peer(state[i].peer);
+		if (peer == NGX_ERROR) {
+			continue;
+		}
+
+		ngx_metrics_peer_add(peer , NGX_METRICS_PEER_REQUESTS , 1);
+		ngx_metrics_peer_add(peer , NGX_METRICS_PEER_BYTES_RECEIVED , (ngx_atomic_int_t)state[i].bytes_received);
+
+		if (state[i].status >= NGX_HTTP_INTERNAL_SERVER_ERROR) {
+			ngx_metrics_peer_add(peer , NGX_METRICS_PEER_ERRORS , 1);
+		}
+
+		if (state[i].connect_time != (ngx_msec_t) -1) {
+			ngx_metrics_peer_observe(peer , NGX_METRICS_PEER_CONNECT , state[i].connect_time);
+		}
+
+		if (state[i].header_time != (ngx_msec_t) -1) {
+			ngx_metrics_peer_observe(peer , NGX_METRICS_PEER_HEADER , state[i].header_time);
+		}
+
+		if (state[i].status != 0) {
+			ngx_metrics_peer_observe(peer , NGX_METRICS_PEER_RESPONSE , state[i].response_time);
+		}
+	}
+}
@@ -0,0 +1,1000 @@
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <ngx_http_metrics.h>
+
+#define NGX_HTTP_METRICS_SCRAPE_BUF	(16 * 1024)
+#define NGX_HTTP_METRICS_SCRAPE_LINE	128
+
+#define NGX_HTTP_METRICS_SCRAPE_PROMETHEUS	0
+#define NGX_HTTP_METRICS_SCRAPE_BINARY	1
+
+#define NGX_HTTP_METRICS_SCRAPE_BIN_VERSION	8
+#define NGX_HTTP_METRICS_SCRAPE_BIN_HEADER	16
+#define NGX_HTTP_METRICS_SCRAPE_BIN_RECORD	12
+#define NGX_HTTP_METRICS_SCRAPE_BIN_LABELS_RECORD	30
+#define NGX_HTTP_METRICS_SCRAPE_BIN_SKETCH_RECORD	22
+#define NGX_HTTP_METRICS_SCRAPE_BIN_QUANTILE	12
+#define NGX_HTTP_METRICS_SCRAPE_BIN_RATE_RECORD	(4 + NGX_METRICS_RATE_WINDOWS * 16)
+
+/* the metric families of the prometheus format, each rendered into its own chain */
+
+#define NGX_HTTP_METRICS_PEER_FAMILY	(NGX_METRICS_NCOUNTERS + NGX_METRICS_NHIST)
+#define NGX_HTTP_METRICS_STREAM_FAMILY	(NGX_HTTP_METRICS_PEER_FAMILY + NGX_METRICS_PEER_NCOUNTERS + NGX_METRICS_PEER_NHIST)
+#define NGX_HTTP_METRICS_LABELS_FAMILY	(NGX_HTTP_METRICS_STREAM_FAMILY + NGX_METRICS_STREAM_NCOUNTERS + 1)
+#define NGX_HTTP_METRICS_SKETCH_FAMILY	(NGX_HTTP_METRICS_LABELS_FAMILY + NGX_METRICS_NCOUNTERS)
+#define NGX_HTTP_METRICS_UNIQUE_FAMILY	(NGX_HTTP_METRICS_SKETCH_FAMILY + 1)
+#define NGX_HTTP_METRICS_RATE_FAMILY	(NGX_HTTP_METRICS_UNIQUE_FAMILY + 1)
+#define NGX_HTTP_METRICS_FAMILIES	(NGX_HTTP_METRICS_RATE_FAMILY + 2)
+
+#define ngx_http_metrics_family_is_counter(k)	\
+	((k) < NGX_METRICS_NCOUNTERS	\
+		|| ((k) >= NGX_HTTP_METRICS_PEER_FAMILY && (k) < NGX_HTTP_METRICS_PEER_FAMILY + NGX_METRICS_PEER_NCOUNTERS)	\
+		|| ((k) >= NGX_HTTP_METRICS_STREAM_FAMILY && (k) < NGX_HTTP_METRICS_STREAM_FAMILY + NGX_METRICS_STREAM_NCOUNTERS)	\
+		|| ((k) >= NGX_HTTP_METRICS_LABELS_FAMILY && (k) < NGX_HTTP_METRICS_SKETCH_FAMILY))
+
+#define ngx_http_metrics_family_type(k)	\
+	(ngx_http_metrics_family_is_counter(k) ? "counter" : (k) == NGX_HTTP_METRICS_SKETCH_FAMILY ? "summary"	\
+		: (k) >= NGX_HTTP_METRICS_UNIQUE_FAMILY ? "gauge" : "histogram")
+
+typedef struct tag_ngx_http_metrics_scrape_conf {
+	ngx_uint_t format;
+} ngx_http_metrics_scrape_conf_t;
+
+typedef struct tag_ngx_http_metrics_out {
+	ngx_chain_t * first;
+	ngx_chain_t ** last;
+	ngx_buf_t * buf;
+} ngx_http_metrics_out_t;
+
+static void * ngx_http_metrics_scrape_create_conf(ngx_conf_t * cf);
+static char * ngx_http_metrics_scrape(ngx_conf_t * cf , ngx_command_t * cmd , void * conf);
+static ngx_int_t ngx_http_metrics_scrape_handler(ngx_http_request_t * r);
+static ngx_int_t ngx_http_metrics_render_prometheus(ngx_http_request_t * r , ngx_metrics_sh_t * sh ,
+	ngx_http_metrics_out_t * out);
+static ngx_int_t ngx_http_metrics_render_binary(ngx_http_request_t * r , ngx_metrics_sh_t * sh ,
+	ngx_http_metrics_out_t * out);
+static ngx_int_t ngx_http_metrics_append_record(ngx_http_request_t * r , ngx_http_metrics_out_t * out ,
+	uint32_t id , ngx_atomic_uint_t value , uint32_t * count);
+static ngx_int_t ngx_http_metrics_render_value(ngx_http_request_t * r , ngx_http_metrics_out_t * f ,
+	ngx_str_t * name , ngx_str_t * labels , ngx_atomic_uint_t value);
+static ngx_int_t ngx_http_metrics_render_histogram(ngx_http_request_t * r , ngx_http_metrics_out_t * f ,
+	ngx_str_t * name , ngx_str_t * labels , ngx_atomic_t * hist);
+static ngx_int_t ngx_http_metrics_label_set(ngx_http_request_t * r , ngx_array_t * names , ngx_metrics_labelset_t * ls ,
+	ngx_uint_t id , ngx_str_t * labels);
+static ngx_int_t ngx_http_metrics_render_sketch(ngx_http_request_t * r , ngx_http_metrics_out_t * f ,
+	ngx_str_t * name , ngx_str_t * labels , ngx_metrics_sh_t * sh , ngx_uint_t slot);
+static ngx_atomic_uint_t ngx_http_metrics_copy_sketch(ngx_metrics_sh_t * sh , ngx_uint_t slot ,
+	ngx_atomic_uint_t * sketch);
+static ngx_int_t ngx_http_metrics_render_rates(ngx_http_request_t * r , ngx_http_metrics_out_t * families ,
+	ngx_str_t * labels , ngx_metrics_sh_t * sh , ngx_uint_t slot);
+static u_char * ngx_http_metrics_reserve(ngx_http_request_t * r , ngx_http_metrics_out_t * out , size_t len);
+
+static ngx_str_t ngx_http_metrics_family_names[NGX_HTTP_METRICS_FAMILIES] = {
+	ngx_string("nginx_metrics_requests_total"),
+	ngx_string("nginx_metrics_sent_bytes_total"),
+	ngx_string("nginx_metrics_received_bytes_total"),
+	ngx_string("nginx_metrics_request_time_milliseconds"),
+	ngx_string("nginx_metrics_upstream_response_time_milliseconds"),
+	ngx_string("nginx_metrics_upstream_peer_requests_total"),
+	ngx_string("nginx_metrics_upstream_peer_errors_total"),
+	ngx_string("nginx_metrics_upstream_peer_received_bytes_total"),
+	ngx_string("nginx_metrics_upstream_peer_connect_time_milliseconds"),
+	ngx_string("nginx_metrics_upstream_peer_header_time_milliseconds"),
+	ngx_string("nginx_metrics_upstream_peer_response_time_milliseconds"),
+	ngx_string("nginx_metrics_stream_sessions_total"),
+	ngx_string("nginx_metrics_stream_received_bytes_total"),
+	ngx_string("nginx_metrics_stream_sent_bytes_total"),
+	ngx_string("nginx_metrics_stream_connect_failures_total"),
+	ngx_string("nginx_metrics_stream_session_time_milliseconds"),
+	ngx_string("nginx_metrics_labeled_requests_total"),
+	ngx_string("nginx_metrics_labeled_sent_bytes_total"),
+	ngx_string("nginx_metrics_labeled_received_bytes_total"),
+	ngx_string("nginx_metrics_request_time_quantiles_milliseconds"),
+	ngx_string("nginx_metrics_unique_clients"),
+	ngx_string("nginx_metrics_request_rate"),
+	ngx_string("nginx_metrics_request_time_average_milliseconds")
+};
+
+static ngx_str_t ngx_http_metrics_rate_windows[NGX_METRICS_RATE_WINDOWS] = {
+	ngx_string("1m"),
+	ngx_string("5m"),
+	ngx_string("15m")
+};
+
+static ngx_command_t  ngx_http_metrics_scrape_commands[] = {
+    {
+    	ngx_string("metrics_scrape"),
+    	NGX_HTTP_LOC_CONF | NGX_CONF_NOARGS | NGX_CONF_TAKE1,
+    	ngx_http_metrics_scrape,
+    	NGX_HTTP_LOC_CONF_OFFSET,
+    	0,
+    	NULL
+    },
+    ngx_null_command
+};
+
+static ngx_http_module_t  ngx_http_metrics_scrape_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    NULL,                                  /* postconfiguration */
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+    NULL,                                  /* create server configuration */
+    NULL,                                  /* merge server configuration */
+    ngx_http_metrics_scrape_create_conf,   /* create location configuration */
+    NULL                                   /* merge location configuration */
+};
+
+ngx_module_t ngx_http_metrics_scrape_module = {
+    NGX_MODULE_V1,
+    &ngx_http_metrics_scrape_module_ctx,   /* module context */
+    ngx_http_metrics_scrape_commands,      /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+static void * ngx_http_metrics_scrape_create_conf(ngx_conf_t * cf) {
+	ngx_http_metrics_scrape_conf_t * mscf = ngx_pcalloc(cf->pool , sizeof(ngx_http_metrics_scrape_conf_t));
+	if (mscf == NULL) {
+		return NULL;
+	}
+
+	return mscf;
+}
+
+/*
+ * metrics_scrape [prometheus|binary]
+ */
+
+static char * ngx_http_metrics_scrape(ngx_conf_t * cf , ngx_command_t * cmd , void * conf) {
+	ngx_http_metrics_scrape_conf_t * mscf = (ngx_http_metrics_scrape_conf_t *)conf;
+	ngx_http_core_loc_conf_t * clcf;
+	ngx_str_t * value = cf->args->elts;
+
+	if (cf->args->nelts == 2) {
+		if (ngx_strcmp(value[1].data , "binary") == 0) {
+			mscf->format = NGX_HTTP_METRICS_SCRAPE_BINARY;
+
+		} else if (ngx_strcmp(value[1].data , "prometheus") != 0) {
+			ngx_conf_log_error(NGX_LOG_EMERG , cf , 0 , "invalid format \"%V\"" , &value[1]);
+
+			return NGX_CONF_ERROR;
+		}
+	}
+
+	if (ngx_metrics_add_zone(cf) == NULL) {
+		return NGX_CONF_ERROR;
+	}
+
+	clcf = ngx_http_conf_get_module_loc_conf(cf , ngx_http_core_module);
+	clcf->handler = ngx_http_metrics_scrape_handler;
+
+	return NGX_CONF_OK;
+}
+
+/*
+ * Renders the totals kept by the aggregator in one pass and without locks.
+ * The totals only grow, so every scrape sees monotonic counters; they lag
+ * the live shards by at most one export interval.
+ */
+
+static ngx_int_t ngx_http_metrics_scrape_handler(ngx_http_request_t * r) {
+	ngx_http_metrics_scrape_conf_t * mscf = ngx_http_get_module_loc_conf(r , ngx_http_metrics_scrape_module);
+	ngx_http_metrics_out_t out;
+	ngx_chain_t * cl;
+	ngx_int_t rc;
+
+	if (!(r->method & (NGX_HTTP_GET | NGX_HTTP_HEAD))) {
+		return NGX_HTTP_NOT_ALLOWED;
+	}
+
+	rc = ngx_http_discard_request_body(r);
+	if (rc != NGX_OK) {
+		return rc;
+	}
+
+	if (ngx_metrics_sh == NULL) {
+		return NGX_HTTP_SERVICE_UNAVAILABLE;
+	}
+
+	if (mscf->format == NGX_HTTP_METRICS_SCRAPE_BINARY) {
+		ngx_str_set(&r->headers_out.content_type , "application/octet-stream");
+	} else {
+		ngx_str_set(&r->headers_out.content_type , "text/plain; version=0.0.4");
+	}
+
+	r->headers_out.content_type_len = r->headers_out.content_type.len;
+	r->headers_out.content_type_lowcase = NULL;
+	r->headers_out.status = NGX_HTTP_OK;
+
+	if (r->method == NGX_HTTP_HEAD) {
+		return ngx_http_send_header(r);
+	}
+
+	ngx_memzero(&out , sizeof(ngx_http_metrics_out_t));
+	out.last = &out.first;
+
+	if (mscf->format == NGX_HTTP_METRICS_SCRAPE_BINARY) {
+		rc = ngx_http_metrics_render_binary(r , ngx_metrics_sh , &out);
+	} else {
+		rc = ngx_http_metrics_render_prometheus(r , ngx_metrics_sh , &out);
+	}
+
+	if (rc != NGX_OK) {
+		return NGX_HTTP_INTERNAL_SERVER_ERROR;
+	}
+
+	out.buf->last_buf = (r == r->main) ? 1 : 0;
+	out.buf->last_in_chain = 1;
+
+	r->headers_out.content_length_n = 0;
+
+	for (cl = out.first; cl != NULL; cl = cl->next) {
+		r->headers_out.content_length_n += cl->buf->last - cl->buf->pos;
+	}
+
+	rc = ngx_http_send_header(r);
+	if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+		return rc;
+	}
+
+	return ngx_http_output_filter(r , out.first);
+}
+
+static ngx_int_t ngx_http_metrics_render_prometheus(ngx_http_request_t * r , ngx_metrics_sh_t * sh ,
+	ngx_http_metrics_out_t * out) {
+	ngx_http_metrics_out_t families[NGX_HTTP_METRICS_FAMILIES] , * f;
+	ngx_array_t * names;
+	ngx_atomic_t * total;
+	ngx_uint_t i , k , n;
+	u_char label[NGX_HTTP_METRICS_SCRAPE_LINE];
+	ngx_str_t labels;
+	ngx_int_t rc;
+	u_char * p;
+
+	for (k = 0; k < NGX_HTTP_METRICS_FAMILIES; k++) {
+		f = &families[k];
+		ngx_memzero(f , sizeof(ngx_http_metrics_out_t));
+		f->last = &f->first;
+
+		p = ngx_http_metrics_reserve(r , f , NGX_HTTP_METRICS_SCRAPE_LINE);
+		if (p == NULL) {
+			return NGX_ERROR;
+		}
+
+		f->buf->last = ngx_sprintf(p , "# TYPE %V %s\n" , &ngx_http_metrics_family_names[k] ,
+			ngx_http_metrics_family_type(k));
+	}
+
+	labels.data = label;
+
+	for (i = 0; i < sh->nslots; i++) {
+		if (ngx_metrics_total(sh , i , NGX_METRICS_REQUESTS) == 0) {
+			continue;
+		}
+
+		labels.len = ngx_sprintf(label , "slot=\"%ui\"" , i) - label;
+
+		for (k = 0; k < NGX_METRICS_NCOUNTERS; k++) {
+			if (ngx_http_metrics_render_value(r , &families[k] , &ngx_http_metrics_family_names[k] , &labels ,
+				ngx_metrics_total(sh , i , k)) != NGX_OK) {
+				return NGX_ERROR;
+			}
+		}
+
+		if (i < sh->nsketch && ngx_http_metrics_render_sketch(r , &families[NGX_HTTP_METRICS_SKETCH_FAMILY] ,
+			&ngx_http_metrics_family_names[NGX_HTTP_METRICS_SKETCH_FAMILY] , &labels , sh , i) != NGX_OK) {
+			return NGX_ERROR;
+		}
+
+		/* the distinct clients of the last interval */
+
+		if (i < sh->nunique && ngx_metrics_unique_total(sh , i) != 0
+			&& ngx_http_metrics_render_value(r , &families[NGX_HTTP_METRICS_UNIQUE_FAMILY] ,
+			&ngx_http_metrics_family_names[NGX_HTTP_METRICS_UNIQUE_FAMILY] , &labels , ngx_metrics_unique_total(sh , i))
+			!= NGX_OK) {
+			return NGX_ERROR;
+		}
+
+		if (i < sh->nrates && ngx_http_metrics_render_rates(r , families , &labels , sh , i) != NGX_OK) {
+			return NGX_ERROR;
+		}
+
+		if (i >= sh->nhist) {
+			continue;
+		}
+
+		for (k = 0; k < NGX_METRICS_NHIST; k++) {
+			if (ngx_http_metrics_render_histogram(r , &families[NGX_METRICS_NCOUNTERS + k] ,
+				&ngx_http_metrics_family_names[NGX_METRICS_NCOUNTERS + k] , &labels ,
+				ngx_metrics_hist_total(sh , i , k)) != NGX_OK) {
+				return NGX_ERROR;
+			}
+		}
+	}
+
+	/* the peers and the stream servers and upstreams are labeled by the names of their rows */
+
+	n = ngx_min(sh->rows_used[NGX_METRICS_ROWS_PEERS] , sh->npeers);
+
+	for (i = 0; i < n; i++) {
+		total = ngx_metrics_peer_total(sh , i);
+
+		if (total[NGX_METRICS_PEER_REQUESTS] == 0) {
+			continue;
+		}
+
+		labels.len = sh->rows[NGX_METRICS_ROWS_PEERS][i].len;
+		labels.data = sh->rows[NGX_METRICS_ROWS_PEERS][i].name;
+
+		for (k = 0; k < NGX_METRICS_PEER_NCOUNTERS; k++) {
+			if (ngx_http_metrics_render_value(r , &families[NGX_HTTP_METRICS_PEER_FAMILY + k] ,
+				&ngx_http_metrics_family_names[NGX_HTTP_METRICS_PEER_FAMILY + k] , &labels , total[k]) != NGX_OK) {
+				return NGX_ERROR;
+			}
+		}
+
+		for (k = 0; k < NGX_METRICS_PEER_NHIST; k++) {
+			f = &families[NGX_HTTP_METRICS_PEER_FAMILY + NGX_METRICS_PEER_NCOUNTERS + k];
+
+			if (ngx_http_metrics_render_histogram(r , f ,
+				&ngx_http_metrics_family_names[NGX_HTTP_METRICS_PEER_FAMILY + NGX_METRICS_PEER_NCOUNTERS + k] ,
+				&labels , total + NGX_METRICS_PEER_NCOUNTERS + k * NGX_METRICS_HIST_WORDS) != NGX_OK) {
+				return NGX_ERROR;
+			}
+		}
+	}
+
+	n = ngx_min(sh->rows_used[NGX_METRICS_ROWS_STREAM] , sh->nstream);
+
+	for (i = 0; i < n; i++) {
+		total = ngx_metrics_stream_total(sh , i);
+
+		if (total[NGX_METRICS_STREAM_SESSIONS] == 0) {
+			continue;
+		}
+
+		labels.len = sh->rows[NGX_METRICS_ROWS_STREAM][i].len;
+		labels.data = sh->rows[NGX_METRICS_ROWS_STREAM][i].name;
+
+		for (k = 0; k < NGX_METRICS_STREAM_NCOUNTERS; k++) {
+			if (ngx_http_metrics_render_value(r , &families[NGX_HTTP_METRICS_STREAM_FAMILY + k] ,
+				&ngx_http_metrics_family_names[NGX_HTTP_METRICS_STREAM_FAMILY + k] , &labels ,
+				total[k]) != NGX_OK) {
+				return NGX_ERROR;
+			}
+		}
+
+		if (ngx_http_metrics_render_histogram(r , &families[NGX_HTTP_METRICS_STREAM_FAMILY + NGX_METRICS_STREAM_NCOUNTERS] ,
+			&ngx_http_metrics_family_names[NGX_HTTP_METRICS_STREAM_FAMILY + NGX_METRICS_STREAM_NCOUNTERS] ,
+			&labels , total + NGX_METRICS_STREAM_NCOUNTERS) != NGX_OK) {
+			return NGX_ERROR;
+		}
+	}
+
+	/* the label sets are named by the metrics_label directives of this worker */
+
+	names = ngx_http_metrics_get_labels();
+	n = names != NULL ? ngx_min(sh->labels_used , sh->nlabels) : 0;
+
+	for (i = 0; i < n; i++) {
+		if (ngx_metrics_label_total(sh , i , NGX_METRICS_REQUESTS) == 0) {
+			continue;
+		}
+
+		rc = ngx_http_metrics_label_set(r , names , &sh->labelsets[i] , i , &labels);
+		if (rc == NGX_DECLINED) {
+			continue;
+		}
+
+		if (rc != NGX_OK) {
+			return NGX_ERROR;
+		}
+
+		for (k = 0; k < NGX_METRICS_NCOUNTERS; k++) {
+			if (ngx_http_metrics_render_value(r , &families[NGX_HTTP_METRICS_LABELS_FAMILY + k] ,
+				&ngx_http_metrics_family_names[NGX_HTTP_METRICS_LABELS_FAMILY + k] , &labels ,
+				ngx_metrics_label_total(sh , i , k)) != NGX_OK) {
+				return NGX_ERROR;
+			}
+		}
+	}
+
+	for (k = 0; k < NGX_HTTP_METRICS_FAMILIES; k++) {
+		*out->last = families[k].first;
+		out->last = families[k].last;
+		out->buf = families[k].buf;
+	}
+
+	return NGX_OK;
+}
+
+static ngx_int_t ngx_http_metrics_render_value(ngx_http_request_t * r , ngx_http_metrics_out_t * f ,
+	ngx_str_t * name , ngx_str_t * labels , ngx_atomic_uint_t value) {
+	u_char * p = ngx_http_metrics_reserve(r , f , NGX_HTTP_METRICS_SCRAPE_LINE + labels->len);
+
+	if (p == NULL) {
+		return NGX_ERROR;
+	}
+
+	f->buf->last = ngx_sprintf(p , "%V{%V} %uA\n" , name , labels , value);
+
+	return NGX_OK;
+}
+
+/*
+ * Renders the configured quantiles of the sketch of a slot over all the
+ * intervals so far, in milliseconds, then the sum and the count.
+ */
+
+static ngx_int_t ngx_http_metrics_render_sketch(ngx_http_request_t * r , ngx_http_metrics_out_t * f ,
+	ngx_str_t * name , ngx_str_t * labels , ngx_metrics_sh_t * sh , ngx_uint_t slot) {
+	ngx_metrics_conf_t * mcf = (ngx_metrics_conf_t *)ngx_get_conf(ngx_cycle->conf_ctx , ngx_metrics_module);
+	ngx_atomic_uint_t sketch[NGX_METRICS_SKETCH_WORDS] , count;
+	ngx_uint_t k;
+	uint64_t v;
+	u_char * p;
+
+	count = ngx_http_metrics_copy_sketch(sh , slot , sketch);
+	if (count == 0) {
+		return NGX_OK;
+	}
+
+	for (k = 0; k < mcf->nquantiles; k++) {
+		v = ngx_metrics_sketch_quantile(sh , sketch , count , mcf->quantiles[k]);
+
+		p = ngx_http_metrics_reserve(r , f , NGX_HTTP_METRICS_SCRAPE_LINE + labels->len + mcf->quantile_names[k].len);
+		if (p == NULL) {
+			return NGX_ERROR;
+		}
+
+		f->buf->last = ngx_sprintf(p , "%V{%V,quantile=\"%V\"} %uL.%03uL\n" , name , labels , &mcf->quantile_names[k] ,
+			v / 1000 , v % 1000);
+	}
+
+	p = ngx_http_metrics_reserve(r , f , 2 * (NGX_HTTP_METRICS_SCRAPE_LINE + labels->len));
+	if (p == NULL) {
+		return NGX_ERROR;
+	}
+
+	f->buf->last = ngx_sprintf(p , "%V_sum{%V} %uA\n%V_count{%V} %uA\n" , name , labels , sketch[NGX_METRICS_SKETCH_SUM] ,
+		name , labels , count);
+
+	return NGX_OK;
+}
+
+/*
+ * Renders the moving averages of a slot, the requests per second and,
+ * for the slots with histograms, their average time in milliseconds.
+ */
+
+static ngx_int_t ngx_http_metrics_render_rates(ngx_http_request_t * r , ngx_http_metrics_out_t * families ,
+	ngx_str_t * labels , ngx_metrics_sh_t * sh , ngx_uint_t slot) {
+	ngx_http_metrics_out_t * f;
+	ngx_atomic_uint_t v;
+	ngx_uint_t w , k;
+	u_char * p;
+
+	for (k = 0; k < 2; k++) {
+		if (k == 1 && slot >= sh->nhist) {
+			break;
+		}
+
+		f = &families[NGX_HTTP_METRICS_RATE_FAMILY + k];
+
+		for (w = 0; w < NGX_METRICS_RATE_WINDOWS; w++) {
+			v = k == 0 ? ngx_metrics_rate(sh , slot , w) : ngx_metrics_rate_latency(sh , slot , w);
+
+			p = ngx_http_metrics_reserve(r , f , NGX_HTTP_METRICS_SCRAPE_LINE + labels->len);
+			if (p == NULL) {
+				return NGX_ERROR;
+			}
+
+			f->buf->last = ngx_sprintf(p , "%V{%V,window=\"%V\"} %uA.%03uA\n" ,
+				&ngx_http_metrics_family_names[NGX_HTTP_METRICS_RATE_FAMILY + k] , labels ,
+				&ngx_http_metrics_rate_windows[w] , v / 1000 , v % 1000);
+		}
+	}
+
+	return NGX_OK;
+}
+
+/*
+ * Copies the totals of a sketch, for the quantiles to be estimated from
+ * a consistent set of buckets, and returns their count.
+ */
+
+static ngx_atomic_uint_t ngx_http_metrics_copy_sketch(ngx_metrics_sh_t * sh , ngx_uint_t slot ,
+	ngx_atomic_uint_t * sketch) {
+	ngx_atomic_t * total = ngx_metrics_sketch_total(sh , slot);
+	ngx_atomic_uint_t count = 0;
+	ngx_uint_t k;
+
+	for (k = 0; k < NGX_METRICS_SKETCH_WORDS; k++) {
+		sketch[k] = total[k];
+
+		if (k < NGX_METRICS_SKETCH_BUCKETS) {
+			count += sketch[k];
+		}
+	}
+
+	return count;
+}
+
+/*
+ * Pairs the values in the key of a label set with the label names, the
+ * overflow set having "__overflow__" for all of them.  A key that does
+ * not have a value for every name was made by another configuration and
+ * is skipped.
+ */
+
+static ngx_int_t ngx_http_metrics_label_set(ngx_http_request_t * r , ngx_array_t * names , ngx_metrics_labelset_t * ls ,
+	ngx_uint_t id , ngx_str_t * labels) {
+	ngx_http_metrics_label_t * name = names->elts;
+	ngx_str_t overflow = ngx_string("__overflow__");
+	ngx_uint_t i;
+	u_char * key , * end , * p , * v;
+	size_t len;
+
+	key = ls->key;
+	end = ls->key + ls->len;
+	len = 0;
+
+	for (i = 0; i < names->nelts; i++) {
+		if (id == NGX_METRICS_LABELS_OVERFLOW) {
+			len += overflow.len;
+
+		} else {
+			if (key >= end || (size_t)(end - key) < (size_t)1 + *key) {
+				return NGX_DECLINED;
+			}
+
+			len += 2 * *key;
+			key += 1 + *key;
+		}
+
+		len += sizeof(",=\"\"") - 1 + name[i].name.len;
+	}
+
+	if (id != NGX_METRICS_LABELS_OVERFLOW && key != end) {
+		return NGX_DECLINED;
+	}
+
+	labels->data = ngx_pnalloc(r->pool , len);
+	if (labels->data == NULL) {
+		return NGX_ERROR;
+	}
+
+	p = labels->data;
+	key = ls->key;
+
+	for (i = 0; i < names->nelts; i++) {
+		if (i > 0) {
+			*p++ = ',';
+		}
+
+		p = ngx_sprintf(p , "%V=\"" , &name[i].name);
+
+		if (id == NGX_METRICS_LABELS_OVERFLOW) {
+			p = ngx_cpymem(p , overflow.data , overflow.len);
+
+		} else {
+			for (v = key + 1; v < key + 1 + *key; v++) {
+				if (*v == '"' || *v == '\\') {
+					*p++ = '\\';
+					*p++ = *v;
+
+				} else if (*v == '\n') {
+					*p++ = '\\';
+					*p++ = 'n';
+
+				} else {
+					*p++ = *v;
+				}
+			}
+
+			key += 1 + *key;
+		}
+
+		*p++ = '"';
+	}
+
+	labels->len = p - labels->data;
+
+	return NGX_OK;
+}
+
+/*
+ * Renders the cumulative buckets up to the highest one in use, then the
+ * sum and the count.  The buckets are read once, so the cumulative counts
+ * are consistent.
+ */
+
+static ngx_int_t ngx_http_metrics_render_histogram(ngx_http_request_t * r , ngx_http_metrics_out_t * f ,
+	ngx_str_t * name , ngx_str_t * labels , ngx_atomic_t * hist) {
+	ngx_atomic_uint_t count = 0;
+	ngx_uint_t b , top = 0;
+	u_char * p;
+
+	for (b = 0; b < NGX_METRICS_HIST_BUCKETS; b++) {
+		if (hist[b] != 0) {
+			top = b + 1;
+		}
+	}
+
+	if (top == 0) {
+		return NGX_OK;
+	}
+
+	for (b = 0; b < top && b < NGX_METRICS_HIST_BUCKETS - 1; b++) {
+		count += hist[b];
+
+		p = ngx_http_metrics_reserve(r , f , NGX_HTTP_METRICS_SCRAPE_LINE + labels->len);
+		if (p == NULL) {
+			return NGX_ERROR;
+		}
+
+		f->buf->last = ngx_sprintf(p , "%V_bucket{%V,le=\"%M\"} %uA\n" , name , labels ,
+			ngx_metrics_hist_lower(b + 1) , count);
+	}
+
+	for ( /* void */ ; b < top; b++) {
+		count += hist[b];
+	}
+
+	p = ngx_http_metrics_reserve(r , f , 3 * (NGX_HTTP_METRICS_SCRAPE_LINE + labels->len));
+	if (p == NULL) {
+		return NGX_ERROR;
+	}
+
+	f->buf->last = ngx_sprintf(p , "%V_bucket{%V,le=\"+Inf\"} %uA\n%V_sum{%V} %uA\n%V_count{%V} %uA\n" ,
+		name , labels , count , name , labels , (ngx_atomic_uint_t)hist[NGX_METRICS_HIST_SUM] , name , labels , count);
+
+	return NGX_OK;
+}
+
+/*
+ * "NGXS" | version:8 | reserved:24 | time:32 | count:32 | count x (id:32 | value:64) |
+ *     peer count:32 | peer count x (id:32 | value:64) |
+ *     stream count:32 | stream count x (id:32 | value:64) |
+ *     label count:32 | label count x (id:32 | requests:64 | sent:64 | received:64 | key length:16 | key) |
+ *     sketch count:32 | sketch count x (slot:32 | count:64 | sum:64 | n:16 | n x (quantile:32 | value:64)) |
+ *     unique count:32 | unique count x (slot:32 | value:64) |
+ *     rate count:32 | rate count x (slot:32 | 3 x (requests per second:64 | average time:64)) |
+ *     trace count:32 | trace count x trace
+ *
+ * in network byte order, with the record ids of the binary export format
+ * and cumulative values, but for the distinct clients of the last interval
+ * and the moving averages over 1, 5 and 15 minutes, in thousandths of a
+ * request per second and microseconds.
+ * The peer, stream, label, sketch and unique records are those of kinds 2
+ * to 6, and the traces those of kind 8, the ones in the rings of all the
+ * shards, oldest first within a shard.  A trace is scraped as long as it
+ * is in its ring.
+ */
+
+static ngx_int_t ngx_http_metrics_render_binary(ngx_http_request_t * r , ngx_metrics_sh_t * sh ,
+	ngx_http_metrics_out_t * out) {
+	ngx_metrics_conf_t * mcf = (ngx_metrics_conf_t *)ngx_get_conf(ngx_cycle->conf_ctx , ngx_metrics_module);
+	ngx_atomic_uint_t sketch[NGX_METRICS_SKETCH_WORDS] , observed;
+	ngx_metrics_labelset_t * ls;
+	ngx_atomic_t * hist , * total;
+	ngx_uint_t i , k , b , n;
+	uint32_t count = 0 , npeers = 0 , nstream = 0 , nlabels = 0 , nsketch = 0 , nunique = 0 , nrates = 0 , ntraces = 0;
+	u_char * header , * peers , * streams , * labels , * sketches , * uniques , * rates , * traces , * p;
+	ngx_metrics_trace_t * trace;
+	ngx_atomic_uint_t next;
+	uint64_t v;
+
+	header = ngx_http_metrics_reserve(r , out , NGX_HTTP_METRICS_SCRAPE_BIN_HEADER);
+	if (header == NULL) {
+		return NGX_ERROR;
+	}
+
+	out->buf->last += NGX_HTTP_METRICS_SCRAPE_BIN_HEADER;
+
+	for (i = 0; i < sh->nslots; i++) {
+		if (ngx_metrics_total(sh , i , NGX_METRICS_REQUESTS) == 0) {
+			continue;
+		}
+
+		for (k = 0; k < NGX_METRICS_NCOUNTERS; k++) {
+			if (ngx_http_metrics_append_record(r , out , ngx_metrics_bin_id(NGX_METRICS_BIN_COUNTER , k , i) ,
+				ngx_metrics_total(sh , i , k) , &count) != NGX_OK) {
+				return NGX_ERROR;
+			}
+		}
+
+		if (i >= sh->nhist) {
+			continue;
+		}
+
+		for (k = 0; k < NGX_METRICS_NHIST; k++) {
+			hist = ngx_metrics_hist_total(sh , i , k);
+
+			for (b = 0; b < NGX_METRICS_HIST_BUCKETS; b++) {
+				if (ngx_http_metrics_append_record(r , out , ngx_metrics_bin_id(NGX_METRICS_BIN_HIST + k , b , i) ,
+					hist[b] , &count) != NGX_OK) {
+					return NGX_ERROR;
+				}
+			}
+
+			if (ngx_http_metrics_append_record(r , out , ngx_metrics_bin_id(NGX_METRICS_BIN_HIST_SUM , k , i) ,
+				hist[NGX_METRICS_HIST_SUM] , &count) != NGX_OK) {
+				return NGX_ERROR;
+			}
+		}
+	}
+
+	peers = ngx_http_metrics_reserve(r , out , sizeof(uint32_t));
+	if (peers == NULL) {
+		return NGX_ERROR;
+	}
+
+	out->buf->last += sizeof(uint32_t);
+
+	for (i = 0; i < sh->npeers; i++) {
+		total = ngx_metrics_peer_total(sh , i);
+
+		if (total[NGX_METRICS_PEER_REQUESTS] == 0) {
+			continue;
+		}
+
+		for (k = 0; k < NGX_METRICS_PEER_WORDS; k++) {
+			if (ngx_http_metrics_append_record(r , out , ngx_metrics_peer_bin_id(k , i) , total[k] , &npeers) != NGX_OK) {
+				return NGX_ERROR;
+			}
+		}
+	}
+
+	(void)ngx_metrics_put32(peers , npeers);
+
+	streams = ngx_http_metrics_reserve(r , out , sizeof(uint32_t));
+	if (streams == NULL) {
+		return NGX_ERROR;
+	}
+
+	out->buf->last += sizeof(uint32_t);
+
+	for (i = 0; i < sh->nstream; i++) {
+		total = ngx_metrics_stream_total(sh , i);
+
+		if (total[NGX_METRICS_STREAM_SESSIONS] == 0) {
+			continue;
+		}
+
+		for (k = 0; k < NGX_METRICS_STREAM_WORDS; k++) {
+			if (ngx_http_metrics_append_record(r , out , ngx_metrics_stream_bin_id(k , i) , total[k] , &nstream)
+				!= NGX_OK) {
+				return NGX_ERROR;
+			}
+		}
+	}
+
+	(void)ngx_metrics_put32(streams , nstream);
+
+	labels = ngx_http_metrics_reserve(r , out , sizeof(uint32_t));
+	if (labels == NULL) {
+		return NGX_ERROR;
+	}
+
+	out->buf->last += sizeof(uint32_t);
+
+	n = ngx_min(sh->labels_used , sh->nlabels);
+
+	for (i = 0; i < n; i++) {
+		if (ngx_metrics_label_total(sh , i , NGX_METRICS_REQUESTS) == 0) {
+			continue;
+		}
+
+		ls = &sh->labelsets[i];
+
+		p = ngx_http_metrics_reserve(r , out , NGX_HTTP_METRICS_SCRAPE_BIN_LABELS_RECORD + ls->len);
+		if (p == NULL) {
+			return NGX_ERROR;
+		}
+
+		p = ngx_metrics_put32(p , (uint32_t)i);
+
+		for (k = 0; k < NGX_METRICS_NCOUNTERS; k++) {
+			p = ngx_metrics_put32(p , (uint32_t)((uint64_t)ngx_metrics_label_total(sh , i , k) >> 32));
+			p = ngx_metrics_put32(p , (uint32_t)ngx_metrics_label_total(sh , i , k));
+		}
+
+		p = ngx_metrics_put16(p , ls->len);
+		out->buf->last = ngx_cpymem(p , ls->key , ls->len);
+
+		nlabels++;
+	}
+
+	(void)ngx_metrics_put32(labels , nlabels);
+
+	sketches = ngx_http_metrics_reserve(r , out , sizeof(uint32_t));
+	if (sketches == NULL) {
+		return NGX_ERROR;
+	}
+
+	out->buf->last += sizeof(uint32_t);
+
+	for (i = 0; i < sh->nsketch; i++) {
+		observed = ngx_http_metrics_copy_sketch(sh , i , sketch);
+		if (observed == 0) {
+			continue;
+		}
+
+		p = ngx_http_metrics_reserve(r , out ,
+			NGX_HTTP_METRICS_SCRAPE_BIN_SKETCH_RECORD + mcf->nquantiles * NGX_HTTP_METRICS_SCRAPE_BIN_QUANTILE);
+		if (p == NULL) {
+			return NGX_ERROR;
+		}
+
+		p = ngx_metrics_put32(p , (uint32_t)i);
+		p = ngx_metrics_put32(p , (uint32_t)((uint64_t)observed >> 32));
+		p = ngx_metrics_put32(p , (uint32_t)observed);
+		p = ngx_metrics_put32(p , (uint32_t)((uint64_t)sketch[NGX_METRICS_SKETCH_SUM] >> 32));
+		p = ngx_metrics_put32(p , (uint32_t)sketch[NGX_METRICS_SKETCH_SUM]);
+		p = ngx_metrics_put16(p , (uint32_t)mcf->nquantiles);
+
+		for (k = 0; k < mcf->nquantiles; k++) {
+			v = ngx_metrics_sketch_quantile(sh , sketch , observed , mcf->quantiles[k]);
+
+			p = ngx_metrics_put32(p , (uint32_t)mcf->quantiles[k]);
+			p = ngx_metrics_put32(p , (uint32_t)(v >> 32));
+			p = ngx_metrics_put32(p , (uint32_t)v);
+		}
+
+		out->buf->last = p;
+		nsketch++;
+	}
+
+	(void)ngx_metrics_put32(sketches , nsketch);
+
+	uniques = ngx_http_metrics_reserve(r , out , sizeof(uint32_t));
+	if (uniques == NULL) {
+		return NGX_ERROR;
+	}
+
+	out->buf->last += sizeof(uint32_t);
+
+	for (i = 0; i < sh->nunique; i++) {
+		if (ngx_http_metrics_append_record(r , out , (uint32_t)i , ngx_metrics_unique_total(sh , i) , &nunique) != NGX_OK) {
+			return NGX_ERROR;
+		}
+	}
+
+	(void)ngx_metrics_put32(uniques , nunique);
+
+	rates = ngx_http_metrics_reserve(r , out , sizeof(uint32_t));
+	if (rates == NULL) {
+		return NGX_ERROR;
+	}
+
+	out->buf->last += sizeof(uint32_t);
+
+	for (i = 0; i < sh->nrates; i++) {
+		if (ngx_metrics_rate(sh , i , NGX_METRICS_RATE_WINDOWS - 1) == 0) {
+			continue;
+		}
+
+		p = ngx_http_metrics_reserve(r , out , NGX_HTTP_METRICS_SCRAPE_BIN_RATE_RECORD);
+		if (p == NULL) {
+			return NGX_ERROR;
+		}
+
+		p = ngx_metrics_put32(p , (uint32_t)i);
+
+		for (k = 0; k < NGX_METRICS_RATE_WINDOWS; k++) {
+			v = ngx_metrics_rate(sh , i , k);
+			p = ngx_metrics_put32(p , (uint32_t)(v >> 32));
+			p = ngx_metrics_put32(p , (uint32_t)v);
+
+			v = ngx_metrics_rate_latency(sh , i , k);
+			p = ngx_metrics_put32(p , (uint32_t)(v >> 32));
+			p = ngx_metrics_put32(p , (uint32_t)v);
+		}
+
+		out->buf->last = p;
+		nrates++;
+	}
+
+	(void)ngx_metrics_put32(rates , nrates);
+
+	traces = ngx_http_metrics_reserve(r , out , sizeof(uint32_t));
+	if (traces == NULL) {
+		return NGX_ERROR;
+	}
+
+	out->buf->last += sizeof(uint32_t);
+
+	if (sh->ntraces) {
+		trace = ngx_palloc(r->pool , sh->ntraces * sizeof(ngx_metrics_trace_t));
+		if (trace == NULL) {
+			return NGX_ERROR;
+		}
+
+		for (i = 0; i < sh->nshards; i++) {
+			next = 0;
+			n = ngx_metrics_trace_take(sh , i , &next , trace);
+
+			for (k = 0; k < n; k++) {
+				p = ngx_http_metrics_reserve(r , out , NGX_METRICS_BIN_TRACE_RECORD + trace[k].len);
+				if (p == NULL) {
+					return NGX_ERROR;
+				}
+
+				out->buf->last = ngx_metrics_put_trace(p , &trace[k]);
+				ntraces++;
+			}
+		}
+	}
+
+	(void)ngx_metrics_put32(traces , ntraces);
+
+	p = ngx_cpymem(header , "NGXS" , 4);
+	*p++ = NGX_HTTP_METRICS_SCRAPE_BIN_VERSION;
+	*p++ = 0;
+	p = ngx_metrics_put16(p , 0);
+	p = ngx_metrics_put32(p , (uint32_t)ngx_time());
+	(void)ngx_metrics_put32(p , count);
+
+	return NGX_OK;
+}
+
+static ngx_int_t ngx_http_metrics_append_record(ngx_http_request_t * r , ngx_http_metrics_out_t * out ,
+	uint32_t id , ngx_atomic_uint_t value , uint32_t * count) {
+	u_char * p;
+
+	if (value == 0) {
+		return NGX_OK;
+	}
+
+	p = ngx_http_metrics_reserve(r , out , NGX_HTTP_METRICS_SCRAPE_BIN_RECORD);
+	if (p == NULL) {
+		return NGX_ERROR;
+	}
+
+	p = ngx_metrics_put32(p , id);
+	p = ngx_metrics_put32(p , (uint32_t)((uint64_t)value >> 32));
+	out->buf->last = ngx_metrics_put32(p , (uint32_t)value);
+
+	(*count)++;
+
+	return NGX_OK;
+}
+
+/*
+ * Returns room for len bytes at the end of the chain, appending a new
+ * buffer when the last one is full.
+ */
+
+static u_char * ngx_http_metrics_reserve(ngx_http_request_t * r , ngx_http_metrics_out_t * out , size_t len) {
+	ngx_chain_t * cl;
+
+	if (out->buf != NULL && (size_t)(out->buf->end - out->buf->last) >= len) {
+		return out->buf->last;
+	}
+
+	cl = ngx_alloc_chain_link(r->pool);
+	if (cl == NULL) {
+		return NULL;
+	}
+
+	cl->buf = ngx_create_temp_buf(r->pool , ngx_max(len , NGX_HTTP_METRICS_SCRAPE_BUF));
+	if (cl->buf == NULL) {
+		return NULL;
+	}
+
+	cl->next = NULL;
+	*out->last = cl;
+	out->last = &cl->next;
+	out->buf = cl->buf;
+
+	return out->buf->last;
+}
@@ -0,0 +1,1839 @@
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_metrics.h>
+
+static void * ngx_metrics_create_conf(ngx_cycle_t * cycle);
+static char * ngx_metrics_init_conf(ngx_cycle_t * cycle , void * conf);
+static char * ngx_metrics_zone(ngx_conf_t * cf , ngx_command_t * cmd , void * conf);
+static char * ngx_metrics_export(ngx_conf_t * cf , ngx_command_t * cmd , void * conf);
+static char * ngx_metrics_quantiles(ngx_conf_t * cf , ngx_command_t * cmd , void * conf);
+static char * ngx_metrics_snapshot(ngx_conf_t * cf , ngx_command_t * cmd , void * conf);
+static ngx_int_t ngx_metrics_add_quantile(ngx_metrics_conf_t * mcf , ngx_str_t * value);
+static char * ngx_metrics_export_env(ngx_cycle_t * cycle , ngx_metrics_conf_t * mcf);
+static ngx_shm_zone_t * ngx_metrics_shared_memory_add(ngx_conf_t * cf , size_t size);
+static ngx_int_t ngx_metrics_init_zone(ngx_shm_zone_t * shm_zone , void * data);
+static ngx_int_t ngx_metrics_check_zone(ngx_shm_zone_t * shm_zone , ngx_metrics_sh_t * sh , ngx_uint_t nold);
+static ngx_int_t ngx_metrics_check_layout(ngx_shm_zone_t * shm_zone , char * name , ngx_uint_t n , ngx_uint_t old);
+static ngx_int_t ngx_metrics_check_rows(ngx_shm_zone_t * shm_zone , ngx_metrics_sh_t * sh , ngx_uint_t area ,
+	char * name , ngx_uint_t n , ngx_uint_t old);
+static ngx_metrics_shard_t * ngx_metrics_claim_shard(ngx_metrics_sh_t * sh , ngx_uint_t hint);
+static ngx_int_t ngx_metrics_init_process(ngx_cycle_t * cycle);
+static void ngx_metrics_exit_process(ngx_cycle_t * cycle);
+static ngx_int_t ngx_metrics_export_open(ngx_metrics_conf_t * mcf , ngx_log_t * log);
+static void ngx_metrics_export_close(void);
+static void ngx_metrics_export_run(ngx_metrics_conf_t * mcf , ngx_log_t * log);
+static void ngx_metrics_export_handler(ngx_event_t * ev);
+static void ngx_metrics_export_slots(ngx_metrics_conf_t * mcf , ngx_log_t * log);
+static void ngx_metrics_export_record(ngx_metrics_conf_t * mcf , ngx_log_t * log , ngx_uint_t kind , uint32_t id ,
+	ngx_atomic_uint_t value);
+static void ngx_metrics_export_labels(ngx_metrics_conf_t * mcf , ngx_uint_t bank , ngx_log_t * log);
+static void ngx_metrics_export_sketches(ngx_metrics_conf_t * mcf , ngx_uint_t bank , ngx_log_t * log);
+static void ngx_metrics_export_heavy(ngx_metrics_conf_t * mcf , ngx_uint_t bank , ngx_uint_t slot , ngx_log_t * log);
+static void ngx_metrics_export_topk(ngx_metrics_conf_t * mcf , ngx_log_t * log);
+static void ngx_metrics_export_traces(ngx_metrics_conf_t * mcf , ngx_log_t * log);
+static u_char * ngx_metrics_export_append(ngx_metrics_conf_t * mcf , ngx_log_t * log , ngx_uint_t kind , size_t len);
+static u_char * ngx_metrics_export_dgram(ngx_metrics_conf_t * mcf , ngx_log_t * log);
+static void ngx_metrics_export_flush(ngx_metrics_conf_t * mcf , ngx_log_t * log);
+
+ngx_metrics_sh_t * ngx_metrics_sh = NULL;
+ngx_metrics_shard_t * ngx_metrics_shard = NULL;
+
+static ngx_str_t ngx_metrics_zone_name = ngx_string(NGX_METRICS_ZONE_NAME);
+
+/* the datagram socket to the collector, and the timer of a worker exporting in its event loop */
+
+static ngx_connection_t * ngx_metrics_export_conn = NULL;
+static ngx_event_t ngx_metrics_export_event;
+
+/* datagrams of the current export round, sent NGX_METRICS_EXPORT_BATCH at a time */
+
+static u_char ngx_metrics_dgrams[NGX_METRICS_EXPORT_BATCH][NGX_METRICS_EXPORT_MTU];
+static size_t ngx_metrics_dgram_len[NGX_METRICS_EXPORT_BATCH];
+static ngx_uint_t ngx_metrics_ndgrams = 0;
+static uint32_t ngx_metrics_export_seq = 0;
+
+/* the binary datagram being filled */
+
+static u_char * ngx_metrics_bin_dgram = NULL;
+static size_t * ngx_metrics_bin_len = NULL;
+static ngx_uint_t ngx_metrics_bin_count = 0;
+static ngx_uint_t ngx_metrics_bin_kind = 0;
+
+/* the quantiles reported without metrics_quantiles */
+
+static ngx_str_t ngx_metrics_default_quantiles[] = {
+	ngx_string("0.5"),
+	ngx_string("0.9"),
+	ngx_string("0.99"),
+	ngx_string("0.999"),
+	ngx_null_string
+};
+
+/* the aggregator's copy of the top-K table */
+
+static ngx_metrics_topk_entry_t * ngx_metrics_topk_copy = NULL;
+
+/* and its candidates for the heavy hitters of a slot */
+
+static ngx_metrics_heavy_entry_t * ngx_metrics_heavy_copy = NULL;
+
+/* and the traces of a shard, with where the export is in every ring */
+
+static ngx_metrics_trace_t * ngx_metrics_trace_copy = NULL;
+static ngx_atomic_uint_t * ngx_metrics_trace_next = NULL;
+
+/* when the aggregator last wrote its snapshot */
+
+static ngx_msec_t ngx_metrics_snapshot_last = 0;
+
+static ngx_command_t  ngx_metrics_commands[] = {
+    {
+    	ngx_string("metrics_zone"),
+    	NGX_MAIN_CONF | NGX_DIRECT_CONF | NGX_CONF_1MORE,
+    	ngx_metrics_zone,
+    	0,
+    	0,
+    	NULL
+    },
+    {
+    	ngx_string("metrics_export"),
+    	NGX_MAIN_CONF | NGX_DIRECT_CONF | NGX_CONF_1MORE,
+    	ngx_metrics_export,
+    	0,
+    	0,
+    	NULL
+    },
+    {
+    	ngx_string("metrics_quantiles"),
+    	NGX_MAIN_CONF | NGX_DIRECT_CONF | NGX_CONF_1MORE,
+    	ngx_metrics_quantiles,
+    	0,
+    	0,
+    	NULL
+    },
+    {
+    	ngx_string("metrics_snapshot"),
+    	NGX_MAIN_CONF | NGX_DIRECT_CONF | NGX_CONF_TAKE12,
+    	ngx_metrics_snapshot,
+    	0,
+    	0,
+    	NULL
+    },
+    ngx_null_command
+};
+
+static ngx_core_module_t  ngx_metrics_module_ctx = {
+    ngx_string("metrics"),
+    ngx_metrics_create_conf,
+    ngx_metrics_init_conf
+};
+
+ngx_module_t ngx_metrics_module = {
+    NGX_MODULE_V1,
+    &ngx_metrics_module_ctx,               /* module context */
+    ngx_metrics_commands,                  /* module directives */
+    NGX_CORE_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    ngx_metrics_init_process,              /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    ngx_metrics_exit_process,              /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+static void * ngx_metrics_create_conf(ngx_cycle_t * cycle) {
+	ngx_metrics_conf_t * mcf = (ngx_metrics_conf_t *)ngx_pcalloc(cycle->pool , sizeof(ngx_metrics_conf_t));
+	if (mcf == NULL) {
+		return NULL;
+	}
+
+	mcf->interval = NGX_CONF_UNSET_MSEC;
+	mcf->snapshot_interval = NGX_CONF_UNSET_MSEC;
+	mcf->shards = NGX_CONF_UNSET_UINT;
+	mcf->nhist = NGX_CONF_UNSET_UINT;
+	mcf->npeers = NGX_CONF_UNSET_UINT;
+	mcf->nstream = NGX_CONF_UNSET_UINT;
+	mcf->nlabels = NGX_CONF_UNSET_UINT;
+	mcf->nsketch = NGX_CONF_UNSET_UINT;
+	mcf->accuracy = NGX_CONF_UNSET_UINT;
+	mcf->nunique = NGX_CONF_UNSET_UINT;
+	mcf->nheavy = NGX_CONF_UNSET_UINT;
+	mcf->nrates = NGX_CONF_UNSET_UINT;
+	mcf->ntraces = NGX_CONF_UNSET_UINT;
+	mcf->ntopk = NGX_CONF_UNSET_UINT;
+
+	return mcf;
+}
+
+static char * ngx_metrics_init_conf(ngx_cycle_t * cycle , void * conf) {
+	ngx_metrics_conf_t * mcf = (ngx_metrics_conf_t *)conf;
+	ngx_core_conf_t * ccf = (ngx_core_conf_t *)ngx_get_conf(cycle->conf_ctx , ngx_core_module);
+	ngx_uint_t i;
+
+	ngx_conf_init_msec_value(mcf->interval , NGX_METRICS_EXPORT_INTERVAL);
+	ngx_conf_init_msec_value(mcf->snapshot_interval , NGX_METRICS_SNAPSHOT_INTERVAL);
+	ngx_conf_init_uint_value(mcf->nhist , NGX_METRICS_DEFAULT_HISTOGRAMS);
+	ngx_conf_init_uint_value(mcf->npeers , 0);
+	ngx_conf_init_uint_value(mcf->nstream , 0);
+	ngx_conf_init_uint_value(mcf->nlabels , 0);
+	ngx_conf_init_uint_value(mcf->nsketch , 0);
+	ngx_conf_init_uint_value(mcf->accuracy , NGX_METRICS_DEFAULT_ACCURACY);
+	ngx_conf_init_uint_value(mcf->nunique , 0);
+	ngx_conf_init_uint_value(mcf->nheavy , 0);
+	ngx_conf_init_uint_value(mcf->nrates , 0);
+	ngx_conf_init_uint_value(mcf->ntraces , 0);
+	ngx_conf_init_uint_value(mcf->ntopk , NGX_METRICS_DEFAULT_TOPK);
+
+	if (mcf->nquantiles == 0) {
+		for (i = 0; ngx_metrics_default_quantiles[i].len; i++) {
+			(void)ngx_metrics_add_quantile(mcf , &ngx_metrics_default_quantiles[i]);
+		}
+	}
+
+	if (mcf->export == NULL && ngx_metrics_export_env(cycle , mcf) != NGX_CONF_OK) {
+		return NGX_CONF_ERROR;
+	}
+
+	if (mcf->domain.data == NULL) {
+		ngx_str_set(&mcf->domain , "unknown");
+	}
+
+	if (mcf->shm_zone == NULL) {
+		return NGX_CONF_OK;
+	}
+
+	if (mcf->shm_zone->shm.size == 0) {
+		mcf->shm_zone->shm.size = NGX_METRICS_DEFAULT_ZONE_SIZE;
+	}
+
+	/*
+	 * twice the number of workers unless metrics_zone sets it: after a
+	 * reload the old workers keep their shards until they have finished
+	 * shutting down
+	 */
+
+	mcf->nworkers = ccf->master ? ccf->worker_processes : 1;
+	mcf->nshards = (mcf->shards != NGX_CONF_UNSET_UINT) ? mcf->shards : 2 * mcf->nworkers;
+
+	if (mcf->nshards < mcf->nworkers) {
+		ngx_log_error(NGX_LOG_EMERG , cycle->log , 0 , "metrics zone has %ui shards for %ui worker processes" ,
+			mcf->nshards , mcf->nworkers);
+
+		return NGX_CONF_ERROR;
+	}
+
+	return NGX_CONF_OK;
+}
+
+/*
+ * metrics_zone size [histograms=number] [peers=number] [streams=number] [labels=number]
+ *     [sketches=number] [accuracy=fraction] [uniques=number] [heavy=number] [rates=number] [traces=number]
+ *     [topk=number] [shards=number]
+ */
+
+static char * ngx_metrics_zone(ngx_conf_t * cf , ngx_command_t * cmd , void * conf) {
+	ngx_metrics_conf_t * mcf = (ngx_metrics_conf_t *)conf;
+	ngx_str_t * value = cf->args->elts;
+	ngx_uint_t i;
+	ngx_int_t n;
+	ssize_t size;
+
+	if (mcf->shm_zone != NULL && mcf->shm_zone->shm.size != 0) {
+		return "is duplicate";
+	}
+
+	size = ngx_parse_size(&value[1]);
+	if (size == NGX_ERROR) {
+		ngx_conf_log_error(NGX_LOG_EMERG , cf , 0 , "invalid zone size \"%V\"" , &value[1]);
+
+		return NGX_CONF_ERROR;
+	}
+
+	if (size < (ssize_t)(8 * ngx_pagesize)) {
+		ngx_conf_log_error(NGX_LOG_EMERG , cf , 0 , "zone \"%V\" is too small" , &value[1]);
+
+		return NGX_CONF_ERROR;
+	}
+
+	for (i = 2; i < cf->args->nelts; i++) {
+		if (ngx_strncmp(value[i].data , "histograms=" , 11) == 0) {
+			n = ngx_atoi(value[i].data + 11 , value[i].len - 11);
+			if (n == NGX_ERROR || n > NGX_METRICS_MAX_SLOTS) {
+				goto invalid;
+			}
+
+			mcf->nhist = n;
+
+			continue;
+		}
+
+		if (ngx_strncmp(value[i].data , "peers=" , 6) == 0) {
+			n = ngx_atoi(value[i].data + 6 , value[i].len - 6);
+			if (n == NGX_ERROR || n > NGX_METRICS_MAX_SLOTS) {
+				goto invalid;
+			}
+
+			mcf->npeers = n;
+
+			continue;
+		}
+
+		if (ngx_strncmp(value[i].data , "streams=" , 8) == 0) {
+			n = ngx_atoi(value[i].data + 8 , value[i].len - 8);
+			if (n == NGX_ERROR || n > NGX_METRICS_MAX_SLOTS) {
+				goto invalid;
+			}
+
+			mcf->nstream = n;
+
+			continue;
+		}
+
+		if (ngx_strncmp(value[i].data , "labels=" , 7) == 0) {
+			n = ngx_atoi(value[i].data + 7 , value[i].len - 7);
+			if (n == NGX_ERROR || n > NGX_METRICS_MAX_SLOTS) {
+				goto invalid;
+			}
+
+			mcf->nlabels = n;
+
+			continue;
+		}
+
+		if (ngx_strncmp(value[i].data , "sketches=" , 9) == 0) {
+			n = ngx_atoi(value[i].data + 9 , value[i].len - 9);
+			if (n == NGX_ERROR || n > NGX_METRICS_MAX_SLOTS) {
+				goto invalid;
+			}
+
+			mcf->nsketch = n;
+
+			continue;
+		}
+
+		if (ngx_strncmp(value[i].data , "uniques=" , 8) == 0) {
+			n = ngx_atoi(value[i].data + 8 , value[i].len - 8);
+			if (n == NGX_ERROR || n > NGX_METRICS_MAX_SLOTS) {
+				goto invalid;
+			}
+
+			mcf->nunique = n;
+
+			continue;
+		}
+
+		if (ngx_strncmp(value[i].data , "heavy=" , 6) == 0) {
+			n = ngx_atoi(value[i].data + 6 , value[i].len - 6);
+			if (n == NGX_ERROR || n > NGX_METRICS_MAX_SLOTS) {
+				goto invalid;
+			}
+
+			mcf->nheavy = n;
+
+			continue;
+		}
+
+		if (ngx_strncmp(value[i].data , "rates=" , 6) == 0) {
+			n = ngx_atoi(value[i].data + 6 , value[i].len - 6);
+			if (n == NGX_ERROR || n > NGX_METRICS_MAX_SLOTS) {
+				goto invalid;
+			}
+
+			mcf->nrates = n;
+
+			continue;
+		}
+
+		if (ngx_strncmp(value[i].data , "traces=" , 7) == 0) {
+			n = ngx_atoi(value[i].data + 7 , value[i].len - 7);
+			if (n == NGX_ERROR || n > NGX_METRICS_MAX_TRACES) {
+				goto invalid;
+			}
+
+			mcf->ntraces = n;
+
+			continue;
+		}
+
+		/* in ten thousandths, from 0.1% to 10% */
+
+		if (ngx_strncmp(value[i].data , "accuracy=" , 9) == 0) {
+			n = ngx_atofp(value[i].data + 9 , value[i].len - 9 , 4);
+			if (n < 10 || n > 1000) {
+				goto invalid;
+			}
+
+			mcf->accuracy = n;
+
+			continue;
+		}
+
+		if (ngx_strncmp(value[i].data , "shards=" , 7) == 0) {
+			n = ngx_atoi(value[i].data + 7 , value[i].len - 7);
+			if (n == NGX_ERROR || n == 0 || n > NGX_MAX_PROCESSES) {
+				goto invalid;
+			}
+
+			mcf->shards = n;
+
+			continue;
+		}
+
+		if (ngx_strncmp(value[i].data , "topk=" , 5) == 0) {
+			n = ngx_atoi(value[i].data + 5 , value[i].len - 5);
+			if (n == NGX_ERROR || n > NGX_METRICS_MAX_TOPK) {
+				goto invalid;
+			}
+
+			mcf->ntopk = n;
+
+			continue;
+		}
+
+		goto invalid;
+	}
+
+	if (ngx_metrics_shared_memory_add(cf , size) == NULL) {
+		return NGX_CONF_ERROR;
+	}
+
+	return NGX_CONF_OK;
+
+invalid:
+
+	ngx_conf_log_error(NGX_LOG_EMERG , cf , 0 , "invalid parameter \"%V\"" , &value[i]);
+
+	return NGX_CONF_ERROR;
+}
+
+/*
+ * metrics_quantiles quantile ...
+ *
+ * The quantiles of the request time sketches, from 0 to 1, that are
+ * exported and scraped.
+ */
+
+static char * ngx_metrics_quantiles(ngx_conf_t * cf , ngx_command_t * cmd , void * conf) {
+	ngx_metrics_conf_t * mcf = (ngx_metrics_conf_t *)conf;
+	ngx_str_t * value = cf->args->elts;
+	ngx_uint_t i;
+
+	if (mcf->nquantiles != 0) {
+		return "is duplicate";
+	}
+
+	if (cf->args->nelts - 1 > NGX_METRICS_MAX_QUANTILES) {
+		ngx_conf_log_error(NGX_LOG_EMERG , cf , 0 , "too many quantiles, at most %d" , NGX_METRICS_MAX_QUANTILES);
+
+		return NGX_CONF_ERROR;
+	}
+
+	for (i = 1; i < cf->args->nelts; i++) {
+		if (ngx_metrics_add_quantile(mcf , &value[i]) != NGX_OK) {
+			ngx_conf_log_error(NGX_LOG_EMERG , cf , 0 , "invalid quantile \"%V\"" , &value[i]);
+
+			return NGX_CONF_ERROR;
+		}
+	}
+
+	return NGX_CONF_OK;
+}
+
+static ngx_int_t ngx_metrics_add_quantile(ngx_metrics_conf_t * mcf , ngx_str_t * value) {
+	ngx_int_t q = ngx_atofp(value->data , value->len , 6);
+
+	if (q == NGX_ERROR || q > 1000000) {
+		return NGX_ERROR;
+	}
+
+	mcf->quantiles[mcf->nquantiles] = q;
+	mcf->quantile_names[mcf->nquantiles] = *value;
+	mcf->nquantiles++;
+
+	return NGX_OK;
+}
+
+/*
+ * metrics_export address:port [domain=name] [interval=time] [format=text|binary]
+ */
+
+static char * ngx_metrics_export(ngx_conf_t * cf , ngx_command_t * cmd , void * conf) {
+	ngx_metrics_conf_t * mcf = (ngx_metrics_conf_t *)conf;
+	ngx_str_t * value = cf->args->elts;
+	ngx_str_t s;
+	ngx_url_t u;
+	ngx_uint_t i;
+
+	if (mcf->export != NULL) {
+		return "is duplicate";
+	}
+
+	ngx_memzero(&u , sizeof(ngx_url_t));
+	u.url = value[1];
+
+	if (ngx_parse_url(cf->pool , &u) != NGX_OK) {
+		if (u.err) {
+			ngx_conf_log_error(NGX_LOG_EMERG , cf , 0 , "%s in \"%V\"" , u.err , &u.url);
+		}
+
+		return NGX_CONF_ERROR;
+	}
+
+	if (u.no_port) {
+		ngx_conf_log_error(NGX_LOG_EMERG , cf , 0 , "no port in \"%V\"" , &u.url);
+
+		return NGX_CONF_ERROR;
+	}
+
+	mcf->export = &u.addrs[0];
+
+	for (i = 2; i < cf->args->nelts; i++) {
+		if (ngx_strncmp(value[i].data , "domain=" , 7) == 0) {
+			mcf->domain.data = value[i].data + 7;
+			mcf->domain.len = value[i].len - 7;
+
+			if (mcf->domain.len == 0 || mcf->domain.len > NGX_METRICS_MAX_DOMAIN) {
+				goto invalid;
+			}
+
+			continue;
+		}
+
+		if (ngx_strncmp(value[i].data , "interval=" , 9) == 0) {
+			s.data = value[i].data + 9;
+			s.len = value[i].len - 9;
+
+			mcf->interval = ngx_parse_time(&s , 0);
+			if (mcf->interval == (ngx_msec_t) NGX_ERROR || mcf->interval == 0) {
+				goto invalid;
+			}
+
+			continue;
+		}
+
+		if (ngx_strcmp(value[i].data , "format=text") == 0) {
+			mcf->format = NGX_METRICS_FORMAT_TEXT;
+			continue;
+		}
+
+		if (ngx_strcmp(value[i].data , "format=binary") == 0) {
+			mcf->format = NGX_METRICS_FORMAT_BINARY;
+			continue;
+		}
+
+		if (ngx_strcmp(value[i].data , "mode=aggregator") == 0) {
+			mcf->export_mode = NGX_METRICS_EXPORT_AGGREGATOR;
+			continue;
+		}
+
+		if (ngx_strcmp(value[i].data , "mode=worker") == 0) {
+			mcf->export_mode = NGX_METRICS_EXPORT_WORKER;
+			continue;
+		}
+
+		goto invalid;
+	}
+
+	return NGX_CONF_OK;
+
+invalid:
+
+	ngx_conf_log_error(NGX_LOG_EMERG , cf , 0 , "invalid parameter \"%V\"" , &value[i]);
+
+	return NGX_CONF_ERROR;
+}
+
+/*
+ * metrics_snapshot path [interval=time]
+ *
+ * The file the aggregator keeps the totals in, every interval and when it
+ * exits, for a new zone to start from.  The aggregator writes a file next
+ * to it and renames it, so its directory is created and given to the
+ * user of the worker processes, as the temp paths are.  The root
+ * directory is left alone.
+ */
+
+static char * ngx_metrics_snapshot(ngx_conf_t * cf , ngx_command_t * cmd , void * conf) {
+	ngx_metrics_conf_t * mcf = (ngx_metrics_conf_t *)conf;
+	ngx_str_t * value = cf->args->elts;
+	ngx_path_t * path;
+	ngx_str_t s;
+	size_t len;
+
+	if (mcf->snapshot.data != NULL) {
+		return "is duplicate";
+	}
+
+	mcf->snapshot = value[1];
+
+	if (ngx_conf_full_name(cf->cycle , &mcf->snapshot , 0) != NGX_OK) {
+		return NGX_CONF_ERROR;
+	}
+
+	for (len = mcf->snapshot.len; len > 0 && mcf->snapshot.data[len - 1] != '/'; len--) { /* void */ }
+
+	if (len > 1) {
+		path = ngx_pcalloc(cf->pool , sizeof(ngx_path_t));
+		if (path == NULL) {
+			return NGX_CONF_ERROR;
+		}
+
+		path->name.len = len - 1;
+		path->name.data = ngx_pnalloc(cf->pool , len);
+		if (path->name.data == NULL) {
+			return NGX_CONF_ERROR;
+		}
+
+		(void)ngx_cpystrn(path->name.data , mcf->snapshot.data , len);
+		path->conf_file = cf->conf_file->file.name.data;
+		path->line = cf->conf_file->line;
+
+		if (ngx_add_path(cf , &path) != NGX_OK) {
+			return NGX_CONF_ERROR;
+		}
+	}
+
+	if (cf->args->nelts == 2) {
+		return NGX_CONF_OK;
+	}
+
+	if (ngx_strncmp(value[2].data , "interval=" , 9) != 0) {
+		goto invalid;
+	}
+
+	s.data = value[2].data + 9;
+	s.len = value[2].len - 9;
+
+	mcf->snapshot_interval = ngx_parse_time(&s , 0);
+	if (mcf->snapshot_interval == (ngx_msec_t) NGX_ERROR || mcf->snapshot_interval == 0) {
+		goto invalid;
+	}
+
+	return NGX_CONF_OK;
+
+invalid:
+
+	ngx_conf_log_error(NGX_LOG_EMERG , cf , 0 , "invalid parameter \"%V\"" , &value[2]);
+
+	return NGX_CONF_ERROR;
+}
+
+/*
+ * Without the metrics_export directive the collector is taken from the
+ * environment of the master, as the module always did.
+ */
+
+static char * ngx_metrics_export_env(ngx_cycle_t * cycle , ngx_metrics_conf_t * mcf) {
+	char * ip = getenv("NGX_METRICS_COLLECTOR_IP");
+	char * port = getenv("NGX_METRICS_COLLECTOR_PORT");
+	char * domain = getenv("NGX_METRICS_DOMAIN");
+	ngx_url_t u;
+
+	if (mcf->domain.data == NULL && domain != NULL && ngx_strlen(domain) <= NGX_METRICS_MAX_DOMAIN) {
+		mcf->domain.len = ngx_strlen(domain);
+		mcf->domain.data = ngx_pnalloc(cycle->pool , mcf->domain.len);
+		if (mcf->domain.data == NULL) {
+			return NGX_CONF_ERROR;
+		}
+
+		ngx_memcpy(mcf->domain.data , domain , mcf->domain.len);
+	}
+
+	if (ip == NULL || port == NULL) {
+		return NGX_CONF_OK;
+	}
+
+	ngx_memzero(&u , sizeof(ngx_url_t));
+	u.url.len = ngx_strlen(ip) + 1 + ngx_strlen(port);
+	u.url.data = ngx_pnalloc(cycle->pool , u.url.len + 1);
+	if (u.url.data == NULL) {
+		return NGX_CONF_ERROR;
+	}
+
+	(void)ngx_sprintf(u.url.data , "%s:%s%Z" , ip , port);
+
+	if (ngx_parse_url(cycle->pool , &u) != NGX_OK || u.no_port) {
+		ngx_log_error(NGX_LOG_WARN , cycle->log , 0 , "invalid metrics collector \"%V\", export disabled" , &u.url);
+
+		return NGX_CONF_OK;
+	}
+
+	mcf->export = &u.addrs[0];
+
+	return NGX_CONF_OK;
+}
+
+ngx_shm_zone_t * ngx_metrics_add_zone(ngx_conf_t * cf) {
+	return ngx_metrics_shared_memory_add(cf , 0);
+}
+
+/*
+ * Keeps the names of the upstream peers or of the stream servers and
+ * upstreams of the configuration, and sizes their area for them unless
+ * metrics_zone sets it.
+ */
+
+void ngx_metrics_reserve_rows(ngx_conf_t * cf , ngx_uint_t area , ngx_array_t * names) {
+	ngx_metrics_conf_t * mcf = (ngx_metrics_conf_t *)ngx_get_conf(cf->cycle->conf_ctx , ngx_metrics_module);
+	ngx_uint_t * n = (area == NGX_METRICS_ROWS_PEERS) ? &mcf->npeers : &mcf->nstream;
+
+	mcf->rows[area] = names;
+
+	if (*n == NGX_CONF_UNSET_UINT) {
+		*n = ngx_min(names->nelts , NGX_METRICS_MAX_SLOTS);
+	}
+}
+
+/*
+ * Sizes the label table when labels are defined, unless metrics_zone
+ * sets it.  The overflow label set takes one of the entries.
+ */
+
+void ngx_metrics_reserve_labels(ngx_conf_t * cf , ngx_uint_t nlabels) {
+	ngx_metrics_conf_t * mcf = (ngx_metrics_conf_t *)ngx_get_conf(cf->cycle->conf_ctx , ngx_metrics_module);
+
+	if (mcf->nlabels == NGX_CONF_UNSET_UINT) {
+		mcf->nlabels = ngx_min(nlabels , NGX_METRICS_MAX_SLOTS);
+	}
+}
+
+/*
+ * Sizes the trace rings when requests are sampled, unless metrics_zone
+ * sets them.
+ */
+
+void ngx_metrics_reserve_traces(ngx_conf_t * cf , ngx_uint_t ntraces) {
+	ngx_metrics_conf_t * mcf = (ngx_metrics_conf_t *)ngx_get_conf(cf->cycle->conf_ctx , ngx_metrics_module);
+
+	if (mcf->ntraces == NGX_CONF_UNSET_UINT) {
+		mcf->ntraces = ngx_min(ntraces , NGX_METRICS_MAX_TRACES);
+	}
+}
+
+static ngx_shm_zone_t * ngx_metrics_shared_memory_add(ngx_conf_t * cf , size_t size) {
+	ngx_metrics_conf_t * mcf = (ngx_metrics_conf_t *)ngx_get_conf(cf->cycle->conf_ctx , ngx_metrics_module);
+
+	ngx_shm_zone_t * shm_zone = ngx_shared_memory_add(cf , &ngx_metrics_zone_name , size , &ngx_metrics_module);
+	if (shm_zone == NULL) {
+		return NULL;
+	}
+
+	shm_zone->init = ngx_metrics_init_zone;
+	shm_zone->data = mcf;
+	mcf->shm_zone = shm_zone;
+
+	return shm_zone;
+}
+
+static ngx_int_t ngx_metrics_init_zone(ngx_shm_zone_t * shm_zone , void * data) {
+	ngx_metrics_conf_t * omcf = (ngx_metrics_conf_t *)data;
+	ngx_metrics_conf_t * mcf = (ngx_metrics_conf_t *)shm_zone->data;
+	ngx_metrics_sh_t * sh;
+	size_t size , hsize , psize , usize , tsize , avail , fixed;
+
+	if (omcf != NULL) {
+		if (ngx_metrics_check_zone(shm_zone , omcf->sh , omcf->nworkers) != NGX_OK) {
+			return NGX_ERROR;
+		}
+
+		mcf->shpool = omcf->shpool;
+		mcf->sh = omcf->sh;
+
+		return NGX_OK;
+	}
+
+	mcf->shpool = (ngx_slab_pool_t *)shm_zone->shm.addr;
+
+	if (shm_zone->shm.exists) {
+		if (ngx_metrics_check_zone(shm_zone , mcf->shpool->data , 0) != NGX_OK) {
+			return NGX_ERROR;
+		}
+
+		mcf->sh = mcf->shpool->data;
+
+		return NGX_OK;
+	}
+
+	sh = ngx_slab_alloc(mcf->shpool , sizeof(ngx_metrics_sh_t));
+	if (sh == NULL) {
+		return NGX_ERROR;
+	}
+
+	mcf->shpool->data = sh;
+
+	sh->zone_id = (uint64_t)ngx_time() << 32 | (uint32_t)ngx_pid;
+	sh->snapshot_origin = 0;
+	sh->snapshot_seq = 0;
+	sh->snapshot_written = 0;
+	sh->snapshot_base = NULL;
+	sh->snapshot_nbase = 0;
+
+	if (ngx_metrics_topk_init_zone(mcf->shpool , sh , mcf->ntopk) != NGX_OK
+		|| ngx_metrics_labels_init_zone(mcf->shpool , sh , mcf->nlabels) != NGX_OK
+		|| ngx_metrics_rows_init_zone(mcf->shpool , sh , NGX_METRICS_ROWS_PEERS , mcf->npeers) != NGX_OK
+		|| ngx_metrics_rows_init_zone(mcf->shpool , sh , NGX_METRICS_ROWS_STREAM , mcf->nstream) != NGX_OK)
+	{
+		return NGX_ERROR;
+	}
+
+	ngx_metrics_snapshot_open(mcf , sh , shm_zone->shm.log);
+
+	/*
+	 * whatever is left in the zone goes to the shards and the totals:
+	 * a slot costs its counters twice in every shard and once in the
+	 * totals, the histograms, the peers, the stream area, the label
+	 * counters, the sketches and the heavy hitters are of fixed size, the
+	 * last not being kept in the totals, the registers are twice outside
+	 * the shards and the moving averages are only kept in the totals; a
+	 * trace ring is once in every shard, with room to align it
+	 */
+
+	hsize = mcf->nhist * NGX_METRICS_NHIST * NGX_METRICS_HIST_WORDS * sizeof(ngx_atomic_t);
+	psize = (mcf->npeers * NGX_METRICS_PEER_WORDS + mcf->nstream * NGX_METRICS_STREAM_WORDS
+		+ mcf->nlabels * NGX_METRICS_NCOUNTERS + mcf->nsketch * NGX_METRICS_SKETCH_WORDS) * sizeof(ngx_atomic_t);
+	usize = mcf->nheavy * NGX_METRICS_HEAVY_WORDS * sizeof(ngx_atomic_t);
+	tsize = mcf->ntraces ? 2 * NGX_CPU_CACHE_LINE + mcf->ntraces * sizeof(ngx_metrics_trace_t) : 0;
+	avail = mcf->shpool->pfree > 2 ? (mcf->shpool->pfree - 2) * ngx_pagesize : 0;
+	fixed = mcf->nshards * (2 * NGX_CPU_CACHE_LINE + 2 * hsize + 2 * psize + 2 * usize + tsize) + hsize + psize
+		+ (2 * mcf->nunique * NGX_METRICS_HLL_WORDS + mcf->nunique + mcf->nrates * NGX_METRICS_RATE_WORDS)
+		* sizeof(ngx_atomic_t);
+
+	sh->nslots = 0;
+
+	if (avail > fixed) {
+		sh->nslots = (avail - fixed) / ((2 * mcf->nshards + 1) * NGX_METRICS_NCOUNTERS * sizeof(ngx_atomic_t));
+		sh->nslots = ngx_min(sh->nslots , NGX_METRICS_MAX_SLOTS);
+	}
+
+	if (sh->nslots < ngx_max(mcf->nhist , 1)) {
+		ngx_log_error(NGX_LOG_EMERG , shm_zone->shm.log , 0 ,
+			"metrics zone \"%V\" is too small for %ui histograms, %ui peers, %ui streams, %ui labels, %ui sketches, "
+			"%ui uniques, %ui heavy and %ui traces x %ui shards" , &shm_zone->shm.name , mcf->nhist , mcf->npeers ,
+			mcf->nstream , mcf->nlabels , mcf->nsketch , mcf->nunique , mcf->nheavy , mcf->ntraces , mcf->nshards);
+
+		return NGX_ERROR;
+	}
+
+	size = ngx_align(NGX_CPU_CACHE_LINE + 2 * hsize + 2 * psize + 2 * usize + tsize
+		+ 2 * sh->nslots * NGX_METRICS_NCOUNTERS * sizeof(ngx_atomic_t) , NGX_CPU_CACHE_LINE);
+
+	sh->shards = ngx_slab_alloc(mcf->shpool , mcf->nshards * size);
+	if (sh->shards == NULL) {
+		return NGX_ERROR;
+	}
+
+	ngx_memzero(sh->shards , mcf->nshards * size);
+
+	sh->totals = ngx_slab_calloc(mcf->shpool , sh->nslots * NGX_METRICS_NCOUNTERS * sizeof(ngx_atomic_t) + hsize + psize
+		+ (mcf->nunique + mcf->nrates * NGX_METRICS_RATE_WORDS) * sizeof(ngx_atomic_t));
+	if (sh->totals == NULL) {
+		return NGX_ERROR;
+	}
+
+	sh->hll = NULL;
+
+	if (mcf->nunique) {
+		sh->hll = ngx_slab_calloc(mcf->shpool , 2 * mcf->nunique * NGX_METRICS_HLL_WORDS * sizeof(ngx_atomic_t));
+		if (sh->hll == NULL) {
+			return NGX_ERROR;
+		}
+	}
+
+	sh->nshards = mcf->nshards;
+	sh->shard_size = size;
+	sh->nhist = mcf->nhist;
+	sh->npeers = mcf->npeers;
+	sh->nstream = mcf->nstream;
+	sh->nunique = mcf->nunique;
+	sh->nheavy = mcf->nheavy;
+	sh->nrates = ngx_min(mcf->nrates , sh->nslots);
+	sh->ntraces = mcf->ntraces;
+	sh->epoch = 0;
+	sh->rates_last = 0;
+
+	ngx_metrics_sketch_init_zone(sh , mcf->nsketch , mcf->accuracy);
+
+	mcf->sh = sh;
+
+	ngx_metrics_snapshot_restore(mcf , sh , shm_zone->shm.log);
+
+	ngx_log_error(NGX_LOG_INFO , shm_zone->shm.log , 0 ,
+		"metrics zone: %ui slots, %ui histograms, %ui peers, %ui streams, %ui labels x %ui shards" ,
+		sh->nslots , sh->nhist , sh->npeers , sh->nstream , sh->nlabels , sh->nshards);
+
+	if (sh->nsketch) {
+		ngx_log_error(NGX_LOG_INFO , shm_zone->shm.log , 0 ,
+			"metrics zone: %ui sketches, accurate to %ui.%02ui%% up to %uD ms" ,
+			sh->nsketch , sh->accuracy / 100 , sh->accuracy % 100 , sh->sketch_bounds[NGX_METRICS_SKETCH_BUCKETS - 1]);
+	}
+
+	if (sh->nunique) {
+		ngx_log_error(NGX_LOG_INFO , shm_zone->shm.log , 0 , "metrics zone: %ui uniques of %d registers" ,
+			sh->nunique , NGX_METRICS_HLL_REGISTERS);
+	}
+
+	if (sh->nheavy) {
+		ngx_log_error(NGX_LOG_INFO , shm_zone->shm.log , 0 , "metrics zone: %ui heavy of %dx%d cells, top %d" ,
+			sh->nheavy , NGX_METRICS_HEAVY_DEPTH , NGX_METRICS_HEAVY_WIDTH , NGX_METRICS_HEAVY_K);
+	}
+
+	if (sh->nrates) {
+		ngx_log_error(NGX_LOG_INFO , shm_zone->shm.log , 0 , "metrics zone: %ui rates" , sh->nrates);
+	}
+
+	if (sh->ntraces) {
+		ngx_log_error(NGX_LOG_INFO , shm_zone->shm.log , 0 , "metrics zone: %ui traces per shard" , sh->ntraces);
+	}
+
+	return NGX_OK;
+}
+
+/*
+ * A zone is only reused by a configuration that lays it out the same, the
+ * slots following from the size and the rest, whose peers and stream
+ * servers and upstreams find their rows or room for them, and whose
+ * workers find a shard each next to the nold ones still running.
+ * Otherwise the reload fails, as the zone cannot be laid out anew under
+ * the old workers.
+ */
+
+static ngx_int_t ngx_metrics_check_zone(ngx_shm_zone_t * shm_zone , ngx_metrics_sh_t * sh , ngx_uint_t nold) {
+	ngx_metrics_conf_t * mcf = (ngx_metrics_conf_t *)shm_zone->data;
+
+	if (ngx_metrics_check_layout(shm_zone , "histograms" , mcf->nhist , sh->nhist) != NGX_OK
+		|| ngx_metrics_check_rows(shm_zone , sh , NGX_METRICS_ROWS_PEERS , "peers" , mcf->npeers , sh->npeers) != NGX_OK
+		|| ngx_metrics_check_rows(shm_zone , sh , NGX_METRICS_ROWS_STREAM , "streams" , mcf->nstream , sh->nstream)
+			!= NGX_OK
+		|| ngx_metrics_check_layout(shm_zone , "labels" , mcf->nlabels , sh->nlabels) != NGX_OK
+		|| ngx_metrics_check_layout(shm_zone , "sketches" , mcf->nsketch , sh->nsketch) != NGX_OK
+		|| ngx_metrics_check_layout(shm_zone , "uniques" , mcf->nunique , sh->nunique) != NGX_OK
+		|| ngx_metrics_check_layout(shm_zone , "heavy" , mcf->nheavy , sh->nheavy) != NGX_OK
+		|| ngx_metrics_check_layout(shm_zone , "rates" , ngx_min(mcf->nrates , sh->nslots) , sh->nrates) != NGX_OK
+		|| ngx_metrics_check_layout(shm_zone , "traces" , mcf->ntraces , sh->ntraces) != NGX_OK
+		|| ngx_metrics_check_layout(shm_zone , "topk" , mcf->ntopk , sh->ntopk) != NGX_OK)
+	{
+		return NGX_ERROR;
+	}
+
+	if (mcf->shards != NGX_CONF_UNSET_UINT
+		&& ngx_metrics_check_layout(shm_zone , "shards" , mcf->shards , sh->nshards) != NGX_OK)
+	{
+		return NGX_ERROR;
+	}
+
+	if (sh->nsketch && mcf->accuracy != sh->accuracy) {
+		ngx_log_error(NGX_LOG_EMERG , shm_zone->shm.log , 0 ,
+			"metrics zone \"%V\" uses accuracy=%ui.%02ui%% while previously it used accuracy=%ui.%02ui%%, "
+			"change its size to lay it out anew" , &shm_zone->shm.name , mcf->accuracy / 100 , mcf->accuracy % 100 ,
+			sh->accuracy / 100 , sh->accuracy % 100);
+
+		return NGX_ERROR;
+	}
+
+	if (nold + mcf->nworkers > sh->nshards) {
+		ngx_log_error(NGX_LOG_EMERG , shm_zone->shm.log , 0 ,
+			"metrics zone \"%V\" has %ui shards while %ui old and %ui new worker processes need one each, "
+			"change its size or its shards to lay it out anew" , &shm_zone->shm.name , sh->nshards , nold ,
+			mcf->nworkers);
+
+		return NGX_ERROR;
+	}
+
+	return NGX_OK;
+}
+
+static ngx_int_t ngx_metrics_check_layout(ngx_shm_zone_t * shm_zone , char * name , ngx_uint_t n , ngx_uint_t old) {
+	if (n == old) {
+		return NGX_OK;
+	}
+
+	ngx_log_error(NGX_LOG_EMERG , shm_zone->shm.log , 0 ,
+		"metrics zone \"%V\" uses %s=%ui while previously it used %s=%ui, change its size to lay it out anew" ,
+		&shm_zone->shm.name , name , n , name , old);
+
+	return NGX_ERROR;
+}
+
+/*
+ * The rows of a zone only grow in number, so it is reused with fewer of
+ * them, and with more names as long as they fit.
+ */
+
+static ngx_int_t ngx_metrics_check_rows(ngx_shm_zone_t * shm_zone , ngx_metrics_sh_t * sh , ngx_uint_t area ,
+	char * name , ngx_uint_t n , ngx_uint_t old) {
+	ngx_metrics_conf_t * mcf = (ngx_metrics_conf_t *)shm_zone->data;
+
+	if (n > old) {
+		return ngx_metrics_check_layout(shm_zone , name , n , old);
+	}
+
+	if (ngx_metrics_rows_check(sh , area , mcf->rows[area]) != NGX_OK) {
+		ngx_log_error(NGX_LOG_EMERG , shm_zone->shm.log , 0 ,
+			"metrics zone \"%V\" has no room left for new %s, change its size to lay it out anew" ,
+			&shm_zone->shm.name , name);
+
+		return NGX_ERROR;
+	}
+
+	return NGX_OK;
+}
+
+static ngx_metrics_shard_t * ngx_metrics_claim_shard(ngx_metrics_sh_t * sh , ngx_uint_t hint) {
+	ngx_uint_t i;
+	ngx_atomic_uint_t owner;
+	ngx_metrics_shard_t * shard;
+
+	for (i = 0; i < sh->nshards; i++) {
+		shard = ngx_metrics_get_shard(sh , (hint + i) % sh->nshards);
+		owner = shard->owner;
+
+		/* a shard left behind by a crashed process can be taken over */
+
+		if (owner != 0 && (kill((ngx_pid_t)owner , 0) == 0 || ngx_errno != NGX_ESRCH)) {
+			continue;
+		}
+
+		if (ngx_atomic_cmp_set(&shard->owner , owner , (ngx_atomic_uint_t)ngx_pid)) {
+			return shard;
+		}
+	}
+
+	return NULL;
+}
+
+static ngx_int_t ngx_metrics_init_process(ngx_cycle_t * cycle) {
+	ngx_metrics_conf_t * mcf = (ngx_metrics_conf_t *)ngx_get_conf(cycle->conf_ctx , ngx_metrics_module);
+
+	if (mcf->sh == NULL) {
+		return NGX_OK;
+	}
+
+	ngx_metrics_sh = mcf->sh;
+
+	if (ngx_process != NGX_PROCESS_WORKER && ngx_process != NGX_PROCESS_SINGLE) {
+		return NGX_OK;
+	}
+
+	ngx_metrics_shard = ngx_metrics_claim_shard(mcf->sh , ngx_worker);
+	if (ngx_metrics_shard == NULL) {
+		ngx_log_error(NGX_LOG_ERR , cycle->log , 0 , "no free shard in metrics zone, requests are not counted");
+	}
+
+	if (mcf->sh->ntopk && ngx_metrics_topk_init(cycle , mcf->shpool , mcf->sh , mcf->interval) != NGX_OK) {
+		return NGX_ERROR;
+	}
+
+	if (mcf->sh->nlabels && ngx_metrics_labels_init(cycle , mcf->shpool , mcf->sh) != NGX_OK) {
+		return NGX_ERROR;
+	}
+
+	return NGX_OK;
+}
+
+static void ngx_metrics_exit_process(ngx_cycle_t * cycle) {
+	ngx_metrics_conf_t * mcf = (ngx_metrics_conf_t *)ngx_get_conf(cycle->conf_ctx , ngx_metrics_module);
+
+	ngx_metrics_topk_flush();
+
+	if (ngx_metrics_export_event.handler != NULL) {
+		ngx_time_update();
+		ngx_metrics_export_run(mcf , cycle->log);
+		ngx_metrics_export_event.handler = NULL;
+	}
+
+	ngx_metrics_export_close();
+
+	if (ngx_metrics_shard != NULL) {
+		ngx_metrics_shard->owner = 0;
+		ngx_metrics_shard = NULL;
+	}
+}
+
+/*
+ * Makes the other bank active and returns the one the workers were
+ * counting into, to be drained by the caller.
+ */
+
+ngx_uint_t ngx_metrics_flip(ngx_metrics_sh_t * sh) {
+	return ngx_atomic_fetch_add(&sh->epoch , 1) & 1;
+}
+
+ngx_atomic_uint_t ngx_metrics_drain(ngx_metrics_sh_t * sh , ngx_uint_t bank , ngx_uint_t slot , ngx_uint_t counter) {
+	ngx_uint_t i;
+	ngx_atomic_uint_t sum = 0;
+
+	for (i = 0; i < sh->nshards; i++) {
+		sum += ngx_metrics_swap_zero(
+			&ngx_metrics_shard_counters(sh , ngx_metrics_get_shard(sh , i) , bank)[slot * NGX_METRICS_NCOUNTERS + counter]);
+	}
+
+	if (sum != 0) {
+		(void)ngx_atomic_fetch_add(&ngx_metrics_total(sh , slot , counter) , sum);
+	}
+
+	return sum;
+}
+
+ngx_atomic_uint_t ngx_metrics_drain_bucket(ngx_metrics_sh_t * sh , ngx_uint_t bank , ngx_uint_t slot ,
+	ngx_uint_t kind , ngx_uint_t bucket) {
+	ngx_uint_t i;
+	ngx_atomic_uint_t sum = 0;
+
+	for (i = 0; i < sh->nshards; i++) {
+		sum += ngx_metrics_swap_zero(
+			&ngx_metrics_shard_histogram(sh , ngx_metrics_get_shard(sh , i) , bank , slot , kind)[bucket]);
+	}
+
+	if (sum != 0) {
+		(void)ngx_atomic_fetch_add(&ngx_metrics_hist_total(sh , slot , kind)[bucket] , sum);
+	}
+
+	return sum;
+}
+
+ngx_atomic_uint_t ngx_metrics_drain_peer(ngx_metrics_sh_t * sh , ngx_uint_t bank , ngx_uint_t peer , ngx_uint_t word) {
+	ngx_uint_t i;
+	ngx_atomic_uint_t sum = 0;
+
+	for (i = 0; i < sh->nshards; i++) {
+		sum += ngx_metrics_swap_zero(&ngx_metrics_shard_peer(sh , ngx_metrics_get_shard(sh , i) , bank , peer)[word]);
+	}
+
+	if (sum != 0) {
+		(void)ngx_atomic_fetch_add(&ngx_metrics_peer_total(sh , peer)[word] , sum);
+	}
+
+	return sum;
+}
+
+ngx_atomic_uint_t ngx_metrics_drain_stream(ngx_metrics_sh_t * sh , ngx_uint_t bank , ngx_uint_t n , ngx_uint_t word) {
+	ngx_uint_t i;
+	ngx_atomic_uint_t sum = 0;
+
+	for (i = 0; i < sh->nshards; i++) {
+		sum += ngx_metrics_swap_zero(&ngx_metrics_shard_stream(sh , ngx_metrics_get_shard(sh , i) , bank , n)[word]);
+	}
+
+	if (sum != 0) {
+		(void)ngx_atomic_fetch_add(&ngx_metrics_stream_total(sh , n)[word] , sum);
+	}
+
+	return sum;
+}
+
+ngx_atomic_uint_t ngx_metrics_drain_label(ngx_metrics_sh_t * sh , ngx_uint_t bank , ngx_uint_t id , ngx_uint_t counter) {
+	ngx_uint_t i;
+	ngx_atomic_uint_t sum = 0;
+
+	for (i = 0; i < sh->nshards; i++) {
+		sum += ngx_metrics_swap_zero(
+			&ngx_metrics_shard_labels(sh , ngx_metrics_get_shard(sh , i) , bank)[id * NGX_METRICS_NCOUNTERS + counter]);
+	}
+
+	if (sum != 0) {
+		(void)ngx_atomic_fetch_add(&ngx_metrics_label_total(sh , id , counter) , sum);
+	}
+
+	return sum;
+}
+
+ngx_atomic_uint_t ngx_metrics_drain_sketch(ngx_metrics_sh_t * sh , ngx_uint_t bank , ngx_uint_t slot , ngx_uint_t word) {
+	ngx_uint_t i;
+	ngx_atomic_uint_t sum = 0;
+
+	for (i = 0; i < sh->nshards; i++) {
+		sum += ngx_metrics_swap_zero(&ngx_metrics_shard_sketch(sh , ngx_metrics_get_shard(sh , i) , bank , slot)[word]);
+	}
+
+	if (sum != 0) {
+		(void)ngx_atomic_fetch_add(&ngx_metrics_sketch_total(sh , slot)[word] , sum);
+	}
+
+	return sum;
+}
+
+ngx_atomic_uint_t ngx_metrics_drain_heavy(ngx_metrics_sh_t * sh , ngx_uint_t bank , ngx_uint_t slot , ngx_uint_t cell) {
+	ngx_uint_t i;
+	ngx_atomic_uint_t sum = 0;
+
+	for (i = 0; i < sh->nshards; i++) {
+		sum += ngx_metrics_swap_zero(&ngx_metrics_shard_heavy(sh , ngx_metrics_get_shard(sh , i) , bank , slot)[cell]);
+	}
+
+	return sum;
+}
+
+/*
+ * Takes the registers of the slot, leaving them empty for the next
+ * interval, and records the estimate of the distinct clients in the
+ * totals.
+ */
+
+ngx_atomic_uint_t ngx_metrics_drain_hll(ngx_metrics_sh_t * sh , ngx_uint_t bank , ngx_uint_t slot , u_char * registers) {
+	ngx_atomic_uint_t word , estimate;
+	ngx_uint_t w , b;
+
+	for (w = 0; w < NGX_METRICS_HLL_WORDS; w++) {
+		word = ngx_metrics_swap_zero(&ngx_metrics_hll(sh , bank , slot)[w]);
+
+		for (b = 0; b < sizeof(ngx_atomic_uint_t); b++ , word >>= 8) {
+			registers[w * sizeof(ngx_atomic_uint_t) + b] = (u_char)(word & 0xff);
+		}
+	}
+
+	estimate = ngx_metrics_hll_estimate(registers);
+	ngx_metrics_unique_total(sh , slot) = estimate;
+
+	return estimate;
+}
+
+ngx_uint_t ngx_metrics_aggregator_enabled(ngx_cycle_t * cycle) {
+	ngx_metrics_conf_t * mcf = (ngx_metrics_conf_t *)ngx_get_conf(cycle->conf_ctx , ngx_metrics_module);
+
+	return mcf->sh != NULL && mcf->export_mode == NGX_METRICS_EXPORT_AGGREGATOR;
+}
+
+/*
+ * Wraps the socket to the collector in a connection of the event loop,
+ * so that it is counted, logged and closed like the others.  It is never
+ * added to the events: the datagrams are sent without waiting and the
+ * ones the socket buffer has no room for are dropped.
+ */
+
+static ngx_int_t ngx_metrics_export_open(ngx_metrics_conf_t * mcf , ngx_log_t * log) {
+	ngx_socket_t s;
+	ngx_connection_t * c;
+
+	s = ngx_socket(mcf->export->sockaddr->sa_family , SOCK_DGRAM , 0);
+	if (s == (ngx_socket_t) -1) {
+		ngx_log_error(NGX_LOG_ALERT , log , ngx_socket_errno , ngx_socket_n " failed");
+		return NGX_ERROR;
+	}
+
+	if (ngx_nonblocking(s) == -1) {
+		ngx_log_error(NGX_LOG_ALERT , log , ngx_socket_errno , ngx_nonblocking_n " failed");
+		goto failed;
+	}
+
+	c = ngx_get_connection(s , log);
+	if (c == NULL) {
+		goto failed;
+	}
+
+	c->log = log;
+	c->read->log = log;
+	c->write->log = log;
+	c->type = SOCK_DGRAM;
+	c->sockaddr = mcf->export->sockaddr;
+	c->socklen = mcf->export->socklen;
+	c->addr_text = mcf->export->name;
+	c->data = mcf;
+
+	ngx_metrics_export_conn = c;
+
+	return NGX_OK;
+
+failed:
+
+	if (ngx_close_socket(s) == -1) {
+		ngx_log_error(NGX_LOG_ALERT , log , ngx_socket_errno , ngx_close_socket_n " failed");
+	}
+
+	return NGX_ERROR;
+}
+
+static void ngx_metrics_export_close(void) {
+	if (ngx_metrics_export_conn != NULL) {
+		ngx_close_connection(ngx_metrics_export_conn);
+		ngx_metrics_export_conn = NULL;
+	}
+}
+
+/*
+ * One export round: drains the counters of all shards into the totals
+ * and sends the non-zero ones to the collector, if there is one.  The
+ * moving averages are weighed by the time since the last round, which
+ * may be later than the interval.  That time is kept in the zone, as the
+ * old and the new aggregator both run rounds while a reload drains.
+ */
+
+static void ngx_metrics_export_run(ngx_metrics_conf_t * mcf , ngx_log_t * log) {
+	ngx_metrics_sh_t * sh = mcf->sh;
+	ngx_msec_t elapsed;
+
+	if (mcf->export != NULL && ngx_metrics_export_conn == NULL) {
+		(void)ngx_metrics_export_open(mcf , log);
+	}
+
+	ngx_shmtx_lock(&mcf->shpool->mutex);
+	elapsed = sh->rates_last ? ngx_current_msec - sh->rates_last : mcf->interval;
+	if ((ngx_msec_int_t)elapsed < 0) {
+		elapsed = 0;
+	}
+	sh->rates_last = ngx_current_msec;
+	ngx_shmtx_unlock(&mcf->shpool->mutex);
+
+	ngx_metrics_rate_decay(elapsed);
+
+	ngx_metrics_export_slots(mcf , log);
+
+	if (mcf->snapshot.len && (ngx_metrics_snapshot_last == 0 || ngx_exiting || ngx_terminate || ngx_quit
+		|| ngx_current_msec - ngx_metrics_snapshot_last >= mcf->snapshot_interval)) {
+		ngx_metrics_snapshot_sync(mcf , log);
+		ngx_metrics_snapshot_last = ngx_current_msec;
+	}
+}
+
+/* runs in the metrics aggregator process every export interval */
+
+void ngx_metrics_aggregator_process_handler(ngx_event_t * ev) {
+	ngx_metrics_conf_t * mcf = (ngx_metrics_conf_t *)ngx_get_conf(ngx_cycle->conf_ctx , ngx_metrics_module);
+
+	ngx_metrics_export_run(mcf , ev->log);
+
+	ngx_add_timer(ev , mcf->interval);
+}
+
+/*
+ * Drains the interval in progress before the aggregator exits and writes
+ * the snapshot with it, for the zone that follows.
+ */
+
+void ngx_metrics_aggregator_process_exit(ngx_cycle_t * cycle) {
+	ngx_metrics_conf_t * mcf = (ngx_metrics_conf_t *)ngx_get_conf(cycle->conf_ctx , ngx_metrics_module);
+
+	if (mcf->sh == NULL) {
+		return;
+	}
+
+	ngx_time_update();
+
+	ngx_metrics_export_run(mcf , cycle->log);
+	ngx_metrics_export_close();
+}
+
+/*
+ * Without the aggregator process, with "mode=worker" or when nginx runs
+ * without a master, the first worker does the export rounds from a timer
+ * of its event loop, between the requests it handles.  Called from the
+ * init_process of the http and stream modules, as the timers are set up
+ * after the core modules; the timer is cancelable, so that it does not
+ * hold up a graceful shutdown, and the last round is done on exit.
+ */
+
+void ngx_metrics_start_export(ngx_cycle_t * cycle) {
+	ngx_metrics_conf_t * mcf = (ngx_metrics_conf_t *)ngx_get_conf(cycle->conf_ctx , ngx_metrics_module);
+
+	if (mcf->sh == NULL || ngx_metrics_export_event.handler != NULL) {
+		return;
+	}
+
+	if (ngx_process == NGX_PROCESS_WORKER) {
+		if (mcf->export_mode != NGX_METRICS_EXPORT_WORKER || ngx_worker != 0) {
+			return;
+		}
+
+	} else if (ngx_process != NGX_PROCESS_SINGLE) {
+		return;
+	}
+
+	ngx_metrics_export_event.handler = ngx_metrics_export_handler;
+	ngx_metrics_export_event.log = cycle->log;
+	ngx_metrics_export_event.data = mcf;
+	ngx_metrics_export_event.cancelable = 1;
+
+	ngx_add_timer(&ngx_metrics_export_event , mcf->interval);
+}
+
+static void ngx_metrics_export_handler(ngx_event_t * ev) {
+	ngx_metrics_conf_t * mcf = ev->data;
+
+	if (ngx_exiting || ngx_terminate || ngx_quit) {
+		return;
+	}
+
+	ngx_metrics_export_run(mcf , ev->log);
+
+	ngx_add_timer(ev , mcf->interval);
+}
+
+/*
+ * The text format sends one "domain_count_slot_time" datagram per counter.
+ *
+ * The binary format packs as many counters as fit into a datagram of at
+ * most NGX_METRICS_EXPORT_MTU bytes, all fields in network byte order:
+ *
+ *     "NGXM" | version:8 | kind:8 | count:16 | seq:32 | time:32 |
+ *     domain length:16 | domain | count x record
+ *
+ * A record of kind 0 is id:32 | value:64, and one of kind 1, a top-K
+ * entry, is count:64 | error:64 | status:16 | uri length:16 | uri, where
+ * count over-estimates the true count by at most error.  Kind 2 records
+ * are those of kind 0 for the upstream peers, with the row of the peer
+ * in place of the slot and ids from ngx_metrics_peer_bin_id(), and kind 3
+ * records those of the stream servers and upstreams, with their row and
+ * ids from ngx_metrics_stream_bin_id().  A record of kind 4 is a
+ * label set, id:32 | requests:64 | bytes sent:64 | bytes received:64 |
+ * key length:16 | key, the key being the label values, each as
+ * length:8 | value, in the order of the metrics_label directives.  Id 0
+ * is the overflow label set, with an empty key.  A record of kind 5 is
+ * the request time sketch of a slot for the interval, slot:32 | count:64 |
+ * sum:64 | quantile count:16 | quantile count x (quantile:32 | value:64),
+ * the quantiles in millionths and their values in microseconds.  Kind 6
+ * records are those of kind 0 with the slot as the id and the estimated
+ * distinct clients of the interval as the value.  A record of kind 7 is
+ * a heavy hitter of a slot in the interval, slot:32 | count:64 |
+ * key length:16 | key, the count over-estimating the requests of the key
+ * by at most e / NGX_METRICS_HEAVY_WIDTH of those of the slot, with a
+ * probability of e^-NGX_METRICS_HEAVY_DEPTH to be off by more.  They are
+ * sent heaviest first.  A record of kind 8 is a sampled request, as put
+ * by ngx_metrics_put_trace(), sent once, shard by shard and oldest first.
+ *
+ * seq numbers the datagrams so the collector can detect losses.  An id is
+ * type:2 | sub:6 | slot:24.  Type 0 is a counter, sub selecting requests,
+ * bytes sent or bytes received; a requests counter id is thus the slot
+ * itself.  Types 1 and 2 are a request and upstream response time
+ * histogram bucket, sub being the bucket, and type 3 is the sum of the
+ * times of histogram kind sub, in milliseconds.  Bucket b counts times
+ * from ngx_metrics_hist_lower(b) ms up to the lower bound of bucket b + 1.
+ *
+ * Byte counters, histograms, peers, streams, labels, sketches, uniques,
+ * heavy hitters, top-K entries and traces are only sent in the binary
+ * format.
+ */
+
+#define NGX_METRICS_BIN_VERSION	1
+#define NGX_METRICS_BIN_COUNT	6
+#define NGX_METRICS_BIN_RECORD	12
+#define NGX_METRICS_BIN_TOPK_RECORD	20
+#define NGX_METRICS_BIN_LABELS_RECORD	30
+#define NGX_METRICS_BIN_SKETCH_RECORD	22
+#define NGX_METRICS_BIN_QUANTILE	12
+#define NGX_METRICS_BIN_HEAVY_RECORD	14
+
+#define NGX_METRICS_BIN_KIND_COUNTERS	0
+#define NGX_METRICS_BIN_KIND_TOPK	1
+#define NGX_METRICS_BIN_KIND_PEERS	2
+#define NGX_METRICS_BIN_KIND_STREAM	3
+#define NGX_METRICS_BIN_KIND_LABELS	4
+#define NGX_METRICS_BIN_KIND_SKETCH	5
+#define NGX_METRICS_BIN_KIND_UNIQUE	6
+#define NGX_METRICS_BIN_KIND_HEAVY	7
+#define NGX_METRICS_BIN_KIND_TRACE	8
+
+
+static void ngx_metrics_export_slots(ngx_metrics_conf_t * mcf , ngx_log_t * log) {
+	ngx_metrics_sh_t * sh = mcf->sh;
+	ngx_uint_t i , k , b , bank;
+	ngx_atomic_uint_t counter;
+	u_char registers[NGX_METRICS_HLL_REGISTERS];
+	u_char * dgram;
+	u_char * p;
+
+	ngx_uint_t send = (ngx_metrics_export_conn != NULL);
+	ngx_uint_t binary = send && mcf->format == NGX_METRICS_FORMAT_BINARY;
+
+	ngx_metrics_bin_dgram = NULL;
+
+	bank = ngx_metrics_flip(sh);
+
+	for (i = 0; i < sh->nslots; i++) {
+		for (k = NGX_METRICS_BYTES_SENT; k < NGX_METRICS_NCOUNTERS; k++) {
+			counter = ngx_metrics_drain(sh , bank , i , k);
+			if (counter != 0 && binary) {
+				ngx_metrics_export_record(mcf , log , NGX_METRICS_BIN_KIND_COUNTERS , ngx_metrics_bin_id(NGX_METRICS_BIN_COUNTER , k , i) , counter);
+			}
+		}
+
+		counter = ngx_metrics_drain(sh , bank , i , NGX_METRICS_REQUESTS);
+
+		if (i < sh->nrates) {
+			ngx_metrics_rate_update(sh , i , NGX_METRICS_RATE_REQUESTS , counter);
+		}
+
+		if (counter == 0 || !send) {
+			continue;
+		}
+
+		if (binary) {
+			ngx_metrics_export_record(mcf , log , NGX_METRICS_BIN_KIND_COUNTERS ,
+				ngx_metrics_bin_id(NGX_METRICS_BIN_COUNTER , NGX_METRICS_REQUESTS , i) , counter);
+
+			continue;
+		}
+
+		dgram = ngx_metrics_export_dgram(mcf , log);
+		p = ngx_snprintf(dgram , NGX_METRICS_EXPORT_MTU , "%V_%uA_%ui_%T" , &mcf->domain , counter , i , ngx_time());
+		ngx_metrics_dgram_len[ngx_metrics_ndgrams - 1] = p - dgram;
+	}
+
+	for (i = 0; i < sh->nhist; i++) {
+		for (k = 0; k < NGX_METRICS_NHIST; k++) {
+			for (b = 0; b < NGX_METRICS_HIST_BUCKETS; b++) {
+				counter = ngx_metrics_drain_bucket(sh , bank , i , k , b);
+				if (counter != 0 && binary) {
+					ngx_metrics_export_record(mcf , log , NGX_METRICS_BIN_KIND_COUNTERS , ngx_metrics_bin_id(NGX_METRICS_BIN_HIST + k , b , i) , counter);
+				}
+			}
+
+			counter = ngx_metrics_drain_bucket(sh , bank , i , k , NGX_METRICS_HIST_SUM);
+
+			if (k == NGX_METRICS_HIST_REQUEST && i < sh->nrates) {
+				ngx_metrics_rate_update(sh , i , NGX_METRICS_RATE_TIME , counter);
+			}
+
+			if (counter != 0 && binary) {
+				ngx_metrics_export_record(mcf , log , NGX_METRICS_BIN_KIND_COUNTERS , ngx_metrics_bin_id(NGX_METRICS_BIN_HIST_SUM , k , i) , counter);
+			}
+		}
+	}
+
+	for (i = 0; i < sh->npeers; i++) {
+		for (k = 0; k < NGX_METRICS_PEER_WORDS; k++) {
+			counter = ngx_metrics_drain_peer(sh , bank , i , k);
+			if (counter != 0 && binary) {
+				ngx_metrics_export_record(mcf , log , NGX_METRICS_BIN_KIND_PEERS , ngx_metrics_peer_bin_id(k , i) , counter);
+			}
+		}
+	}
+
+	for (i = 0; i < sh->nstream; i++) {
+		for (k = 0; k < NGX_METRICS_STREAM_WORDS; k++) {
+			counter = ngx_metrics_drain_stream(sh , bank , i , k);
+			if (counter != 0 && binary) {
+				ngx_metrics_export_record(mcf , log , NGX_METRICS_BIN_KIND_STREAM , ngx_metrics_stream_bin_id(k , i) ,
+					counter);
+			}
+		}
+	}
+
+	if (sh->nlabels) {
+		ngx_metrics_export_labels(mcf , bank , binary ? log : NULL);
+	}
+
+	if (sh->nsketch) {
+		ngx_metrics_export_sketches(mcf , bank , binary ? log : NULL);
+	}
+
+	for (i = 0; i < sh->nunique; i++) {
+		counter = ngx_metrics_drain_hll(sh , bank , i , registers);
+		if (counter != 0 && binary) {
+			ngx_metrics_export_record(mcf , log , NGX_METRICS_BIN_KIND_UNIQUE , (uint32_t)i , counter);
+		}
+	}
+
+	for (i = 0; i < sh->nheavy; i++) {
+		ngx_metrics_export_heavy(mcf , bank , i , binary ? log : NULL);
+	}
+
+	if (sh->ntopk) {
+		ngx_metrics_export_topk(mcf , binary ? log : NULL);
+	}
+
+	if (sh->ntraces) {
+		ngx_metrics_export_traces(mcf , binary ? log : NULL);
+	}
+
+	if (send) {
+		ngx_metrics_export_flush(mcf , log);
+	}
+}
+
+static void ngx_metrics_export_record(ngx_metrics_conf_t * mcf , ngx_log_t * log , ngx_uint_t kind , uint32_t id ,
+	ngx_atomic_uint_t value) {
+	u_char * p = ngx_metrics_export_append(mcf , log , kind , NGX_METRICS_BIN_RECORD);
+
+	p = ngx_metrics_put32(p , id);
+	p = ngx_metrics_put32(p , (uint32_t)((uint64_t)value >> 32));
+	(void)ngx_metrics_put32(p , (uint32_t)value);
+}
+
+/*
+ * Drains the counters of the label sets in use and sends the non-zero
+ * ones, with their key, when log is set.
+ */
+
+static void ngx_metrics_export_labels(ngx_metrics_conf_t * mcf , ngx_uint_t bank , ngx_log_t * log) {
+	ngx_metrics_sh_t * sh = mcf->sh;
+	ngx_atomic_uint_t counter[NGX_METRICS_NCOUNTERS];
+	ngx_metrics_labelset_t * ls;
+	ngx_uint_t i , k , used;
+	u_char * p;
+
+	used = ngx_min(sh->labels_used , sh->nlabels);
+
+	for (i = 0; i < used; i++) {
+		for (k = 0; k < NGX_METRICS_NCOUNTERS; k++) {
+			counter[k] = ngx_metrics_drain_label(sh , bank , i , k);
+		}
+
+		if (log == NULL || (counter[NGX_METRICS_REQUESTS] | counter[NGX_METRICS_BYTES_SENT] | counter[NGX_METRICS_BYTES_RECEIVED]) == 0) {
+			continue;
+		}
+
+		ls = &sh->labelsets[i];
+
+		p = ngx_metrics_export_append(mcf , log , NGX_METRICS_BIN_KIND_LABELS , NGX_METRICS_BIN_LABELS_RECORD + ls->len);
+		p = ngx_metrics_put32(p , (uint32_t)i);
+
+		for (k = 0; k < NGX_METRICS_NCOUNTERS; k++) {
+			p = ngx_metrics_put32(p , (uint32_t)((uint64_t)counter[k] >> 32));
+			p = ngx_metrics_put32(p , (uint32_t)counter[k]);
+		}
+
+		p = ngx_metrics_put16(p , ls->len);
+		(void)ngx_cpymem(p , ls->key , ls->len);
+	}
+}
+
+/*
+ * Merges the sketches of all shards into the one of the interval, whose
+ * quantiles are sent when log is set, and into the totals.
+ */
+
+static void ngx_metrics_export_sketches(ngx_metrics_conf_t * mcf , ngx_uint_t bank , ngx_log_t * log) {
+	ngx_metrics_sh_t * sh = mcf->sh;
+	ngx_atomic_uint_t sketch[NGX_METRICS_SKETCH_WORDS] , count;
+	ngx_uint_t i , k;
+	uint64_t v;
+	u_char * p;
+
+	for (i = 0; i < sh->nsketch; i++) {
+		count = 0;
+
+		for (k = 0; k < NGX_METRICS_SKETCH_WORDS; k++) {
+			sketch[k] = ngx_metrics_drain_sketch(sh , bank , i , k);
+
+			if (k < NGX_METRICS_SKETCH_BUCKETS) {
+				count += sketch[k];
+			}
+		}
+
+		if (log == NULL || count == 0) {
+			continue;
+		}
+
+		p = ngx_metrics_export_append(mcf , log , NGX_METRICS_BIN_KIND_SKETCH ,
+			NGX_METRICS_BIN_SKETCH_RECORD + mcf->nquantiles * NGX_METRICS_BIN_QUANTILE);
+		p = ngx_metrics_put32(p , (uint32_t)i);
+		p = ngx_metrics_put32(p , (uint32_t)((uint64_t)count >> 32));
+		p = ngx_metrics_put32(p , (uint32_t)count);
+		p = ngx_metrics_put32(p , (uint32_t)((uint64_t)sketch[NGX_METRICS_SKETCH_SUM] >> 32));
+		p = ngx_metrics_put32(p , (uint32_t)sketch[NGX_METRICS_SKETCH_SUM]);
+		p = ngx_metrics_put16(p , (uint32_t)mcf->nquantiles);
+
+		for (k = 0; k < mcf->nquantiles; k++) {
+			v = ngx_metrics_sketch_quantile(sh , sketch , count , mcf->quantiles[k]);
+
+			p = ngx_metrics_put32(p , (uint32_t)mcf->quantiles[k]);
+			p = ngx_metrics_put32(p , (uint32_t)(v >> 32));
+			p = ngx_metrics_put32(p , (uint32_t)v);
+		}
+	}
+}
+
+/*
+ * Takes the heavy hitters of the slot in the interval and sends them when
+ * log is set; the sketches and heaps are emptied either way.
+ */
+
+static void ngx_metrics_export_heavy(ngx_metrics_conf_t * mcf , ngx_uint_t bank , ngx_uint_t slot , ngx_log_t * log) {
+	ngx_metrics_heavy_entry_t * e;
+	ngx_uint_t i , n;
+	u_char * p;
+
+	if (ngx_metrics_heavy_copy == NULL) {
+		ngx_metrics_heavy_copy = ngx_alloc(mcf->sh->nshards * NGX_METRICS_HEAVY_K * sizeof(ngx_metrics_heavy_entry_t) ,
+			ngx_cycle->log);
+		if (ngx_metrics_heavy_copy == NULL) {
+			return;
+		}
+	}
+
+	n = ngx_metrics_heavy_take(mcf->sh , bank , slot , ngx_metrics_heavy_copy);
+	if (log == NULL) {
+		return;
+	}
+
+	for (i = 0; i < n; i++) {
+		e = &ngx_metrics_heavy_copy[i];
+
+		p = ngx_metrics_export_append(mcf , log , NGX_METRICS_BIN_KIND_HEAVY , NGX_METRICS_BIN_HEAVY_RECORD + e->len);
+		p = ngx_metrics_put32(p , (uint32_t)slot);
+		p = ngx_metrics_put32(p , (uint32_t)((uint64_t)e->count >> 32));
+		p = ngx_metrics_put32(p , (uint32_t)e->count);
+		p = ngx_metrics_put16(p , e->len);
+		(void)ngx_cpymem(p , e->key , e->len);
+	}
+}
+
+/*
+ * Takes the top-K entries collected since the last round and sends them,
+ * hottest first, when log is set; the table is emptied either way.
+ */
+
+static void ngx_metrics_export_topk(ngx_metrics_conf_t * mcf , ngx_log_t * log) {
+	ngx_metrics_topk_entry_t * e;
+	ngx_uint_t i , n;
+	u_char * p;
+
+	if (ngx_metrics_topk_copy == NULL) {
+		ngx_metrics_topk_copy = ngx_alloc(mcf->sh->ntopk * sizeof(ngx_metrics_topk_entry_t) , ngx_cycle->log);
+		if (ngx_metrics_topk_copy == NULL) {
+			return;
+		}
+	}
+
+	n = ngx_metrics_topk_take(mcf->shpool , mcf->sh , ngx_metrics_topk_copy);
+	if (log == NULL || n == 0) {
+		return;
+	}
+
+	ngx_qsort(ngx_metrics_topk_copy , n , sizeof(ngx_metrics_topk_entry_t) , ngx_metrics_topk_cmp);
+
+	for (i = 0; i < n; i++) {
+		e = &ngx_metrics_topk_copy[i];
+
+		p = ngx_metrics_export_append(mcf , log , NGX_METRICS_BIN_KIND_TOPK , NGX_METRICS_BIN_TOPK_RECORD + e->len);
+		p = ngx_metrics_put32(p , (uint32_t)((uint64_t)e->count >> 32));
+		p = ngx_metrics_put32(p , (uint32_t)e->count);
+		p = ngx_metrics_put32(p , (uint32_t)((uint64_t)e->error >> 32));
+		p = ngx_metrics_put32(p , (uint32_t)e->error);
+		p = ngx_metrics_put16(p , e->status);
+		p = ngx_metrics_put16(p , e->len);
+		(void)ngx_cpymem(p , e->uri , e->len);
+	}
+}
+
+/*
+ * Sends the traces written since the last round when log is set.  The
+ * first round starts at the end of the rings, so that a new exporter does
+ * not send again what its predecessor did.
+ */
+
+static void ngx_metrics_export_traces(ngx_metrics_conf_t * mcf , ngx_log_t * log) {
+	ngx_metrics_sh_t * sh = mcf->sh;
+	ngx_metrics_trace_t * t;
+	ngx_uint_t i , k , n;
+	u_char * p;
+
+	if (ngx_metrics_trace_next == NULL) {
+		ngx_metrics_trace_copy = ngx_alloc(sh->ntraces * sizeof(ngx_metrics_trace_t) , ngx_cycle->log);
+		ngx_metrics_trace_next = ngx_alloc(sh->nshards * sizeof(ngx_atomic_uint_t) , ngx_cycle->log);
+		if (ngx_metrics_trace_copy == NULL || ngx_metrics_trace_next == NULL) {
+			ngx_free(ngx_metrics_trace_copy);
+			ngx_free(ngx_metrics_trace_next);
+			ngx_metrics_trace_copy = NULL;
+			ngx_metrics_trace_next = NULL;
+
+			return;
+		}
+
+		for (i = 0; i < sh->nshards; i++) {
+			ngx_metrics_trace_next[i] = *ngx_metrics_shard_traces(sh , ngx_metrics_get_shard(sh , i));
+		}
+	}
+
+	for (i = 0; i < sh->nshards; i++) {
+		n = ngx_metrics_trace_take(sh , i , &ngx_metrics_trace_next[i] , ngx_metrics_trace_copy);
+		if (log == NULL) {
+			continue;
+		}
+
+		for (k = 0; k < n; k++) {
+			t = &ngx_metrics_trace_copy[k];
+
+			p = ngx_metrics_export_append(mcf , log , NGX_METRICS_BIN_KIND_TRACE , NGX_METRICS_BIN_TRACE_RECORD + t->len);
+			(void)ngx_metrics_put_trace(p , t);
+		}
+	}
+}
+
+/*
+ * Returns room for a record of len bytes in the binary datagram of the
+ * given kind being filled, starting a new datagram when it is full.
+ */
+
+static u_char * ngx_metrics_export_append(ngx_metrics_conf_t * mcf , ngx_log_t * log , ngx_uint_t kind , size_t len) {
+	u_char * dgram = ngx_metrics_bin_dgram , * p;
+
+	if (dgram == NULL || ngx_metrics_bin_kind != kind || *ngx_metrics_bin_len + len > NGX_METRICS_EXPORT_MTU) {
+		dgram = ngx_metrics_export_dgram(mcf , log);
+
+		p = ngx_cpymem(dgram , "NGXM" , 4);
+		*p++ = NGX_METRICS_BIN_VERSION;
+		*p++ = (u_char)kind;
+		p = ngx_metrics_put16(p , 0);
+		p = ngx_metrics_put32(p , ngx_metrics_export_seq++);
+		p = ngx_metrics_put32(p , (uint32_t)ngx_time());
+		p = ngx_metrics_put16(p , (uint32_t)mcf->domain.len);
+		p = ngx_cpymem(p , mcf->domain.data , mcf->domain.len);
+
+		ngx_metrics_bin_dgram = dgram;
+		ngx_metrics_bin_len = &ngx_metrics_dgram_len[ngx_metrics_ndgrams - 1];
+		ngx_metrics_bin_count = 0;
+		ngx_metrics_bin_kind = kind;
+
+		*ngx_metrics_bin_len = p - dgram;
+	}
+
+	p = dgram + *ngx_metrics_bin_len;
+	*ngx_metrics_bin_len += len;
+
+	(void)ngx_metrics_put16(dgram + NGX_METRICS_BIN_COUNT , (uint32_t)++ngx_metrics_bin_count);
+
+	return p;
+}
+
+static u_char * ngx_metrics_export_dgram(ngx_metrics_conf_t * mcf , ngx_log_t * log) {
+	if (ngx_metrics_ndgrams == NGX_METRICS_EXPORT_BATCH) {
+		ngx_metrics_export_flush(mcf , log);
+	}
+
+	ngx_metrics_dgram_len[ngx_metrics_ndgrams] = 0;
+
+	return ngx_metrics_dgrams[ngx_metrics_ndgrams++];
+}
+
+static void ngx_metrics_export_flush(ngx_metrics_conf_t * mcf , ngx_log_t * log) {
+	ngx_uint_t i;
+	ngx_int_t n;
+#if (NGX_HAVE_SENDMMSG)
+	struct mmsghdr msgs[NGX_METRICS_EXPORT_BATCH];
+	struct iovec iovs[NGX_METRICS_EXPORT_BATCH];
+
+	ngx_memzero(msgs , ngx_metrics_ndgrams * sizeof(struct mmsghdr));
+
+	for (i = 0; i < ngx_metrics_ndgrams; i++) {
+		iovs[i].iov_base = ngx_metrics_dgrams[i];
+		iovs[i].iov_len = ngx_metrics_dgram_len[i];
+		msgs[i].msg_hdr.msg_name = mcf->export->sockaddr;
+		msgs[i].msg_hdr.msg_namelen = mcf->export->socklen;
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	for (i = 0; i < ngx_metrics_ndgrams; i += n) {
+		n = sendmmsg(ngx_metrics_export_conn->fd , &msgs[i] , ngx_metrics_ndgrams - i , 0);
+		if (n == -1) {
+			ngx_log_error(NGX_LOG_ERR , log , ngx_socket_errno , "sendmmsg() to %V failed, %ui datagrams dropped" ,
+				&mcf->export->name , ngx_metrics_ndgrams - i);
+			break;
+		}
+	}
+#else
+	for (i = 0; i < ngx_metrics_ndgrams; i++) {
+		n = sendto(ngx_metrics_export_conn->fd , ngx_metrics_dgrams[i] , ngx_metrics_dgram_len[i] , 0 ,
+			mcf->export->sockaddr , mcf->export->socklen);
+		if (n == -1) {
+			ngx_log_error(NGX_LOG_ERR , log , ngx_socket_errno , "sendto() to %V failed" , &mcf->export->name);
+		}
+	}
+#endif
+
+	ngx_log_debug2(NGX_LOG_DEBUG_CORE , log , 0 , "metrics sent %ui datagrams to %V" , ngx_metrics_ndgrams , &mcf->export->name);
+
+	ngx_metrics_ndgrams = 0;
+}
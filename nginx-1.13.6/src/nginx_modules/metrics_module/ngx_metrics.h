@@ -0,0 +1,780 @@
+#ifndef _NGX_METRICS_H_INCLUDED_
+#define _NGX_METRICS_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+
+#define NGX_METRICS_ZONE_NAME	"metrics"
+#define NGX_METRICS_DEFAULT_ZONE_SIZE	(1024 * 1024)
+#define NGX_METRICS_DEFAULT_HISTOGRAMS	64
+#define NGX_METRICS_DEFAULT_TOPK	100
+#define NGX_METRICS_MAX_TOPK	65536
+#define NGX_METRICS_TOPK_URI_LEN	120
+#define NGX_METRICS_DEFAULT_LABELS	1024
+#define NGX_METRICS_LABELS_KEY_LEN	250
+#define NGX_METRICS_LABELS_CACHE	256
+#define NGX_METRICS_LABELS_OVERFLOW	0
+#define NGX_METRICS_DEFAULT_ACCURACY	100
+#define NGX_METRICS_MAX_QUANTILES	8
+#define NGX_METRICS_EXPORT_INTERVAL	1000
+#define NGX_METRICS_MAX_DOMAIN	512
+#define NGX_METRICS_EXPORT_MTU	1472
+#define NGX_METRICS_EXPORT_BATCH	64
+#define NGX_METRICS_SNAPSHOT_INTERVAL	60000
+#define NGX_METRICS_DEFAULT_TRACES	256
+#define NGX_METRICS_MAX_TRACES	65536
+
+#define NGX_METRICS_FORMAT_TEXT	0
+#define NGX_METRICS_FORMAT_BINARY	1
+
+#define NGX_METRICS_EXPORT_AGGREGATOR	0
+#define NGX_METRICS_EXPORT_WORKER	1
+
+/* the counters of a slot */
+
+#define NGX_METRICS_REQUESTS	0
+#define NGX_METRICS_BYTES_SENT	1
+#define NGX_METRICS_BYTES_RECEIVED	2
+#define NGX_METRICS_NCOUNTERS	3
+
+#define NGX_METRICS_HIST_REQUEST	0
+#define NGX_METRICS_HIST_UPSTREAM	1
+#define NGX_METRICS_NHIST	2
+
+/* the counters and histograms of an upstream peer */
+
+#define NGX_METRICS_PEER_REQUESTS	0
+#define NGX_METRICS_PEER_ERRORS	1
+#define NGX_METRICS_PEER_BYTES_RECEIVED	2
+#define NGX_METRICS_PEER_NCOUNTERS	3
+
+#define NGX_METRICS_PEER_CONNECT	0
+#define NGX_METRICS_PEER_HEADER	1
+#define NGX_METRICS_PEER_RESPONSE	2
+#define NGX_METRICS_PEER_NHIST	3
+
+/* the counters of a stream server or upstream, followed by a session time histogram */
+
+#define NGX_METRICS_STREAM_SESSIONS	0
+#define NGX_METRICS_STREAM_BYTES_RECEIVED	1
+#define NGX_METRICS_STREAM_BYTES_SENT	2
+#define NGX_METRICS_STREAM_CONNECT_FAILURES	3
+#define NGX_METRICS_STREAM_NCOUNTERS	4
+
+/* log-linear buckets in milliseconds: 4 per power of two, up to 2^17 ms */
+
+#define NGX_METRICS_HIST_SUB_BITS	2
+#define NGX_METRICS_HIST_BUCKETS	64
+#define NGX_METRICS_HIST_SUM	NGX_METRICS_HIST_BUCKETS
+#define NGX_METRICS_HIST_WORDS	(NGX_METRICS_HIST_BUCKETS + 1)
+
+#define NGX_METRICS_PEER_WORDS	(NGX_METRICS_PEER_NCOUNTERS + NGX_METRICS_PEER_NHIST * NGX_METRICS_HIST_WORDS)
+#define NGX_METRICS_STREAM_WORDS	(NGX_METRICS_STREAM_NCOUNTERS + NGX_METRICS_HIST_WORDS)
+
+/* the areas whose rows are named in the zone, by their labels */
+
+#define NGX_METRICS_ROWS_PEERS	0
+#define NGX_METRICS_ROWS_STREAM	1
+#define NGX_METRICS_ROW_AREAS	2
+#define NGX_METRICS_ROW_NAME_LEN	120
+
+/*
+ * the buckets of a quantile sketch: bucket 0 counts zero, bucket i the
+ * times from sh->sketch_bounds[i - 1] + 1 up to sh->sketch_bounds[i] ms
+ */
+
+#define NGX_METRICS_SKETCH_BUCKETS	512
+#define NGX_METRICS_SKETCH_SUM	NGX_METRICS_SKETCH_BUCKETS
+#define NGX_METRICS_SKETCH_WORDS	(NGX_METRICS_SKETCH_BUCKETS + 1)
+
+/* HyperLogLog registers, a byte each, packed into atomic words */
+
+#define NGX_METRICS_HLL_BITS	12
+#define NGX_METRICS_HLL_REGISTERS	(1 << NGX_METRICS_HLL_BITS)
+#define NGX_METRICS_HLL_WORDS	(NGX_METRICS_HLL_REGISTERS / sizeof(ngx_atomic_uint_t))
+
+/* the count-min sketch and the candidate heap of a heavy hitter slot */
+
+#define NGX_METRICS_HEAVY_DEPTH	4
+#define NGX_METRICS_HEAVY_WIDTH	256
+#define NGX_METRICS_HEAVY_CELLS	(NGX_METRICS_HEAVY_DEPTH * NGX_METRICS_HEAVY_WIDTH)
+#define NGX_METRICS_HEAVY_K	16
+#define NGX_METRICS_HEAVY_KEY_LEN	48
+
+/*
+ * the moving averages of a rate slot over 1, 5 and 15 minutes: the
+ * requests per second and the milliseconds of request time per second,
+ * both in thousandths
+ */
+
+#define NGX_METRICS_RATE_WINDOWS	3
+#define NGX_METRICS_RATE_REQUESTS	0
+#define NGX_METRICS_RATE_TIME	NGX_METRICS_RATE_WINDOWS
+#define NGX_METRICS_RATE_WORDS	(2 * NGX_METRICS_RATE_WINDOWS)
+
+/*
+ * the points of a trace: the request header read, the connect, header
+ * and response times of the last upstream try, the response header sent
+ * and the request logged, in milliseconds, the upstream times from the
+ * start of the try and the others from the start of the request
+ */
+
+#define NGX_METRICS_TRACE_HEADER	0
+#define NGX_METRICS_TRACE_CONNECT	1
+#define NGX_METRICS_TRACE_FIRST_BYTE	2
+#define NGX_METRICS_TRACE_LAST_BYTE	3
+#define NGX_METRICS_TRACE_SEND	4
+#define NGX_METRICS_TRACE_DONE	5
+#define NGX_METRICS_TRACE_POINTS	6
+#define NGX_METRICS_TRACE_NONE	0xffffffff
+#define NGX_METRICS_TRACE_URI_LEN	62
+
+/* a trace record of the binary formats, followed by the uri */
+
+#define NGX_METRICS_BIN_TRACE_RECORD	(34 + NGX_METRICS_TRACE_POINTS * 4)
+
+#define ngx_metrics_hist_lower(b)	\
+	((b) < 4 ? (ngx_msec_t) (b) : (ngx_msec_t) (4 + (b) % 4) << ((b) / 4 - 1))
+
+/* record ids of the binary formats: type:2 | sub:6 | slot:24 */
+
+#define NGX_METRICS_BIN_COUNTER	0
+#define NGX_METRICS_BIN_HIST	1
+#define NGX_METRICS_BIN_HIST_SUM	3
+
+#define NGX_METRICS_MAX_SLOTS	0xffffff
+
+#define ngx_metrics_bin_id(type , sub , slot)	\
+	((uint32_t) (type) << 30 | (uint32_t) (sub) << 24 | (uint32_t) (slot))
+
+/*
+ * The counters live in the "metrics" shared memory zone, split into one
+ * shard per worker process.  A shard starts on its own cache line and is
+ * only incremented by the process that owns it, so no two cores write the
+ * same line.  Every slot has NGX_METRICS_NCOUNTERS adjacent counters:
+ * requests, bytes sent and bytes received.
+ *
+ * Every shard keeps two banks of counters.  Workers count into the bank
+ * selected by the current epoch; the exporter flips the epoch and then
+ * drains the bank that just became inactive by atomically swapping each
+ * counter with zero.  An increment that raced with the flip lands in the
+ * drained bank after the swap and is exported with the next drain of that
+ * bank, so nothing is lost and workers never wait for the exporter.
+ *
+ * The first nhist slots also have a latency histogram per kind in each
+ * bank, laid out after the counters and drained the same way.  The word
+ * after the buckets holds the sum of the recorded times.
+ *
+ * The upstream peers come last, NGX_METRICS_PEER_WORDS per peer and bank:
+ * the peer counters followed by the connect, header and response time
+ * histograms.
+ *
+ * The stream servers and upstreams follow the peers, NGX_METRICS_STREAM_WORDS
+ * each.
+ *
+ * A peer or stream row is named by its labels in a table of the zone,
+ * which hands out rows as the workers meet the names and never frees
+ * them, so that the totals of a row keep their name whatever the order
+ * of the configuration, across reloads and snapshots.
+ *
+ * The label sets follow, with the counters of a slot each.  A label
+ * set is a tuple of label values interned in the shared label table,
+ * which hands out ids in order and never frees them.  Once the table is
+ * full, new tuples are counted into the overflow label set, id 0.
+ *
+ * The first nsketch slots also have a quantile sketch of their request
+ * times, NGX_METRICS_SKETCH_WORDS per slot and bank, after the label sets.
+ * Its buckets grow geometrically, each one at most 1 + 2 * accuracy times
+ * as wide as its lower bound, so any quantile is estimated within the
+ * relative accuracy of the zone.  Sketches merge by adding their buckets,
+ * which is what draining the shards into the totals does.
+ *
+ * The first nunique slots have HyperLogLog registers of the client
+ * addresses, NGX_METRICS_HLL_WORDS per slot and bank, outside the shards:
+ * the union of per-shard registers is the maximum of every register, so
+ * a single set shared by all workers holds the same estimate.  A worker
+ * raises a register with a compare and swap of its word, which fails only
+ * while the register is still growing, and the aggregator swaps the words
+ * with zero to estimate the distinct clients of the interval.  The totals
+ * keep only that estimate.
+ *
+ * The first nheavy slots end the shard with a count-min sketch of their
+ * keys, client addresses by default, and a min-heap of the keys with the
+ * highest estimates in the shard, NGX_METRICS_HEAVY_WORDS per slot and
+ * bank.  The sketches of all shards add up to the sketch of the interval,
+ * from which the aggregator estimates the candidates of all heaps and
+ * exports the heaviest.  Nothing of them is kept in the totals.
+ *
+ * The shard ends with a ring of the last ntraces sampled requests of its
+ * owner, on their own cache lines after a cache line with the number of
+ * traces ever written.  The owner is the only writer; a trace is odd
+ * while it is written and then numbers its place in the sequence, so
+ * readers in any process copy the ring without locks and drop the traces
+ * that changed under them.  The ring is neither banked nor drained.
+ *
+ * Every drained value is also added to the totals, which are outside the
+ * shards and only ever grow, for readers that want cumulative values.
+ * The totals end with the moving averages of the first nrates slots,
+ * which the aggregator alone updates from every drain.
+ *
+ * The zone is reused across reloads of the configuration as long as its
+ * size does not change.  A reload fails if it would lay the zone out
+ * differently, or if it starts more workers than the shards leave room
+ * for next to the old workers, which keep theirs until they exit.
+ *
+ * A new zone, after a binary upgrade, a change of size or a restart,
+ * starts from the snapshot of the totals its predecessor last wrote, and
+ * the aggregator keeps adding what the predecessor writes later, until it
+ * has exited, so that neither the interval the old processes were in nor
+ * the totals are lost or counted twice.
+ *
+ * The top-K table counts the hottest uri and status pairs with the
+ * Space-Saving algorithm.  Workers pre-aggregate into a local table and
+ * merge it into the shared one under the zone mutex once per interval.
+ * Both tables find their entries through an open addressing index and
+ * keep them in a min-heap on their counts, so that merging an entry
+ * costs O(log topk) whatever the size of the table.
+ */
+typedef struct tag_ngx_metrics_shard {
+	ngx_atomic_t owner;
+} ngx_metrics_shard_t;
+
+typedef struct tag_ngx_metrics_topk_entry {
+	uint32_t hash;
+	uint16_t status;
+	uint16_t len;
+	ngx_atomic_uint_t count;
+	ngx_atomic_uint_t error;
+	u_char uri[NGX_METRICS_TOPK_URI_LEN];
+} ngx_metrics_topk_entry_t;
+
+/* the index holds an entry plus one, 0 being free */
+
+typedef struct tag_ngx_metrics_topk_table {
+	ngx_metrics_topk_entry_t * entries;
+	ngx_uint_t used;
+	uint32_t * heap;
+	uint32_t * pos;
+	uint32_t * index;
+	ngx_uint_t mask;
+} ngx_metrics_topk_table_t;
+
+/* the key is the label values, each as length:8 | value */
+
+typedef struct tag_ngx_metrics_labelset {
+	uint32_t hash;
+	uint16_t len;
+	u_char key[NGX_METRICS_LABELS_KEY_LEN];
+} ngx_metrics_labelset_t;
+
+typedef struct tag_ngx_metrics_row {
+	uint32_t hash;
+	uint16_t len;
+	u_char name[NGX_METRICS_ROW_NAME_LEN];
+} ngx_metrics_row_t;
+
+typedef struct tag_ngx_metrics_heavy_entry {
+	ngx_atomic_uint_t count;
+	uint32_t hash;
+	uint16_t len;
+	u_char key[NGX_METRICS_HEAVY_KEY_LEN];
+} ngx_metrics_heavy_entry_t;
+
+/* the cells of the sketch, then the number of heap entries and the heap */
+
+#define NGX_METRICS_HEAVY_USED	NGX_METRICS_HEAVY_CELLS
+#define NGX_METRICS_HEAVY_HEAP	(NGX_METRICS_HEAVY_CELLS + 1)
+#define NGX_METRICS_HEAVY_WORDS	\
+	(NGX_METRICS_HEAVY_HEAP + NGX_METRICS_HEAVY_K * sizeof(ngx_metrics_heavy_entry_t) / sizeof(ngx_atomic_t))
+
+/* a sampled request, two cache lines */
+
+typedef struct tag_ngx_metrics_trace {
+	ngx_atomic_t seq;
+	uint64_t start;
+	uint32_t slot;
+	uint16_t status;
+	uint16_t tries;
+	uint32_t time[NGX_METRICS_TRACE_POINTS];
+	uint64_t sent;
+	uint64_t received;
+	uint16_t len;
+	u_char uri[NGX_METRICS_TRACE_URI_LEN];
+} ngx_metrics_trace_t;
+
+typedef struct tag_ngx_metrics_sh {
+	ngx_atomic_t epoch;
+	ngx_uint_t nslots;
+	ngx_uint_t nhist;
+	ngx_uint_t npeers;
+	ngx_uint_t nstream;
+	ngx_metrics_row_t * rows[NGX_METRICS_ROW_AREAS];
+	ngx_atomic_t rows_used[NGX_METRICS_ROW_AREAS];
+	uint32_t * rows_index[NGX_METRICS_ROW_AREAS];
+	ngx_uint_t rows_mask[NGX_METRICS_ROW_AREAS];
+	ngx_uint_t nshards;
+	size_t shard_size;
+	u_char * shards;
+	ngx_atomic_t * totals;
+	ngx_uint_t ntopk;
+	ngx_metrics_topk_table_t topk;
+	ngx_uint_t nlabels;
+	ngx_atomic_t labels_used;
+	ngx_metrics_labelset_t * labelsets;
+	uint32_t * labels_index;
+	ngx_uint_t labels_mask;
+	ngx_uint_t nsketch;
+	ngx_uint_t accuracy;
+	ngx_uint_t sketch_linear;
+	uint32_t sketch_bounds[NGX_METRICS_SKETCH_BUCKETS];
+	ngx_uint_t nunique;
+	ngx_atomic_t * hll;
+	ngx_uint_t nheavy;
+	ngx_uint_t nrates;
+	ngx_msec_t rates_last;
+	ngx_uint_t ntraces;
+	uint64_t zone_id;
+	uint64_t snapshot_origin;
+	ngx_atomic_t snapshot_seq;
+	ngx_atomic_t snapshot_written;
+	ngx_atomic_uint_t * snapshot_base;
+	ngx_uint_t snapshot_nbase;
+} ngx_metrics_sh_t;
+
+typedef struct tag_ngx_metrics_conf {
+	ngx_shm_zone_t * shm_zone;
+	ngx_slab_pool_t * shpool;
+	ngx_metrics_sh_t * sh;
+	ngx_uint_t nworkers;
+	ngx_uint_t shards;
+	ngx_uint_t nshards;
+	ngx_uint_t nhist;
+	ngx_uint_t npeers;
+	ngx_uint_t nstream;
+	ngx_array_t * rows[NGX_METRICS_ROW_AREAS];
+	ngx_uint_t nlabels;
+	ngx_uint_t nsketch;
+	ngx_uint_t accuracy;
+	ngx_uint_t nunique;
+	ngx_uint_t nheavy;
+	ngx_uint_t nrates;
+	ngx_uint_t ntraces;
+	ngx_uint_t nquantiles;
+	ngx_uint_t quantiles[NGX_METRICS_MAX_QUANTILES];
+	ngx_str_t quantile_names[NGX_METRICS_MAX_QUANTILES];
+	ngx_uint_t ntopk;
+	ngx_addr_t * export;
+	ngx_str_t domain;
+	ngx_msec_t interval;
+	ngx_uint_t format;
+	ngx_uint_t export_mode;
+	ngx_str_t snapshot;
+	ngx_msec_t snapshot_interval;
+} ngx_metrics_conf_t;
+
+#define ngx_metrics_get_shard(sh , n)	\
+	((ngx_metrics_shard_t *) ((sh)->shards + (n) * (sh)->shard_size))
+
+#define ngx_metrics_shard_counters(sh , shard , bank)	\
+	((ngx_atomic_t *) ((u_char *) (shard) + NGX_CPU_CACHE_LINE) + (bank) * (sh)->nslots * NGX_METRICS_NCOUNTERS)
+
+#define ngx_metrics_shard_histogram(sh , shard , bank , slot , kind)	\
+	(ngx_metrics_shard_counters(sh , shard , 2)	\
+		+ (((bank) * (sh)->nhist + (slot)) * NGX_METRICS_NHIST + (kind)) * NGX_METRICS_HIST_WORDS)
+
+#define ngx_metrics_shard_peer(sh , shard , bank , peer)	\
+	(ngx_metrics_shard_histogram(sh , shard , 2 , 0 , 0) + ((bank) * (sh)->npeers + (peer)) * NGX_METRICS_PEER_WORDS)
+
+#define ngx_metrics_shard_stream(sh , shard , bank , n)	\
+	(ngx_metrics_shard_peer(sh , shard , 2 , 0) + ((bank) * (sh)->nstream + (n)) * NGX_METRICS_STREAM_WORDS)
+
+#define ngx_metrics_shard_labels(sh , shard , bank)	\
+	(ngx_metrics_shard_stream(sh , shard , 2 , 0) + (bank) * (sh)->nlabels * NGX_METRICS_NCOUNTERS)
+
+#define ngx_metrics_shard_sketch(sh , shard , bank , slot)	\
+	(ngx_metrics_shard_labels(sh , shard , 2) + ((bank) * (sh)->nsketch + (slot)) * NGX_METRICS_SKETCH_WORDS)
+
+#define ngx_metrics_shard_heavy(sh , shard , bank , slot)	\
+	(ngx_metrics_shard_sketch(sh , shard , 2 , 0) + ((bank) * (sh)->nheavy + (slot)) * NGX_METRICS_HEAVY_WORDS)
+
+#define ngx_metrics_shard_traces(sh , shard)	\
+	((ngx_atomic_t *) ngx_align_ptr(ngx_metrics_shard_heavy(sh , shard , 2 , 0) , NGX_CPU_CACHE_LINE))
+
+#define ngx_metrics_trace_entry(ring , n)	\
+	((ngx_metrics_trace_t *) ((u_char *) (ring) + NGX_CPU_CACHE_LINE) + (n))
+
+#define ngx_metrics_hll(sh , bank , slot)	\
+	((sh)->hll + ((bank) * (sh)->nunique + (slot)) * NGX_METRICS_HLL_WORDS)
+
+#define ngx_metrics_total(sh , slot , counter)	\
+	((sh)->totals[(slot) * NGX_METRICS_NCOUNTERS + (counter)])
+
+#define ngx_metrics_hist_total(sh , slot , kind)	\
+	((sh)->totals + (sh)->nslots * NGX_METRICS_NCOUNTERS + ((slot) * NGX_METRICS_NHIST + (kind)) * NGX_METRICS_HIST_WORDS)
+
+#define ngx_metrics_peer_total(sh , peer)	\
+	(ngx_metrics_hist_total(sh , (sh)->nhist , 0) + (peer) * NGX_METRICS_PEER_WORDS)
+
+#define ngx_metrics_stream_total(sh , n)	\
+	(ngx_metrics_peer_total(sh , (sh)->npeers) + (n) * NGX_METRICS_STREAM_WORDS)
+
+#define ngx_metrics_label_total(sh , id , counter)	\
+	(ngx_metrics_stream_total(sh , (sh)->nstream)[(id) * NGX_METRICS_NCOUNTERS + (counter)])
+
+#define ngx_metrics_sketch_total(sh , slot)	\
+	(&ngx_metrics_label_total(sh , (sh)->nlabels , 0) + (slot) * NGX_METRICS_SKETCH_WORDS)
+
+#define ngx_metrics_unique_total(sh , slot)	\
+	(ngx_metrics_sketch_total(sh , (sh)->nsketch)[slot])
+
+#define ngx_metrics_rate_total(sh , slot)	\
+	(&ngx_metrics_unique_total(sh , (sh)->nunique) + (slot) * NGX_METRICS_RATE_WORDS)
+
+extern ngx_module_t ngx_metrics_module;
+extern ngx_metrics_sh_t * ngx_metrics_sh;
+extern ngx_metrics_shard_t * ngx_metrics_shard;
+
+ngx_shm_zone_t * ngx_metrics_add_zone(ngx_conf_t * cf);
+void ngx_metrics_reserve_rows(ngx_conf_t * cf , ngx_uint_t area , ngx_array_t * names);
+void ngx_metrics_reserve_labels(ngx_conf_t * cf , ngx_uint_t nlabels);
+void ngx_metrics_reserve_traces(ngx_conf_t * cf , ngx_uint_t ntraces);
+ngx_uint_t ngx_metrics_aggregator_enabled(ngx_cycle_t * cycle);
+void ngx_metrics_aggregator_process_handler(ngx_event_t * ev);
+void ngx_metrics_aggregator_process_exit(ngx_cycle_t * cycle);
+void ngx_metrics_start_export(ngx_cycle_t * cycle);
+ngx_uint_t ngx_metrics_flip(ngx_metrics_sh_t * sh);
+ngx_atomic_uint_t ngx_metrics_drain(ngx_metrics_sh_t * sh , ngx_uint_t bank , ngx_uint_t slot , ngx_uint_t counter);
+ngx_int_t ngx_metrics_topk_init_zone(ngx_slab_pool_t * shpool , ngx_metrics_sh_t * sh , ngx_uint_t ntopk);
+ngx_int_t ngx_metrics_topk_init(ngx_cycle_t * cycle , ngx_slab_pool_t * shpool , ngx_metrics_sh_t * sh ,
+	ngx_msec_t interval);
+void ngx_metrics_topk_count(u_char * uri , size_t len , ngx_uint_t status);
+void ngx_metrics_topk_flush(void);
+ngx_uint_t ngx_metrics_topk_take(ngx_slab_pool_t * shpool , ngx_metrics_sh_t * sh , ngx_metrics_topk_entry_t * out);
+int ngx_libc_cdecl ngx_metrics_topk_cmp(const void * one , const void * two);
+ngx_atomic_uint_t ngx_metrics_drain_bucket(ngx_metrics_sh_t * sh , ngx_uint_t bank , ngx_uint_t slot ,
+	ngx_uint_t kind , ngx_uint_t bucket);
+ngx_atomic_uint_t ngx_metrics_drain_peer(ngx_metrics_sh_t * sh , ngx_uint_t bank , ngx_uint_t peer , ngx_uint_t word);
+ngx_atomic_uint_t ngx_metrics_drain_stream(ngx_metrics_sh_t * sh , ngx_uint_t bank , ngx_uint_t n , ngx_uint_t word);
+ngx_atomic_uint_t ngx_metrics_drain_label(ngx_metrics_sh_t * sh , ngx_uint_t bank , ngx_uint_t id , ngx_uint_t counter);
+ngx_int_t ngx_metrics_rows_init_zone(ngx_slab_pool_t * shpool , ngx_metrics_sh_t * sh , ngx_uint_t area , ngx_uint_t n);
+ngx_int_t ngx_metrics_rows_check(ngx_metrics_sh_t * sh , ngx_uint_t area , ngx_array_t * names);
+ngx_int_t ngx_metrics_row(ngx_slab_pool_t * shpool , ngx_metrics_sh_t * sh , ngx_uint_t area , u_char * name ,
+	size_t len);
+ngx_int_t ngx_metrics_labels_init_zone(ngx_slab_pool_t * shpool , ngx_metrics_sh_t * sh , ngx_uint_t nlabels);
+ngx_int_t ngx_metrics_labels_init(ngx_cycle_t * cycle , ngx_slab_pool_t * shpool , ngx_metrics_sh_t * sh);
+ngx_uint_t ngx_metrics_labels_intern(u_char * key , size_t len);
+ngx_uint_t ngx_metrics_labels_add(ngx_slab_pool_t * shpool , ngx_metrics_sh_t * sh , u_char * key , size_t len);
+ngx_atomic_uint_t ngx_metrics_drain_sketch(ngx_metrics_sh_t * sh , ngx_uint_t bank , ngx_uint_t slot , ngx_uint_t word);
+void ngx_metrics_sketch_init_zone(ngx_metrics_sh_t * sh , ngx_uint_t nsketch , ngx_uint_t accuracy);
+uint64_t ngx_metrics_sketch_quantile(ngx_metrics_sh_t * sh , ngx_atomic_uint_t * buckets , ngx_atomic_uint_t count ,
+	ngx_uint_t quantile);
+ngx_atomic_uint_t ngx_metrics_drain_hll(ngx_metrics_sh_t * sh , ngx_uint_t bank , ngx_uint_t slot , u_char * registers);
+ngx_atomic_uint_t ngx_metrics_hll_estimate(u_char * registers);
+ngx_atomic_uint_t ngx_metrics_drain_heavy(ngx_metrics_sh_t * sh , ngx_uint_t bank , ngx_uint_t slot , ngx_uint_t cell);
+void ngx_metrics_heavy_count(ngx_uint_t slot , u_char * key , size_t len);
+ngx_uint_t ngx_metrics_heavy_take(ngx_metrics_sh_t * sh , ngx_uint_t bank , ngx_uint_t slot , ngx_metrics_heavy_entry_t * out);
+void ngx_metrics_snapshot_open(ngx_metrics_conf_t * mcf , ngx_metrics_sh_t * sh , ngx_log_t * log);
+void ngx_metrics_snapshot_restore(ngx_metrics_conf_t * mcf , ngx_metrics_sh_t * sh , ngx_log_t * log);
+void ngx_metrics_snapshot_sync(ngx_metrics_conf_t * mcf , ngx_log_t * log);
+void ngx_metrics_rate_decay(ngx_msec_t elapsed);
+void ngx_metrics_rate_update(ngx_metrics_sh_t * sh , ngx_uint_t slot , ngx_uint_t kind , ngx_atomic_uint_t value);
+void ngx_metrics_trace_add(ngx_metrics_trace_t * trace);
+ngx_uint_t ngx_metrics_trace_take(ngx_metrics_sh_t * sh , ngx_uint_t shard , ngx_atomic_uint_t * next ,
+	ngx_metrics_trace_t * out);
+#if (NGX_METRICS_BENCH)
+ngx_int_t ngx_metrics_topk_check(ngx_log_t * log);
+ngx_int_t ngx_metrics_snapshot_check(ngx_metrics_conf_t * mcf , ngx_str_t * path , ngx_log_t * log);
+#endif
+
+/* takes a word of a drained bank, leaving zero in its place */
+
+static ngx_inline ngx_atomic_uint_t ngx_metrics_swap_zero(ngx_atomic_t * counter) {
+	ngx_atomic_uint_t value;
+
+	do {
+		value = *counter;
+	} while (value != 0 && !ngx_atomic_cmp_set(counter , value , 0));
+
+	return value;
+}
+
+static ngx_inline void ngx_metrics_add(ngx_uint_t slot , ngx_uint_t counter , ngx_atomic_int_t n) {
+	ngx_metrics_sh_t * sh = ngx_metrics_sh;
+
+	if (ngx_metrics_shard == NULL || slot >= sh->nslots) {
+		return;
+	}
+
+	(void)ngx_atomic_fetch_add(
+		&ngx_metrics_shard_counters(sh , ngx_metrics_shard , sh->epoch & 1)[slot * NGX_METRICS_NCOUNTERS + counter] , n);
+}
+
+#define ngx_metrics_count(slot)	ngx_metrics_add(slot , NGX_METRICS_REQUESTS , 1)
+
+static ngx_inline u_char * ngx_metrics_put16(u_char * p , uint32_t v) {
+	*p++ = (u_char)(v >> 8);
+	*p++ = (u_char)v;
+
+	return p;
+}
+
+static ngx_inline u_char * ngx_metrics_put32(u_char * p , uint32_t v) {
+	*p++ = (u_char)(v >> 24);
+	*p++ = (u_char)(v >> 16);
+
+	return ngx_metrics_put16(p , v);
+}
+
+/*
+ * A trace record: slot:32 | status:16 | tries:16 | start:64 |
+ * NGX_METRICS_TRACE_POINTS x time:32 | bytes sent:64 | bytes received:64 |
+ * uri length:16 | uri, the start in milliseconds since the epoch.
+ */
+
+static ngx_inline u_char * ngx_metrics_put_trace(u_char * p , ngx_metrics_trace_t * t) {
+	ngx_uint_t i;
+
+	p = ngx_metrics_put32(p , t->slot);
+	p = ngx_metrics_put16(p , t->status);
+	p = ngx_metrics_put16(p , t->tries);
+	p = ngx_metrics_put32(p , (uint32_t)(t->start >> 32));
+	p = ngx_metrics_put32(p , (uint32_t)t->start);
+
+	for (i = 0; i < NGX_METRICS_TRACE_POINTS; i++) {
+		p = ngx_metrics_put32(p , t->time[i]);
+	}
+
+	p = ngx_metrics_put32(p , (uint32_t)(t->sent >> 32));
+	p = ngx_metrics_put32(p , (uint32_t)t->sent);
+	p = ngx_metrics_put32(p , (uint32_t)(t->received >> 32));
+	p = ngx_metrics_put32(p , (uint32_t)t->received);
+	p = ngx_metrics_put16(p , t->len);
+
+	return ngx_cpymem(p , t->uri , t->len);
+}
+
+static ngx_inline ngx_uint_t ngx_metrics_hist_bucket(ngx_msec_t ms) {
+	ngx_uint_t e;
+
+	if (ms < (1 << NGX_METRICS_HIST_SUB_BITS)) {
+		return ms;
+	}
+
+	for (e = NGX_METRICS_HIST_SUB_BITS; e < 31 && (ms >> (e + 1)) != 0; e++) { /* void */ }
+
+	e = ((e - NGX_METRICS_HIST_SUB_BITS + 1) << NGX_METRICS_HIST_SUB_BITS)
+		+ ((ms >> (e - NGX_METRICS_HIST_SUB_BITS)) & ((1 << NGX_METRICS_HIST_SUB_BITS) - 1));
+
+	return ngx_min(e , NGX_METRICS_HIST_BUCKETS - 1);
+}
+
+/*
+ * The bounds start with one bucket per millisecond, as long as the
+ * accuracy allows, so only the longer times are searched for.
+ */
+
+static ngx_inline ngx_uint_t ngx_metrics_sketch_bucket(ngx_metrics_sh_t * sh , ngx_msec_t ms) {
+	ngx_uint_t lo , hi , mid;
+
+	if (ms <= sh->sketch_linear) {
+		return ms;
+	}
+
+	lo = sh->sketch_linear + 1;
+	hi = NGX_METRICS_SKETCH_BUCKETS - 1;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+
+		if (sh->sketch_bounds[mid] < ms) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo;
+}
+
+static ngx_inline void ngx_metrics_observe(ngx_uint_t slot , ngx_uint_t kind , ngx_msec_t ms) {
+	ngx_metrics_sh_t * sh = ngx_metrics_sh;
+	ngx_atomic_t * sketch , * hist;
+
+	if (ngx_metrics_shard == NULL) {
+		return;
+	}
+
+	if (kind == NGX_METRICS_HIST_REQUEST && slot < sh->nsketch) {
+		sketch = ngx_metrics_shard_sketch(sh , ngx_metrics_shard , sh->epoch & 1 , slot);
+
+		(void)ngx_atomic_fetch_add(&sketch[ngx_metrics_sketch_bucket(sh , ms)] , 1);
+		(void)ngx_atomic_fetch_add(&sketch[NGX_METRICS_SKETCH_SUM] , ms);
+	}
+
+	if (slot >= sh->nhist) {
+		return;
+	}
+
+	hist = ngx_metrics_shard_histogram(sh , ngx_metrics_shard , sh->epoch & 1 , slot , kind);
+
+	(void)ngx_atomic_fetch_add(&hist[ngx_metrics_hist_bucket(ms)] , 1);
+	(void)ngx_atomic_fetch_add(&hist[NGX_METRICS_HIST_SUM] , ms);
+}
+
+/*
+ * The requests per second of a rate slot over a window, in thousandths,
+ * and their average time in microseconds, as of the last interval.
+ */
+
+static ngx_inline ngx_atomic_uint_t ngx_metrics_rate(ngx_metrics_sh_t * sh , ngx_uint_t slot , ngx_uint_t window) {
+	return ngx_metrics_rate_total(sh , slot)[NGX_METRICS_RATE_REQUESTS + window];
+}
+
+static ngx_inline ngx_atomic_uint_t ngx_metrics_rate_latency(ngx_metrics_sh_t * sh , ngx_uint_t slot , ngx_uint_t window) {
+	ngx_atomic_t * rate = ngx_metrics_rate_total(sh , slot);
+	ngx_atomic_uint_t requests = rate[NGX_METRICS_RATE_REQUESTS + window];
+
+	return requests ? (ngx_atomic_uint_t)((uint64_t)rate[NGX_METRICS_RATE_TIME + window] * 1000 / requests) : 0;
+}
+
+/*
+ * Adds a client to the registers of the slot: the high bits of its hash
+ * select a register, which keeps the highest rank, the position of the
+ * first set bit, seen in the rest.
+ */
+
+static ngx_inline void ngx_metrics_unique(ngx_uint_t slot , uint32_t hash) {
+	ngx_metrics_sh_t * sh = ngx_metrics_sh;
+	ngx_atomic_uint_t old , reg , shift;
+	ngx_atomic_t * word;
+	ngx_uint_t idx , rank;
+	uint32_t rest;
+
+	if (ngx_metrics_shard == NULL || slot >= sh->nunique) {
+		return;
+	}
+
+	idx = hash >> (32 - NGX_METRICS_HLL_BITS);
+	rest = hash << NGX_METRICS_HLL_BITS;
+
+	for (rank = 1; rank <= 32 - NGX_METRICS_HLL_BITS && !(rest & 0x80000000); rank++) {
+		rest <<= 1;
+	}
+
+	word = &ngx_metrics_hll(sh , sh->epoch & 1 , slot)[idx / sizeof(ngx_atomic_uint_t)];
+	shift = (idx % sizeof(ngx_atomic_uint_t)) * 8;
+
+	do {
+		old = *word;
+		reg = (old >> shift) & 0xff;
+
+		if (reg >= rank) {
+			return;
+		}
+	} while (!ngx_atomic_cmp_set(word , old , (old & ~((ngx_atomic_uint_t)0xff << shift)) | (ngx_atomic_uint_t)rank << shift));
+}
+
+/*
+ * The record id of a peer word: type 0 with sub 0 to 2 is a peer counter
+ * and with sub 3 to 5 the sum of a peer histogram, types 1 to 3 are the
+ * buckets of the connect, header and response time histograms.
+ */
+
+static ngx_inline uint32_t ngx_metrics_peer_bin_id(ngx_uint_t word , ngx_uint_t peer) {
+	ngx_uint_t kind , bucket;
+
+	if (word < NGX_METRICS_PEER_NCOUNTERS) {
+		return ngx_metrics_bin_id(NGX_METRICS_BIN_COUNTER , word , peer);
+	}
+
+	kind = (word - NGX_METRICS_PEER_NCOUNTERS) / NGX_METRICS_HIST_WORDS;
+	bucket = (word - NGX_METRICS_PEER_NCOUNTERS) % NGX_METRICS_HIST_WORDS;
+
+	if (bucket == NGX_METRICS_HIST_SUM) {
+		return ngx_metrics_bin_id(NGX_METRICS_BIN_COUNTER , NGX_METRICS_PEER_NCOUNTERS + kind , peer);
+	}
+
+	return ngx_metrics_bin_id(NGX_METRICS_BIN_HIST + kind , bucket , peer);
+}
+
+/*
+ * The record id of a stream word: type 0 with sub 0 to 3 is a counter and
+ * with sub 4 the sum of the session times, type 1 a session time bucket.
+ */
+
+static ngx_inline uint32_t ngx_metrics_stream_bin_id(ngx_uint_t word , ngx_uint_t n) {
+	if (word < NGX_METRICS_STREAM_NCOUNTERS) {
+		return ngx_metrics_bin_id(NGX_METRICS_BIN_COUNTER , word , n);
+	}
+
+	if (word - NGX_METRICS_STREAM_NCOUNTERS == NGX_METRICS_HIST_SUM) {
+		return ngx_metrics_bin_id(NGX_METRICS_BIN_COUNTER , NGX_METRICS_STREAM_NCOUNTERS , n);
+	}
+
+	return ngx_metrics_bin_id(NGX_METRICS_BIN_HIST , word - NGX_METRICS_STREAM_NCOUNTERS , n);
+}
+
+static ngx_inline void ngx_metrics_peer_add(ngx_uint_t peer , ngx_uint_t counter , ngx_atomic_int_t n) {
+	ngx_metrics_sh_t * sh = ngx_metrics_sh;
+
+	if (ngx_metrics_shard == NULL || peer >= sh->npeers) {
+		return;
+	}
+
+	(void)ngx_atomic_fetch_add(&ngx_metrics_shard_peer(sh , ngx_metrics_shard , sh->epoch & 1 , peer)[counter] , n);
+}
+
+static ngx_inline void ngx_metrics_peer_observe(ngx_uint_t peer , ngx_uint_t kind , ngx_msec_t ms) {
+	ngx_metrics_sh_t * sh = ngx_metrics_sh;
+	ngx_atomic_t * hist;
+
+	if (ngx_metrics_shard == NULL || peer >= sh->npeers) {
+		return;
+	}
+
+	hist = ngx_metrics_shard_peer(sh , ngx_metrics_shard , sh->epoch & 1 , peer)
+		+ NGX_METRICS_PEER_NCOUNTERS + kind * NGX_METRICS_HIST_WORDS;
+
+	(void)ngx_atomic_fetch_add(&hist[ngx_metrics_hist_bucket(ms)] , 1);
+	(void)ngx_atomic_fetch_add(&hist[NGX_METRICS_HIST_SUM] , ms);
+}
+
+static ngx_inline void ngx_metrics_stream_add(ngx_uint_t n , ngx_uint_t counter , ngx_atomic_int_t v) {
+	ngx_metrics_sh_t * sh = ngx_metrics_sh;
+
+	if (ngx_metrics_shard == NULL || n >= sh->nstream) {
+		return;
+	}
+
+	(void)ngx_atomic_fetch_add(&ngx_metrics_shard_stream(sh , ngx_metrics_shard , sh->epoch & 1 , n)[counter] , v);
+}
+
+static ngx_inline void ngx_metrics_stream_observe(ngx_uint_t n , ngx_msec_t ms) {
+	ngx_metrics_sh_t * sh = ngx_metrics_sh;
+	ngx_atomic_t * hist;
+
+	if (ngx_metrics_shard == NULL || n >= sh->nstream) {
+		return;
+	}
+
+	hist = ngx_metrics_shard_stream(sh , ngx_metrics_shard , sh->epoch & 1 , n) + NGX_METRICS_STREAM_NCOUNTERS;
+
+	(void)ngx_atomic_fetch_add(&hist[ngx_metrics_hist_bucket(ms)] , 1);
+	(void)ngx_atomic_fetch_add(&hist[NGX_METRICS_HIST_SUM] , ms);
+}
+
+static ngx_inline void ngx_metrics_label_add(ngx_uint_t id , ngx_uint_t counter , ngx_atomic_int_t n) {
+	ngx_metrics_sh_t * sh = ngx_metrics_sh;
+
+	if (ngx_metrics_shard == NULL || id >= sh->nlabels) {
+		return;
+	}
+
+	(void)ngx_atomic_fetch_add(
+		&ngx_metrics_shard_labels(sh , ngx_metrics_shard , sh->epoch & 1)[id * NGX_METRICS_NCOUNTERS + counter] , n);
+}
+
+
+#endif /* _NGX_METRICS_H_INCLUDED_ */
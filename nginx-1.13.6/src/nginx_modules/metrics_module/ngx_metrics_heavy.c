@@ -0,0 +1,197 @@
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_metrics.h>
+
+#define ngx_metrics_heavy_cell(hash , step , row)	\
+	((row) * NGX_METRICS_HEAVY_WIDTH + (((hash) + (row) * (step)) & (NGX_METRICS_HEAVY_WIDTH - 1)))
+
+static uint32_t ngx_metrics_heavy_step(uint32_t hash);
+static void ngx_metrics_heavy_sift_up(ngx_metrics_heavy_entry_t * heap , ngx_uint_t i);
+static void ngx_metrics_heavy_sift_down(ngx_metrics_heavy_entry_t * heap , ngx_uint_t n , ngx_uint_t i);
+static int ngx_libc_cdecl ngx_metrics_heavy_cmp(const void * one , const void * two);
+
+/* the aggregator's sum of the sketches of all shards */
+
+static ngx_atomic_uint_t ngx_metrics_heavy_cells[NGX_METRICS_HEAVY_CELLS];
+
+/*
+ * The rows of the sketch are indexed by double hashing, the second hash
+ * being odd so that the rows differ.
+ */
+
+static uint32_t ngx_metrics_heavy_step(uint32_t hash) {
+	return ((hash >> 17) | (hash << 15)) | 1;
+}
+
+/*
+ * Counts the key in the sketch of the slot, in the shard of the worker,
+ * and keeps it in the heap of the shard if its estimate is among the
+ * highest.  Only the owner of the shard writes the heap, and it grows the
+ * heap with a compare and swap of its size, which the aggregator swaps
+ * with zero when it takes the heap, so neither loses the other's update.
+ */
+
+void ngx_metrics_heavy_count(ngx_uint_t slot , u_char * key , size_t len) {
+	ngx_metrics_sh_t * sh = ngx_metrics_sh;
+	ngx_metrics_heavy_entry_t * heap , * e;
+	ngx_atomic_uint_t estimate , c;
+	ngx_atomic_t * words;
+	ngx_uint_t i , used;
+	uint32_t hash , step;
+
+	if (ngx_metrics_shard == NULL || slot >= sh->nheavy) {
+		return;
+	}
+
+	len = ngx_min(len , NGX_METRICS_HEAVY_KEY_LEN);
+	hash = ngx_murmur_hash2(key , len);
+	step = ngx_metrics_heavy_step(hash);
+
+	words = ngx_metrics_shard_heavy(sh , ngx_metrics_shard , sh->epoch & 1 , slot);
+	estimate = (ngx_atomic_uint_t) -1;
+
+	for (i = 0; i < NGX_METRICS_HEAVY_DEPTH; i++) {
+		c = ngx_atomic_fetch_add(&words[ngx_metrics_heavy_cell(hash , step , i)] , 1) + 1;
+		estimate = ngx_min(estimate , c);
+	}
+
+	heap = (ngx_metrics_heavy_entry_t *)&words[NGX_METRICS_HEAVY_HEAP];
+	used = ngx_min(words[NGX_METRICS_HEAVY_USED] , NGX_METRICS_HEAVY_K);
+
+	for (i = 0; i < used; i++) {
+		if (heap[i].hash == hash && heap[i].len == len && ngx_memcmp(heap[i].key , key , len) == 0) {
+			heap[i].count = estimate;
+			ngx_metrics_heavy_sift_down(heap , used , i);
+
+			return;
+		}
+	}
+
+	if (used == NGX_METRICS_HEAVY_K && estimate <= heap[0].count) {
+		return;
+	}
+
+	e = used < NGX_METRICS_HEAVY_K ? &heap[used] : &heap[0];
+	e->count = estimate;
+	e->hash = hash;
+	e->len = (uint16_t)len;
+	ngx_memcpy(e->key , key , len);
+
+	if (used == NGX_METRICS_HEAVY_K) {
+		ngx_metrics_heavy_sift_down(heap , used , 0);
+
+	} else if (ngx_atomic_cmp_set(&words[NGX_METRICS_HEAVY_USED] , used , used + 1)) {
+		ngx_metrics_heavy_sift_up(heap , used);
+	}
+}
+
+static void ngx_metrics_heavy_sift_up(ngx_metrics_heavy_entry_t * heap , ngx_uint_t i) {
+	ngx_metrics_heavy_entry_t e = heap[i];
+	ngx_uint_t parent;
+
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (heap[parent].count <= e.count) {
+			break;
+		}
+
+		heap[i] = heap[parent];
+		i = parent;
+	}
+
+	heap[i] = e;
+}
+
+static void ngx_metrics_heavy_sift_down(ngx_metrics_heavy_entry_t * heap , ngx_uint_t n , ngx_uint_t i) {
+	ngx_metrics_heavy_entry_t e = heap[i];
+	ngx_uint_t child;
+
+	for ( ;; ) {
+		child = 2 * i + 1;
+		if (child >= n) {
+			break;
+		}
+
+		if (child + 1 < n && heap[child + 1].count < heap[child].count) {
+			child++;
+		}
+
+		if (e.count <= heap[child].count) {
+			break;
+		}
+
+		heap[i] = heap[child];
+		i = child;
+	}
+
+	heap[i] = e;
+}
+
+/*
+ * Sums the sketches of the slot in all shards, estimates the keys of all
+ * their heaps from the sum and returns the heaviest, at most
+ * NGX_METRICS_HEAVY_K, hottest first.  out has room for the heaps of all
+ * shards.  The size of every heap is swapped with zero before the heap
+ * is read, as the counters are, so a worker still writing the bank after
+ * the flip starts the heap anew for the next drain of the bank.  A heap
+ * entry torn by such a worker no longer matches its hash and is left out.
+ */
+
+ngx_uint_t ngx_metrics_heavy_take(ngx_metrics_sh_t * sh , ngx_uint_t bank , ngx_uint_t slot , ngx_metrics_heavy_entry_t * out) {
+	ngx_metrics_heavy_entry_t * heap , e;
+	ngx_atomic_t * words;
+	ngx_uint_t c , i , j , k , n = 0 , used;
+	uint32_t step;
+
+	for (c = 0; c < NGX_METRICS_HEAVY_CELLS; c++) {
+		ngx_metrics_heavy_cells[c] = ngx_metrics_drain_heavy(sh , bank , slot , c);
+	}
+
+	for (i = 0; i < sh->nshards; i++) {
+		words = ngx_metrics_shard_heavy(sh , ngx_metrics_get_shard(sh , i) , bank , slot);
+		heap = (ngx_metrics_heavy_entry_t *)&words[NGX_METRICS_HEAVY_HEAP];
+		used = ngx_metrics_swap_zero(&words[NGX_METRICS_HEAVY_USED]);
+		used = ngx_min(used , NGX_METRICS_HEAVY_K);
+
+		for (j = 0; j < used; j++) {
+			e = heap[j];
+
+			if (e.len > NGX_METRICS_HEAVY_KEY_LEN || ngx_murmur_hash2(e.key , e.len) != e.hash) {
+				continue;
+			}
+
+			for (k = 0; k < n; k++) {
+				if (out[k].hash == e.hash && out[k].len == e.len && ngx_memcmp(out[k].key , e.key , e.len) == 0) {
+					break;
+				}
+			}
+
+			if (k < n) {
+				continue;
+			}
+
+			step = ngx_metrics_heavy_step(e.hash);
+			e.count = (ngx_atomic_uint_t) -1;
+
+			for (k = 0; k < NGX_METRICS_HEAVY_DEPTH; k++) {
+				e.count = ngx_min(e.count , ngx_metrics_heavy_cells[ngx_metrics_heavy_cell(e.hash , step , k)]);
+			}
+
+			out[n++] = e;
+		}
+	}
+
+	ngx_qsort(out , n , sizeof(ngx_metrics_heavy_entry_t) , ngx_metrics_heavy_cmp);
+
+	return ngx_min(n , NGX_METRICS_HEAVY_K);
+}
+
+static int ngx_libc_cdecl ngx_metrics_heavy_cmp(const void * one , const void * two) {
+	const ngx_metrics_heavy_entry_t * a = one , * b = two;
+
+	if (a->count == b->count) {
+		return 0;
+	}
+
+	return a->count < b->count ? 1 : -1;
+}
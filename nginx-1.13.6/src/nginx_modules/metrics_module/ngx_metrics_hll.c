@@ -0,0 +1,69 @@
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_metrics.h>
+
+static double ngx_metrics_hll_ln(double x);
+
+/*
+ * The HyperLogLog estimate of the distinct values added to the registers,
+ * with linear counting while it is small and registers are still empty.
+ * The standard error is 1.04 / sqrt(NGX_METRICS_HLL_REGISTERS).
+ */
+
+ngx_atomic_uint_t ngx_metrics_hll_estimate(u_char * registers) {
+	double m = NGX_METRICS_HLL_REGISTERS , sum = 0 , e;
+	ngx_uint_t i , zeros = 0;
+
+	for (i = 0; i < NGX_METRICS_HLL_REGISTERS; i++) {
+		sum += 1.0 / (double)((uint64_t)1 << registers[i]);
+
+		if (registers[i] == 0) {
+			zeros++;
+		}
+	}
+
+	if (zeros == NGX_METRICS_HLL_REGISTERS) {
+		return 0;
+	}
+
+	e = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+
+	if (e <= 2.5 * m && zeros != 0) {
+		e = m * ngx_metrics_hll_ln(m / zeros);
+	}
+
+	return (ngx_atomic_uint_t)(e + 0.5);
+}
+
+/*
+ * The natural logarithm of x > 0, without the math library: x = y * 2^k
+ * with y in [1, 2), and ln y from the series of 2 atanh((y - 1) / (y + 1)).
+ */
+
+static double ngx_metrics_hll_ln(double x) {
+	double t , t2 , term , sum;
+	ngx_int_t k = 0;
+	ngx_uint_t n;
+
+	while (x >= 2) {
+		x /= 2;
+		k++;
+	}
+
+	while (x < 1) {
+		x *= 2;
+		k--;
+	}
+
+	t = (x - 1) / (x + 1);
+	t2 = t * t;
+	term = t;
+	sum = 0;
+
+	for (n = 1; n < 40; n += 2) {
+		sum += term / n;
+		term *= t2;
+	}
+
+	return k * 0.69314718055994531 + 2 * sum;
+}
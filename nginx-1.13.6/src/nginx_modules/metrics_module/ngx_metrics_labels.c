@@ -0,0 +1,163 @@
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_metrics.h>
+
+/*
+ * Every worker keeps the ids of the label sets it has seen in a direct
+ * mapped cache in front of the shared table, so the zone mutex is only
+ * taken the first time a worker meets a tuple.  Ids are never reused, so
+ * a cached id stays right for the life of the zone.
+ */
+typedef struct tag_ngx_metrics_labels_cached {
+	uint32_t hash;
+	uint32_t id;
+	uint16_t len;
+	u_char key[NGX_METRICS_LABELS_KEY_LEN];
+} ngx_metrics_labels_cached_t;
+
+static ngx_metrics_labels_cached_t * ngx_metrics_labels_cache = NULL;
+static ngx_slab_pool_t * ngx_metrics_labels_shpool = NULL;
+static ngx_metrics_sh_t * ngx_metrics_labels_sh = NULL;
+
+static ngx_uint_t ngx_metrics_labels_find(ngx_slab_pool_t * shpool , ngx_metrics_sh_t * sh , uint32_t hash ,
+	u_char * key , size_t len);
+
+/*
+ * Allocates the shared label table: the label sets, the overflow one
+ * first, and an open addressing index of their ids, 0 being free.
+ */
+
+ngx_int_t ngx_metrics_labels_init_zone(ngx_slab_pool_t * shpool , ngx_metrics_sh_t * sh , ngx_uint_t nlabels) {
+	ngx_uint_t n;
+
+	sh->nlabels = nlabels;
+	sh->labels_used = 0;
+	sh->labelsets = NULL;
+	sh->labels_index = NULL;
+	sh->labels_mask = 0;
+
+	if (nlabels == 0) {
+		return NGX_OK;
+	}
+
+	for (n = 1; n < 2 * nlabels; n <<= 1) { /* void */ }
+
+	sh->labelsets = ngx_slab_alloc(shpool , nlabels * sizeof(ngx_metrics_labelset_t));
+	sh->labels_index = ngx_slab_calloc(shpool , n * sizeof(uint32_t));
+
+	if (sh->labelsets == NULL || sh->labels_index == NULL) {
+		return NGX_ERROR;
+	}
+
+	sh->labels_mask = n - 1;
+
+	sh->labelsets[NGX_METRICS_LABELS_OVERFLOW].hash = 0;
+	sh->labelsets[NGX_METRICS_LABELS_OVERFLOW].len = 0;
+	sh->labels_used = NGX_METRICS_LABELS_OVERFLOW + 1;
+
+	return NGX_OK;
+}
+
+ngx_int_t ngx_metrics_labels_init(ngx_cycle_t * cycle , ngx_slab_pool_t * shpool , ngx_metrics_sh_t * sh) {
+	ngx_metrics_labels_cache = ngx_calloc(NGX_METRICS_LABELS_CACHE * sizeof(ngx_metrics_labels_cached_t) , cycle->log);
+	if (ngx_metrics_labels_cache == NULL) {
+		return NGX_ERROR;
+	}
+
+	ngx_metrics_labels_shpool = shpool;
+	ngx_metrics_labels_sh = sh;
+
+	return NGX_OK;
+}
+
+/*
+ * Returns the id of the label set with the given key, adding it to the
+ * shared table if there is room and returning the overflow id otherwise.
+ */
+
+ngx_uint_t ngx_metrics_labels_intern(u_char * key , size_t len) {
+	ngx_metrics_sh_t * sh = ngx_metrics_labels_sh;
+	ngx_metrics_labels_cached_t * c;
+	ngx_uint_t id;
+	uint32_t hash;
+
+	if (sh == NULL || len == 0 || len > NGX_METRICS_LABELS_KEY_LEN) {
+		return NGX_METRICS_LABELS_OVERFLOW;
+	}
+
+	hash = ngx_murmur_hash2(key , len);
+	c = &ngx_metrics_labels_cache[hash & (NGX_METRICS_LABELS_CACHE - 1)];
+
+	if (c->hash == hash && c->len == len && ngx_memcmp(c->key , key , len) == 0) {
+		return c->id;
+	}
+
+	id = ngx_metrics_labels_find(ngx_metrics_labels_shpool , sh , hash , key , len);
+
+	c->hash = hash;
+	c->len = (uint16_t)len;
+	c->id = (uint32_t)id;
+	ngx_memcpy(c->key , key , len);
+
+	return id;
+}
+
+/*
+ * The same without the cache of a worker, for the aggregator and the
+ * master restoring a snapshot.
+ */
+
+ngx_uint_t ngx_metrics_labels_add(ngx_slab_pool_t * shpool , ngx_metrics_sh_t * sh , u_char * key , size_t len) {
+	if (sh->nlabels == 0 || len == 0 || len > NGX_METRICS_LABELS_KEY_LEN) {
+		return NGX_METRICS_LABELS_OVERFLOW;
+	}
+
+	return ngx_metrics_labels_find(shpool , sh , ngx_murmur_hash2(key , len) , key , len);
+}
+
+/*
+ * Looks the key up in the shared table under the zone mutex, adding it
+ * if there is room.
+ */
+
+static ngx_uint_t ngx_metrics_labels_find(ngx_slab_pool_t * shpool , ngx_metrics_sh_t * sh , uint32_t hash ,
+	u_char * key , size_t len) {
+	ngx_metrics_labelset_t * ls;
+	ngx_uint_t i , id;
+
+	ngx_shmtx_lock(&shpool->mutex);
+
+	for (i = hash & sh->labels_mask; sh->labels_index[i] != 0; i = (i + 1) & sh->labels_mask) {
+		ls = &sh->labelsets[sh->labels_index[i]];
+
+		if (ls->hash == hash && ls->len == len && ngx_memcmp(ls->key , key , len) == 0) {
+			break;
+		}
+	}
+
+	if (sh->labels_index[i] != 0) {
+		id = sh->labels_index[i];
+
+	} else if (sh->labels_used < sh->nlabels) {
+		id = sh->labels_used;
+
+		ls = &sh->labelsets[id];
+		ls->hash = hash;
+		ls->len = (uint16_t)len;
+		ngx_memcpy(ls->key , key , len);
+
+		/* readers of the table go up to labels_used without the mutex */
+
+		ngx_memory_barrier();
+
+		sh->labels_index[i] = (uint32_t)id;
+		sh->labels_used = id + 1;
+
+	} else {
+		id = NGX_METRICS_LABELS_OVERFLOW;
+	}
+
+	ngx_shmtx_unlock(&shpool->mutex);
+
+	return id;
+}
@@ -0,0 +1,80 @@
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_metrics.h>
+
+static double ngx_metrics_rate_exp(double x);
+
+/* the windows of the moving averages, in milliseconds */
+
+static ngx_msec_t ngx_metrics_rate_windows[NGX_METRICS_RATE_WINDOWS] = { 60000 , 300000 , 900000 };
+
+/* the weights of the past for the interval being drained */
+
+static double ngx_metrics_rate_weights[NGX_METRICS_RATE_WINDOWS];
+static ngx_msec_t ngx_metrics_rate_elapsed;
+
+/*
+ * e^-x for x >= 0, without libm: the series for a small enough part of
+ * x, squared back up.
+ */
+
+static double ngx_metrics_rate_exp(double x) {
+	double term , sum;
+	ngx_uint_t i , halvings = 0;
+
+	while (x > 0.5) {
+		x /= 2;
+		halvings++;
+	}
+
+	term = 1;
+	sum = 1;
+
+	for (i = 1; i < 12; i++) {
+		term *= -x / i;
+		sum += term;
+	}
+
+	while (halvings--) {
+		sum *= sum;
+	}
+
+	return sum;
+}
+
+/*
+ * Weighs the averages for an interval of elapsed ms: the past of a window
+ * of w ms counts e^(-elapsed / w), so the averages do not depend on the
+ * export interval.
+ */
+
+void ngx_metrics_rate_decay(ngx_msec_t elapsed) {
+	ngx_uint_t w;
+
+	ngx_metrics_rate_elapsed = ngx_max(elapsed , 1);
+
+	for (w = 0; w < NGX_METRICS_RATE_WINDOWS; w++) {
+		ngx_metrics_rate_weights[w] = ngx_metrics_rate_exp((double)ngx_metrics_rate_elapsed / ngx_metrics_rate_windows[w]);
+	}
+}
+
+/*
+ * Moves the averages of one kind, the requests or the request time in
+ * ms, of the slot towards what was drained for the interval.  Only the
+ * aggregator writes them.
+ */
+
+void ngx_metrics_rate_update(ngx_metrics_sh_t * sh , ngx_uint_t slot , ngx_uint_t kind , ngx_atomic_uint_t value) {
+	ngx_atomic_t * rate = ngx_metrics_rate_total(sh , slot) + kind;
+	double now , weight;
+	ngx_uint_t w;
+
+	/* thousandths per second are millionths per millisecond */
+
+	now = (double)value * 1000000 / ngx_metrics_rate_elapsed;
+
+	for (w = 0; w < NGX_METRICS_RATE_WINDOWS; w++) {
+		weight = ngx_metrics_rate_weights[w];
+		rate[w] = (ngx_atomic_uint_t)(rate[w] * weight + now * (1 - weight) + 0.5);
+	}
+}
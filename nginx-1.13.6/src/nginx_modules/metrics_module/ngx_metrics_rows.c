@@ -0,0 +1,138 @@
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_metrics.h>
+
+static ngx_uint_t ngx_metrics_rows_find(ngx_metrics_sh_t * sh , ngx_uint_t area , uint32_t hash , u_char * name ,
+	size_t len);
+
+#define ngx_metrics_rows_size(sh , area)	\
+	((area) == NGX_METRICS_ROWS_PEERS ? (sh)->npeers : (sh)->nstream)
+
+/*
+ * Allocates the row table of an area: the names of the rows handed out,
+ * in order, and an open addressing index of them, holding the row plus
+ * one, 0 being free.
+ */
+
+ngx_int_t ngx_metrics_rows_init_zone(ngx_slab_pool_t * shpool , ngx_metrics_sh_t * sh , ngx_uint_t area , ngx_uint_t n) {
+	ngx_uint_t size;
+
+	sh->rows[area] = NULL;
+	sh->rows_used[area] = 0;
+	sh->rows_index[area] = NULL;
+	sh->rows_mask[area] = 0;
+
+	if (n == 0) {
+		return NGX_OK;
+	}
+
+	for (size = 1; size < 2 * n; size <<= 1) { /* void */ }
+
+	sh->rows[area] = ngx_slab_alloc(shpool , n * sizeof(ngx_metrics_row_t));
+	sh->rows_index[area] = ngx_slab_calloc(shpool , size * sizeof(uint32_t));
+
+	if (sh->rows[area] == NULL || sh->rows_index[area] == NULL) {
+		return NGX_ERROR;
+	}
+
+	sh->rows_mask[area] = size - 1;
+
+	return NGX_OK;
+}
+
+/*
+ * Returns the row of the area named name, handing out the next one under
+ * the zone mutex the first time the name is met, or NGX_ERROR once the
+ * area is full.
+ */
+
+ngx_int_t ngx_metrics_row(ngx_slab_pool_t * shpool , ngx_metrics_sh_t * sh , ngx_uint_t area , u_char * name ,
+	size_t len) {
+	ngx_metrics_row_t * row;
+	uint32_t hash;
+	ngx_uint_t i;
+	ngx_int_t n;
+
+	if (sh->rows[area] == NULL || len == 0 || len > NGX_METRICS_ROW_NAME_LEN) {
+		return NGX_ERROR;
+	}
+
+	hash = ngx_murmur_hash2(name , len);
+
+	ngx_shmtx_lock(&shpool->mutex);
+
+	i = ngx_metrics_rows_find(sh , area , hash , name , len);
+
+	if (sh->rows_index[area][i] != 0) {
+		n = sh->rows_index[area][i] - 1;
+
+	} else if (sh->rows_used[area] < ngx_metrics_rows_size(sh , area)) {
+		n = sh->rows_used[area];
+
+		row = &sh->rows[area][n];
+		row->hash = hash;
+		row->len = (uint16_t)len;
+		ngx_memcpy(row->name , name , len);
+
+		/* readers of the table go up to rows_used without the mutex */
+
+		ngx_memory_barrier();
+
+		sh->rows_index[area][i] = (uint32_t)n + 1;
+		sh->rows_used[area] = n + 1;
+
+	} else {
+		n = NGX_ERROR;
+	}
+
+	ngx_shmtx_unlock(&shpool->mutex);
+
+	return n;
+}
+
+/*
+ * Checks, for the master reusing the zone, that the names of a new
+ * configuration either have their rows or fit into those left.
+ */
+
+ngx_int_t ngx_metrics_rows_check(ngx_metrics_sh_t * sh , ngx_uint_t area , ngx_array_t * names) {
+	ngx_str_t * name;
+	ngx_uint_t i , n = 0;
+
+	if (names == NULL) {
+		return NGX_OK;
+	}
+
+	name = names->elts;
+
+	for (i = 0; i < names->nelts; i++) {
+		if (name[i].len == 0 || name[i].len > NGX_METRICS_ROW_NAME_LEN) {
+			continue;
+		}
+
+		if (sh->rows[area] == NULL
+			|| sh->rows_index[area][ngx_metrics_rows_find(sh , area , ngx_murmur_hash2(name[i].data , name[i].len) ,
+				name[i].data , name[i].len)] == 0) {
+			n++;
+		}
+	}
+
+	return sh->rows_used[area] + n <= ngx_metrics_rows_size(sh , area) ? NGX_OK : NGX_ERROR;
+}
+
+static ngx_uint_t ngx_metrics_rows_find(ngx_metrics_sh_t * sh , ngx_uint_t area , uint32_t hash , u_char * name ,
+	size_t len) {
+	uint32_t * index = sh->rows_index[area];
+	ngx_metrics_row_t * row;
+	ngx_uint_t i;
+
+	for (i = hash & sh->rows_mask[area]; index[i] != 0; i = (i + 1) & sh->rows_mask[area]) {
+		row = &sh->rows[area][index[i] - 1];
+
+		if (row->hash == hash && row->len == len && ngx_memcmp(row->name , name , len) == 0) {
+			break;
+		}
+	}
+
+	return i;
+}
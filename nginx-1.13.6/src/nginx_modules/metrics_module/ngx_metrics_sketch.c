@@ -0,0 +1,74 @@
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_metrics.h>
+
+/*
+ * Computes the bucket bounds for the relative accuracy, in ten thousandths.
+ * A bucket from a up to b ms, with b <= a * gamma, estimates its times as
+ * 2ab / (a + b), which is off by at most (gamma - 1) / (gamma + 1), the
+ * accuracy.  The last bucket also takes the times past its bound.
+ */
+
+void ngx_metrics_sketch_init_zone(ngx_metrics_sh_t * sh , ngx_uint_t nsketch , ngx_uint_t accuracy) {
+	double gamma , next;
+	uint32_t bound;
+	ngx_uint_t i;
+
+	sh->nsketch = nsketch;
+	sh->accuracy = accuracy;
+
+	gamma = (10000.0 + accuracy) / (10000.0 - accuracy);
+
+	sh->sketch_bounds[0] = 0;
+	sh->sketch_linear = 0;
+
+	for (i = 1; i < NGX_METRICS_SKETCH_BUCKETS; i++) {
+		next = ((double)sh->sketch_bounds[i - 1] + 1) * gamma;
+		bound = next >= (double)NGX_MAX_UINT32_VALUE ? NGX_MAX_UINT32_VALUE : (uint32_t)next;
+
+		if (bound <= sh->sketch_bounds[i - 1]) {
+			bound = sh->sketch_bounds[i - 1] == NGX_MAX_UINT32_VALUE
+				? NGX_MAX_UINT32_VALUE : sh->sketch_bounds[i - 1] + 1;
+		}
+
+		sh->sketch_bounds[i] = bound;
+
+		if (bound == i) {
+			sh->sketch_linear = i;
+		}
+	}
+}
+
+/*
+ * Estimates the quantile, in millionths, of the times counted in the
+ * buckets and returns it in microseconds.
+ */
+
+uint64_t ngx_metrics_sketch_quantile(ngx_metrics_sh_t * sh , ngx_atomic_uint_t * buckets , ngx_atomic_uint_t count ,
+	ngx_uint_t quantile) {
+	ngx_atomic_uint_t rank , seen = 0;
+	double a , b;
+	ngx_uint_t i;
+
+	if (count == 0) {
+		return 0;
+	}
+
+	rank = (ngx_atomic_uint_t)((uint64_t)(count - 1) * quantile / 1000000);
+
+	for (i = 0; i < NGX_METRICS_SKETCH_BUCKETS - 1; i++) {
+		seen += buckets[i];
+		if (seen > rank) {
+			break;
+		}
+	}
+
+	if (i == 0) {
+		return 0;
+	}
+
+	a = (double)sh->sketch_bounds[i - 1] + 1;
+	b = (double)sh->sketch_bounds[i];
+
+	return (uint64_t)(2 * a * b / (a + b) * 1000 + 0.5);
+}
@@ -0,0 +1,647 @@
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_metrics.h>
+
+#define NGX_METRICS_SNAPSHOT_VERSION	2
+
+/* the areas of the totals, in their order; the last two are not cumulative */
+
+#define NGX_METRICS_SNAPSHOT_PEERS	2
+#define NGX_METRICS_SNAPSHOT_STREAM	3
+#define NGX_METRICS_SNAPSHOT_LABELS	4
+#define NGX_METRICS_SNAPSHOT_SKETCH	5
+#define NGX_METRICS_SNAPSHOT_GAUGES	6
+#define NGX_METRICS_SNAPSHOT_AREAS	8
+
+/*
+ * A snapshot is "NGXT" | version:32 | zone id:64 | seq:64 | pid:64 |
+ * word size:64 | accuracy:64 | 8 x area count:64 | label sets:64 |
+ * 2 x named rows:64 | words:64, in host byte order, followed by the label
+ * sets in use, the names of the peer and stream rows in use and the
+ * totals.  seq counts the snapshots of a zone and pid is the process
+ * that wrote it.  Only a snapshot of this version and word size is read.
+ */
+typedef struct tag_ngx_metrics_snapshot_header {
+	u_char magic[4];
+	uint32_t version;
+	uint64_t zone_id;
+	uint64_t seq;
+	uint64_t pid;
+	uint64_t word_size;
+	uint64_t accuracy;
+	uint64_t areas[NGX_METRICS_SNAPSHOT_AREAS];
+	uint64_t labels_used;
+	uint64_t rows_used[NGX_METRICS_ROW_AREAS];
+	uint64_t nwords;
+} ngx_metrics_snapshot_header_t;
+
+#define ngx_metrics_snapshot_rows(h)	\
+	((ngx_metrics_row_t *) ((u_char *) ((h) + 1) + (h)->labels_used * sizeof(ngx_metrics_labelset_t)))
+
+#define ngx_metrics_snapshot_values(h)	\
+	((ngx_atomic_uint_t *) (ngx_metrics_snapshot_rows(h) + (h)->rows_used[0] + (h)->rows_used[1]))
+
+static void ngx_metrics_snapshot_areas(ngx_metrics_sh_t * sh , uint64_t * areas);
+static uint64_t ngx_metrics_snapshot_words(uint64_t * areas);
+static ngx_metrics_snapshot_header_t * ngx_metrics_snapshot_read(ngx_str_t * path , ngx_log_t * log);
+static void ngx_metrics_snapshot_apply(ngx_slab_pool_t * shpool , ngx_metrics_sh_t * sh ,
+	ngx_metrics_snapshot_header_t * h , ngx_atomic_uint_t * base);
+static ngx_int_t ngx_metrics_snapshot_write(ngx_metrics_conf_t * mcf , ngx_log_t * log);
+#if (NGX_METRICS_BENCH)
+static ngx_int_t ngx_metrics_snapshot_check_put(ngx_str_t * path , ngx_metrics_snapshot_header_t * h , size_t size ,
+	ngx_log_t * log);
+#endif
+
+/* the words of an element of each area */
+
+static uint64_t ngx_metrics_snapshot_units[NGX_METRICS_SNAPSHOT_AREAS] = {
+	NGX_METRICS_NCOUNTERS,
+	NGX_METRICS_NHIST * NGX_METRICS_HIST_WORDS,
+	NGX_METRICS_PEER_WORDS,
+	NGX_METRICS_STREAM_WORDS,
+	NGX_METRICS_NCOUNTERS,
+	NGX_METRICS_SKETCH_WORDS,
+	1,
+	NGX_METRICS_RATE_WORDS
+};
+
+/* the snapshot the master read for the zone it is creating */
+
+static ngx_metrics_snapshot_header_t * ngx_metrics_snapshot_pending = NULL;
+
+/* the file the aggregator writes before renaming it to the snapshot */
+
+static u_char * ngx_metrics_snapshot_temp = NULL;
+
+static void ngx_metrics_snapshot_areas(ngx_metrics_sh_t * sh , uint64_t * areas) {
+	areas[0] = sh->nslots;
+	areas[1] = sh->nhist;
+	areas[2] = sh->npeers;
+	areas[3] = sh->nstream;
+	areas[4] = sh->nlabels;
+	areas[5] = sh->nsketch;
+	areas[6] = sh->nunique;
+	areas[7] = sh->nrates;
+}
+
+static uint64_t ngx_metrics_snapshot_words(uint64_t * areas) {
+	uint64_t n = 0;
+	ngx_uint_t i;
+
+	for (i = 0; i < NGX_METRICS_SNAPSHOT_AREAS; i++) {
+		n += areas[i] * ngx_metrics_snapshot_units[i];
+	}
+
+	return n;
+}
+
+/*
+ * Reads a snapshot into memory and checks that it is whole.  A missing
+ * snapshot is not an error.
+ */
+
+static ngx_metrics_snapshot_header_t * ngx_metrics_snapshot_read(ngx_str_t * path , ngx_log_t * log) {
+	ngx_metrics_snapshot_header_t * h;
+	ngx_file_info_t fi;
+	ngx_fd_t fd;
+	ssize_t n;
+	size_t size;
+
+	fd = ngx_open_file(path->data , NGX_FILE_RDONLY , NGX_FILE_OPEN , 0);
+	if (fd == NGX_INVALID_FILE) {
+		if (ngx_errno != NGX_ENOENT) {
+			ngx_log_error(NGX_LOG_ERR , log , ngx_errno , ngx_open_file_n " \"%V\" failed" , path);
+		}
+
+		return NULL;
+	}
+
+	h = NULL;
+
+	if (ngx_fd_info(fd , &fi) == NGX_FILE_ERROR) {
+		ngx_log_error(NGX_LOG_ERR , log , ngx_errno , ngx_fd_info_n " \"%V\" failed" , path);
+		goto done;
+	}
+
+	size = (size_t)ngx_file_size(&fi);
+	if (size < sizeof(ngx_metrics_snapshot_header_t)) {
+		goto invalid;
+	}
+
+	h = ngx_alloc(size , log);
+	if (h == NULL) {
+		goto done;
+	}
+
+	n = ngx_read_fd(fd , h , size);
+	if (n == -1) {
+		ngx_log_error(NGX_LOG_ERR , log , ngx_errno , ngx_read_fd_n " \"%V\" failed" , path);
+		goto failed;
+	}
+
+	if ((size_t)n != size || ngx_memcmp(h->magic , "NGXT" , 4) != 0 || h->version != NGX_METRICS_SNAPSHOT_VERSION
+		|| h->word_size != sizeof(ngx_atomic_uint_t) || h->labels_used > h->areas[NGX_METRICS_SNAPSHOT_LABELS]
+		|| h->rows_used[NGX_METRICS_ROWS_PEERS] > h->areas[NGX_METRICS_SNAPSHOT_PEERS]
+		|| h->rows_used[NGX_METRICS_ROWS_STREAM] > h->areas[NGX_METRICS_SNAPSHOT_STREAM]
+		|| h->nwords != ngx_metrics_snapshot_words(h->areas)
+		|| size != sizeof(ngx_metrics_snapshot_header_t) + h->labels_used * sizeof(ngx_metrics_labelset_t)
+			+ (h->rows_used[0] + h->rows_used[1]) * sizeof(ngx_metrics_row_t) + h->nwords * sizeof(ngx_atomic_uint_t)) {
+		goto invalid;
+	}
+
+	goto done;
+
+invalid:
+
+	ngx_log_error(NGX_LOG_WARN , log , 0 , "metrics snapshot \"%V\" is invalid, ignored" , path);
+
+failed:
+
+	if (h != NULL) {
+		ngx_free(h);
+		h = NULL;
+	}
+
+done:
+
+	if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+		ngx_log_error(NGX_LOG_ALERT , log , ngx_errno , ngx_close_file_n " \"%V\" failed" , path);
+	}
+
+	return h;
+}
+
+/*
+ * Reads the snapshot for a zone being created and sets aside room for
+ * the values it will be restored from.
+ */
+
+void ngx_metrics_snapshot_open(ngx_metrics_conf_t * mcf , ngx_metrics_sh_t * sh , ngx_log_t * log) {
+	ngx_metrics_snapshot_header_t * h;
+
+	if (mcf->snapshot.len == 0) {
+		return;
+	}
+
+	h = ngx_metrics_snapshot_read(&mcf->snapshot , log);
+	if (h == NULL) {
+		return;
+	}
+
+	sh->snapshot_base = ngx_slab_alloc(mcf->shpool , h->nwords * sizeof(ngx_atomic_uint_t));
+	if (sh->snapshot_base == NULL) {
+		ngx_log_error(NGX_LOG_WARN , log , 0 , "metrics zone is too small to restore \"%V\"" , &mcf->snapshot);
+		ngx_free(h);
+
+		return;
+	}
+
+	sh->snapshot_nbase = h->nwords;
+	ngx_metrics_snapshot_pending = h;
+}
+
+/*
+ * Starts the totals of the new zone from the snapshot read by
+ * ngx_metrics_snapshot_open() and keeps its values, to add only what the
+ * zone that wrote it counts later.
+ */
+
+void ngx_metrics_snapshot_restore(ngx_metrics_conf_t * mcf , ngx_metrics_sh_t * sh , ngx_log_t * log) {
+	ngx_metrics_snapshot_header_t * h = ngx_metrics_snapshot_pending;
+
+	if (h == NULL) {
+		return;
+	}
+
+	ngx_metrics_snapshot_pending = NULL;
+
+	ngx_metrics_snapshot_apply(mcf->shpool , sh , h , NULL);
+
+	ngx_memcpy(sh->snapshot_base , ngx_metrics_snapshot_values(h) , h->nwords * sizeof(ngx_atomic_uint_t));
+
+	sh->snapshot_origin = h->zone_id;
+	sh->snapshot_seq = h->seq;
+
+	ngx_log_error(NGX_LOG_NOTICE , log , 0 , "metrics zone restored from \"%V\", snapshot %uL" , &mcf->snapshot , h->seq);
+
+	ngx_free(h);
+}
+
+/*
+ * Adds the totals of a snapshot, less the base from an earlier snapshot
+ * of the same zone, to those of the zone, area by area, as far as the
+ * layouts share them.  Label sets are matched by their keys, and peer
+ * and stream rows by their names.  Without a base the snapshot is being
+ * restored and the averages are taken too.
+ */
+
+static void ngx_metrics_snapshot_apply(ngx_slab_pool_t * shpool , ngx_metrics_sh_t * sh ,
+	ngx_metrics_snapshot_header_t * h , ngx_atomic_uint_t * base) {
+	ngx_metrics_labelset_t * ls = (ngx_metrics_labelset_t *)(h + 1);
+	ngx_metrics_row_t * rows = ngx_metrics_snapshot_rows(h);
+	ngx_atomic_uint_t * words = ngx_metrics_snapshot_values(h);
+	ngx_atomic_uint_t b;
+	ngx_atomic_t * total = sh->totals;
+	uint64_t areas[NGX_METRICS_SNAPSHOT_AREAS];
+	ngx_uint_t a , i , k , id , n , unit;
+	ngx_int_t row;
+
+	ngx_metrics_snapshot_areas(sh , areas);
+
+	for (a = 0; a < NGX_METRICS_SNAPSHOT_AREAS; a++) {
+		n = (ngx_uint_t)(ngx_min(h->areas[a] , areas[a]) * ngx_metrics_snapshot_units[a]);
+
+		if (a == NGX_METRICS_SNAPSHOT_SKETCH && h->accuracy != sh->accuracy) {
+			n = 0;
+		}
+
+		if (a == NGX_METRICS_SNAPSHOT_LABELS) {
+			for (i = 0; n && i < h->labels_used; i++) {
+				id = i == NGX_METRICS_LABELS_OVERFLOW ? NGX_METRICS_LABELS_OVERFLOW
+					: ngx_metrics_labels_add(shpool , sh , ls[i].key , ls[i].len);
+
+				for (k = 0; k < NGX_METRICS_NCOUNTERS; k++) {
+					b = base ? base[i * NGX_METRICS_NCOUNTERS + k] : 0;
+
+					if (words[i * NGX_METRICS_NCOUNTERS + k] > b) {
+						(void)ngx_atomic_fetch_add(&total[id * NGX_METRICS_NCOUNTERS + k] ,
+							words[i * NGX_METRICS_NCOUNTERS + k] - b);
+					}
+				}
+			}
+
+		} else if (a == NGX_METRICS_SNAPSHOT_PEERS || a == NGX_METRICS_SNAPSHOT_STREAM) {
+			unit = (ngx_uint_t)ngx_metrics_snapshot_units[a];
+
+			for (i = 0; n && i < h->rows_used[a - NGX_METRICS_SNAPSHOT_PEERS]; i++) {
+				row = ngx_metrics_row(shpool , sh , a - NGX_METRICS_SNAPSHOT_PEERS , rows[i].name , rows[i].len);
+				if (row == NGX_ERROR) {
+					continue;
+				}
+
+				for (k = 0; k < unit; k++) {
+					b = base ? base[i * unit + k] : 0;
+
+					if (words[i * unit + k] > b) {
+						(void)ngx_atomic_fetch_add(&total[row * unit + k] , words[i * unit + k] - b);
+					}
+				}
+			}
+
+			rows += h->rows_used[a - NGX_METRICS_SNAPSHOT_PEERS];
+
+		} else if (a >= NGX_METRICS_SNAPSHOT_GAUGES) {
+			for (i = 0; base == NULL && i < n; i++) {
+				total[i] = words[i];
+			}
+
+		} else {
+			for (i = 0; i < n; i++) {
+				b = base ? base[i] : 0;
+
+				if (words[i] > b) {
+					(void)ngx_atomic_fetch_add(&total[i] , words[i] - b);
+				}
+			}
+		}
+
+		total += areas[a] * ngx_metrics_snapshot_units[a];
+		words += h->areas[a] * ngx_metrics_snapshot_units[a];
+
+		if (base != NULL) {
+			base += h->areas[a] * ngx_metrics_snapshot_units[a];
+		}
+	}
+}
+
+/*
+ * Runs in the aggregator: adds what the zone the totals were restored
+ * from has counted since its last snapshot, then writes the snapshot of
+ * this zone, unless another zone that is still running wrote the last
+ * one, which it then would no longer see.
+ */
+
+void ngx_metrics_snapshot_sync(ngx_metrics_conf_t * mcf , ngx_log_t * log) {
+	ngx_metrics_sh_t * sh = mcf->sh;
+	ngx_metrics_snapshot_header_t * h;
+	ngx_atomic_uint_t seq;
+
+	h = ngx_metrics_snapshot_read(&mcf->snapshot , log);
+
+	if (h != NULL) {
+		seq = sh->snapshot_seq;
+
+		if (h->zone_id == sh->snapshot_origin && h->seq > seq && h->nwords == sh->snapshot_nbase
+			&& ngx_atomic_cmp_set(&sh->snapshot_seq , seq , h->seq)) {
+			ngx_metrics_snapshot_apply(mcf->shpool , sh , h , sh->snapshot_base);
+
+			ngx_memcpy(sh->snapshot_base , ngx_metrics_snapshot_values(h) , h->nwords * sizeof(ngx_atomic_uint_t));
+
+			ngx_log_error(NGX_LOG_INFO , log , 0 , "metrics zone caught up with snapshot %uL of \"%V\"" , h->seq ,
+				&mcf->snapshot);
+		}
+
+		if (h->zone_id != sh->zone_id && (kill((ngx_pid_t)h->pid , 0) == 0 || ngx_errno != NGX_ESRCH)) {
+			ngx_free(h);
+
+			return;
+		}
+
+		ngx_free(h);
+	}
+
+	(void)ngx_metrics_snapshot_write(mcf , log);
+}
+
+/*
+ * Writes the snapshot to a file of this process and renames it over the
+ * last one, so that readers never see a partial snapshot.
+ */
+
+static ngx_int_t ngx_metrics_snapshot_write(ngx_metrics_conf_t * mcf , ngx_log_t * log) {
+	ngx_metrics_sh_t * sh = mcf->sh;
+	ngx_metrics_snapshot_header_t h;
+	ngx_int_t rc = NGX_ERROR;
+	size_t len[5];
+	u_char * data[5];
+	ngx_uint_t i;
+	ngx_fd_t fd;
+
+	if (ngx_metrics_snapshot_temp == NULL) {
+		ngx_metrics_snapshot_temp = ngx_alloc(mcf->snapshot.len + 1 + NGX_INT64_LEN + 1 , log);
+		if (ngx_metrics_snapshot_temp == NULL) {
+			return NGX_ERROR;
+		}
+
+		(void)ngx_sprintf(ngx_metrics_snapshot_temp , "%V.%P%Z" , &mcf->snapshot , ngx_pid);
+	}
+
+	ngx_memzero(&h , sizeof(ngx_metrics_snapshot_header_t));
+	ngx_memcpy(h.magic , "NGXT" , 4);
+	h.version = NGX_METRICS_SNAPSHOT_VERSION;
+	h.zone_id = sh->zone_id;
+	h.seq = ngx_atomic_fetch_add(&sh->snapshot_written , 1) + 1;
+	h.pid = ngx_pid;
+	h.word_size = sizeof(ngx_atomic_uint_t);
+	h.accuracy = sh->accuracy;
+	ngx_metrics_snapshot_areas(sh , h.areas);
+	h.labels_used = sh->nlabels ? ngx_min(sh->labels_used , sh->nlabels) : 0;
+	h.rows_used[NGX_METRICS_ROWS_PEERS] = ngx_min(sh->rows_used[NGX_METRICS_ROWS_PEERS] , sh->npeers);
+	h.rows_used[NGX_METRICS_ROWS_STREAM] = ngx_min(sh->rows_used[NGX_METRICS_ROWS_STREAM] , sh->nstream);
+	h.nwords = ngx_metrics_snapshot_words(h.areas);
+
+	data[0] = (u_char *)&h;
+	len[0] = sizeof(ngx_metrics_snapshot_header_t);
+	data[1] = (u_char *)sh->labelsets;
+	len[1] = h.labels_used * sizeof(ngx_metrics_labelset_t);
+	data[2] = (u_char *)sh->rows[NGX_METRICS_ROWS_PEERS];
+	len[2] = h.rows_used[NGX_METRICS_ROWS_PEERS] * sizeof(ngx_metrics_row_t);
+	data[3] = (u_char *)sh->rows[NGX_METRICS_ROWS_STREAM];
+	len[3] = h.rows_used[NGX_METRICS_ROWS_STREAM] * sizeof(ngx_metrics_row_t);
+	data[4] = (u_char *)sh->totals;
+	len[4] = h.nwords * sizeof(ngx_atomic_uint_t);
+
+	fd = ngx_open_file(ngx_metrics_snapshot_temp , NGX_FILE_WRONLY , NGX_FILE_TRUNCATE , NGX_FILE_DEFAULT_ACCESS);
+	if (fd == NGX_INVALID_FILE) {
+		ngx_log_error(NGX_LOG_ERR , log , ngx_errno , ngx_open_file_n " \"%s\" failed" , ngx_metrics_snapshot_temp);
+
+		return NGX_ERROR;
+	}
+
+	for (i = 0; i < 5; i++) {
+		if (len[i] && ngx_write_fd(fd , data[i] , len[i]) != (ssize_t)len[i]) {
+			ngx_log_error(NGX_LOG_ERR , log , ngx_errno , ngx_write_fd_n " \"%s\" failed" , ngx_metrics_snapshot_temp);
+			break;
+		}
+	}
+
+	if (i == 5) {
+		rc = NGX_OK;
+	}
+
+	if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+		ngx_log_error(NGX_LOG_ALERT , log , ngx_errno , ngx_close_file_n " \"%s\" failed" , ngx_metrics_snapshot_temp);
+	}
+
+	if (rc == NGX_OK && ngx_rename_file(ngx_metrics_snapshot_temp , mcf->snapshot.data) == NGX_FILE_ERROR) {
+		ngx_log_error(NGX_LOG_ERR , log , ngx_errno , ngx_rename_file_n " \"%s\" to \"%V\" failed" ,
+			ngx_metrics_snapshot_temp , &mcf->snapshot);
+		rc = NGX_ERROR;
+	}
+
+	if (rc != NGX_OK) {
+		(void)ngx_delete_file(ngx_metrics_snapshot_temp);
+	}
+
+	return rc;
+}
+
+#if (NGX_METRICS_BENCH)
+
+/*
+ * For metrics_bench: writes the totals of the zone, set to a pattern, to
+ * a scratch snapshot and restores them from it.  A snapshot of another
+ * version or word size, or one whose size does not match its layout, must
+ * be refused, and a failed rename must not leave the temp file behind.
+ * The zone is the one of the configuration being tested, which no worker
+ * uses, and its totals are left zero.
+ */
+
+ngx_int_t ngx_metrics_snapshot_check(ngx_metrics_conf_t * mcf , ngx_str_t * path , ngx_log_t * log) {
+	ngx_metrics_sh_t * sh = mcf->sh;
+	ngx_metrics_snapshot_header_t * h;
+	ngx_atomic_uint_t written;
+	ngx_atomic_t * total;
+	ngx_file_info_t fi;
+	ngx_str_t snapshot;
+	ngx_log_t quiet;
+	uint64_t areas[NGX_METRICS_SNAPSHOT_AREAS] , nwords , n , base;
+	ngx_uint_t a , i;
+	u_char * temp;
+	size_t size;
+	ngx_int_t rc;
+	char * what;
+
+	/* the refusals are expected, and not logged */
+
+	quiet = *log;
+	quiet.log_level = NGX_LOG_EMERG;
+	quiet.next = NULL;
+
+	snapshot = mcf->snapshot;
+	temp = ngx_metrics_snapshot_temp;
+	written = sh->snapshot_written;
+
+	mcf->snapshot = *path;
+	ngx_metrics_snapshot_temp = NULL;
+
+	ngx_metrics_snapshot_areas(sh , areas);
+	nwords = ngx_metrics_snapshot_words(areas);
+
+	for (i = 0; i < nwords; i++) {
+		sh->totals[i] = i * 3 + 1;
+	}
+
+	h = NULL;
+	rc = NGX_ERROR;
+
+	if (ngx_metrics_snapshot_write(mcf , log) != NGX_OK) {
+		what = "cannot be written";
+		goto failed;
+	}
+
+	if (ngx_file_info(ngx_metrics_snapshot_temp , &fi) != NGX_FILE_ERROR) {
+		what = "leaves its temp file behind";
+		goto failed;
+	}
+
+	h = ngx_metrics_snapshot_read(path , log);
+	if (h == NULL || h->zone_id != sh->zone_id || h->pid != (uint64_t)ngx_pid || h->nwords != nwords) {
+		what = "does not read back";
+		goto failed;
+	}
+
+	/* label sets and named rows come back as far as they are in use */
+
+	ngx_memzero((void *)sh->totals , nwords * sizeof(ngx_atomic_uint_t));
+	ngx_metrics_snapshot_apply(mcf->shpool , sh , h , NULL);
+
+	for (total = sh->totals , base = 0 , a = 0; a < NGX_METRICS_SNAPSHOT_AREAS; a++) {
+		n = areas[a];
+
+		if (a == NGX_METRICS_SNAPSHOT_LABELS) {
+			n = h->labels_used;
+
+		} else if (a == NGX_METRICS_SNAPSHOT_PEERS || a == NGX_METRICS_SNAPSHOT_STREAM) {
+			n = h->rows_used[a - NGX_METRICS_SNAPSHOT_PEERS];
+		}
+
+		for (i = 0; i < n * ngx_metrics_snapshot_units[a]; i++) {
+			if (total[i] != (base + i) * 3 + 1) {
+				what = "restores other totals";
+				goto failed;
+			}
+		}
+
+		total += areas[a] * ngx_metrics_snapshot_units[a];
+		base += areas[a] * ngx_metrics_snapshot_units[a];
+	}
+
+	size = (u_char *)(ngx_metrics_snapshot_values(h) + h->nwords) - (u_char *)h;
+
+	h->version = 1;
+	if (ngx_metrics_snapshot_check_put(path , h , size , &quiet) != NGX_DECLINED) {
+		what = "of version 1 is read";
+		goto failed;
+	}
+
+	h->version = NGX_METRICS_SNAPSHOT_VERSION;
+	h->word_size = sizeof(ngx_atomic_uint_t) / 2;
+	if (ngx_metrics_snapshot_check_put(path , h , size , &quiet) != NGX_DECLINED) {
+		what = "of another word size is read";
+		goto failed;
+	}
+
+	h->word_size = sizeof(ngx_atomic_uint_t);
+	h->areas[0]++;
+	h->nwords += ngx_metrics_snapshot_units[0];
+	if (ngx_metrics_snapshot_check_put(path , h , size , &quiet) != NGX_DECLINED) {
+		what = "with more slots than it holds is read";
+		goto failed;
+	}
+
+	h->areas[0]--;
+	h->nwords -= ngx_metrics_snapshot_units[0];
+	if (ngx_metrics_snapshot_check_put(path , h , size - 1 , &quiet) != NGX_DECLINED) {
+		what = "cut short is read";
+		goto failed;
+	}
+
+	if (ngx_metrics_snapshot_check_put(path , h , size , &quiet) != NGX_OK) {
+		what = "is not read once put back";
+		goto failed;
+	}
+
+	/* a directory in the way of the rename */
+
+	(void)ngx_delete_file(path->data);
+
+	if (ngx_create_dir(path->data , 0700) == NGX_FILE_ERROR) {
+		what = "cannot be replaced with a directory";
+		goto failed;
+	}
+
+	if (ngx_metrics_snapshot_write(mcf , &quiet) != NGX_ERROR) {
+		what = "is renamed over a directory";
+
+	} else if (ngx_file_info(ngx_metrics_snapshot_temp , &fi) != NGX_FILE_ERROR) {
+		what = "leaves its temp file behind after a failed rename";
+
+	} else {
+		rc = NGX_OK;
+	}
+
+	(void)ngx_delete_dir(path->data);
+
+	if (rc == NGX_OK) {
+		goto done;
+	}
+
+failed:
+
+	ngx_log_error(NGX_LOG_EMERG , log , 0 , "metrics bench: snapshot \"%V\" %s" , path , what);
+
+done:
+
+	if (h != NULL) {
+		ngx_free(h);
+	}
+
+	(void)ngx_delete_file(path->data);
+
+	if (ngx_metrics_snapshot_temp != NULL) {
+		ngx_free(ngx_metrics_snapshot_temp);
+	}
+
+	ngx_memzero((void *)sh->totals , nwords * sizeof(ngx_atomic_uint_t));
+	sh->snapshot_written = written;
+
+	mcf->snapshot = snapshot;
+	ngx_metrics_snapshot_temp = temp;
+
+	return rc;
+}
+
+/*
+ * Writes size bytes of a snapshot to the file and reads it back: NGX_OK
+ * if it is taken, NGX_DECLINED if it is refused.
+ */
+
+static ngx_int_t ngx_metrics_snapshot_check_put(ngx_str_t * path , ngx_metrics_snapshot_header_t * h , size_t size ,
+	ngx_log_t * log) {
+	ngx_metrics_snapshot_header_t * r;
+	ngx_fd_t fd;
+	ssize_t n;
+
+	fd = ngx_open_file(path->data , NGX_FILE_WRONLY , NGX_FILE_TRUNCATE , NGX_FILE_DEFAULT_ACCESS);
+	if (fd == NGX_INVALID_FILE) {
+		return NGX_ERROR;
+	}
+
+	n = ngx_write_fd(fd , h , size);
+
+	if (ngx_close_file(fd) == NGX_FILE_ERROR || n != (ssize_t)size) {
+		return NGX_ERROR;
+	}
+
+	r = ngx_metrics_snapshot_read(path , log);
+	if (r == NULL) {
+		return NGX_DECLINED;
+	}
+
+	ngx_free(r);
+
+	return NGX_OK;
+}
+
+#endif
@@ -0,0 +1,511 @@
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_metrics.h>
+
+/*
+ * The worker's local Space-Saving table, twice the size of the shared
+ * one, with a timer merging it into the shared table every interval.
+ */
+typedef struct tag_ngx_metrics_topk_local {
+	ngx_metrics_topk_table_t table;
+	ngx_uint_t size;
+	ngx_slab_pool_t * shpool;
+	ngx_metrics_sh_t * sh;
+	ngx_msec_t interval;
+	ngx_event_t event;
+} ngx_metrics_topk_local_t;
+
+static ngx_int_t ngx_metrics_topk_alloc(ngx_metrics_topk_table_t * t , ngx_uint_t size , ngx_slab_pool_t * shpool ,
+	ngx_log_t * log);
+static void ngx_metrics_topk_add(ngx_metrics_topk_table_t * t , ngx_uint_t size , uint32_t hash , u_char * uri ,
+	size_t len , ngx_uint_t status , ngx_atomic_uint_t count , ngx_atomic_uint_t error);
+static ngx_uint_t ngx_metrics_topk_match(ngx_metrics_topk_entry_t * e , uint32_t hash , u_char * uri , size_t len ,
+	ngx_uint_t status);
+static ngx_uint_t ngx_metrics_topk_slot(ngx_metrics_topk_table_t * t , uint32_t hash , u_char * uri , size_t len ,
+	ngx_uint_t status);
+static void ngx_metrics_topk_unindex(ngx_metrics_topk_table_t * t , ngx_uint_t idx);
+static void ngx_metrics_topk_sift_up(ngx_metrics_topk_table_t * t , ngx_uint_t i);
+static void ngx_metrics_topk_sift_down(ngx_metrics_topk_table_t * t , ngx_uint_t i);
+static void ngx_metrics_topk_merge(ngx_metrics_topk_table_t * t , ngx_uint_t size , ngx_metrics_topk_table_t * from);
+static void ngx_metrics_topk_flush_handler(ngx_event_t * ev);
+#if (NGX_METRICS_BENCH)
+static ngx_int_t ngx_metrics_topk_check_table(ngx_metrics_topk_table_t * t , ngx_uint_t size , ngx_uint_t * freq ,
+	ngx_uint_t total , ngx_log_t * log);
+#endif
+
+static ngx_metrics_topk_local_t ngx_metrics_topk_local;
+
+ngx_int_t ngx_metrics_topk_init_zone(ngx_slab_pool_t * shpool , ngx_metrics_sh_t * sh , ngx_uint_t ntopk) {
+	sh->ntopk = ntopk;
+	ngx_memzero(&sh->topk , sizeof(ngx_metrics_topk_table_t));
+
+	if (ntopk == 0) {
+		return NGX_OK;
+	}
+
+	return ngx_metrics_topk_alloc(&sh->topk , ntopk , shpool , NULL);
+}
+
+ngx_int_t ngx_metrics_topk_init(ngx_cycle_t * cycle , ngx_slab_pool_t * shpool , ngx_metrics_sh_t * sh ,
+	ngx_msec_t interval) {
+	ngx_metrics_topk_local_t * tl = &ngx_metrics_topk_local;
+
+	/* twice the shared size, so that entries live long enough to be ranked */
+
+	tl->size = 2 * sh->ntopk;
+
+	if (ngx_metrics_topk_alloc(&tl->table , tl->size , NULL , cycle->log) != NGX_OK) {
+		return NGX_ERROR;
+	}
+
+	tl->shpool = shpool;
+	tl->sh = sh;
+	tl->interval = interval;
+
+	tl->event.handler = ngx_metrics_topk_flush_handler;
+	tl->event.log = cycle->log;
+	tl->event.cancelable = 1;
+
+	return NGX_OK;
+}
+
+/*
+ * Allocates a table of size entries from the zone, or from the heap of
+ * the process without one.
+ */
+
+static ngx_int_t ngx_metrics_topk_alloc(ngx_metrics_topk_table_t * t , ngx_uint_t size , ngx_slab_pool_t * shpool ,
+	ngx_log_t * log) {
+	ngx_uint_t n;
+
+	for (n = 1; n < 2 * size; n <<= 1) { /* void */ }
+
+	t->mask = n - 1;
+	t->used = 0;
+
+	if (shpool != NULL) {
+		t->entries = ngx_slab_alloc(shpool , size * sizeof(ngx_metrics_topk_entry_t));
+		t->heap = ngx_slab_alloc(shpool , size * sizeof(uint32_t));
+		t->pos = ngx_slab_alloc(shpool , size * sizeof(uint32_t));
+		t->index = ngx_slab_calloc(shpool , n * sizeof(uint32_t));
+
+	} else {
+		t->entries = ngx_alloc(size * sizeof(ngx_metrics_topk_entry_t) , log);
+		t->heap = ngx_alloc(size * sizeof(uint32_t) , log);
+		t->pos = ngx_alloc(size * sizeof(uint32_t) , log);
+		t->index = ngx_calloc(n * sizeof(uint32_t) , log);
+	}
+
+	if (t->entries == NULL || t->heap == NULL || t->pos == NULL || t->index == NULL) {
+		t->entries = NULL;
+
+		return NGX_ERROR;
+	}
+
+	return NGX_OK;
+}
+
+void ngx_metrics_topk_count(u_char * uri , size_t len , ngx_uint_t status) {
+	ngx_metrics_topk_local_t * tl = &ngx_metrics_topk_local;
+	uint32_t hash;
+
+	if (tl->table.entries == NULL) {
+		return;
+	}
+
+	/* armed here, as the timers are set up after the core modules start */
+
+	if (!tl->event.timer_set) {
+		ngx_add_timer(&tl->event , tl->interval);
+	}
+
+	len = ngx_min(len , NGX_METRICS_TOPK_URI_LEN);
+	hash = ngx_murmur_hash2(uri , len) ^ (uint32_t)(status * 0x9e3779b1);
+
+	ngx_metrics_topk_add(&tl->table , tl->size , hash , uri , len , status , 1 , 0);
+}
+
+/*
+ * Space-Saving: the key adds its count and error to its entry, or, in a
+ * full table, takes over the least counted entry and inherits its count,
+ * which it also adds to its error.
+ */
+
+static void ngx_metrics_topk_add(ngx_metrics_topk_table_t * t , ngx_uint_t size , uint32_t hash , u_char * uri ,
+	size_t len , ngx_uint_t status , ngx_atomic_uint_t count , ngx_atomic_uint_t error) {
+	ngx_metrics_topk_entry_t * e;
+	ngx_uint_t idx , i;
+
+	i = ngx_metrics_topk_slot(t , hash , uri , len , status);
+
+	if (t->index[i] != 0) {
+		idx = t->index[i] - 1;
+		t->entries[idx].count += count;
+		t->entries[idx].error += error;
+		ngx_metrics_topk_sift_down(t , t->pos[idx]);
+
+		return;
+	}
+
+	if (t->used < size) {
+		idx = t->used++;
+		t->heap[idx] = (uint32_t)idx;
+		t->pos[idx] = (uint32_t)idx;
+
+		e = &t->entries[idx];
+		e->count = 0;
+		e->error = 0;
+
+	} else {
+		idx = t->heap[0];
+		ngx_metrics_topk_unindex(t , idx);
+		i = ngx_metrics_topk_slot(t , hash , uri , len , status);
+
+		e = &t->entries[idx];
+		e->error = e->count;
+	}
+
+	e->hash = hash;
+	e->status = (uint16_t)status;
+	e->len = (uint16_t)len;
+	e->count += count;
+	e->error += error;
+	ngx_memcpy(e->uri , uri , len);
+
+	t->index[i] = (uint32_t)idx + 1;
+
+	ngx_metrics_topk_sift_up(t , t->pos[idx]);
+	ngx_metrics_topk_sift_down(t , t->pos[idx]);
+}
+
+static ngx_uint_t ngx_metrics_topk_match(ngx_metrics_topk_entry_t * e , uint32_t hash , u_char * uri , size_t len ,
+	ngx_uint_t status) {
+	return e->hash == hash && e->status == status && e->len == len && ngx_memcmp(e->uri , uri , len) == 0;
+}
+
+/*
+ * Returns the index slot of the key, or the empty slot where it belongs.
+ */
+
+static ngx_uint_t ngx_metrics_topk_slot(ngx_metrics_topk_table_t * t , uint32_t hash , u_char * uri , size_t len ,
+	ngx_uint_t status) {
+	ngx_uint_t i;
+
+	for (i = hash & t->mask; t->index[i] != 0; i = (i + 1) & t->mask) {
+		if (ngx_metrics_topk_match(&t->entries[t->index[i] - 1] , hash , uri , len , status)) {
+			break;
+		}
+	}
+
+	return i;
+}
+
+/*
+ * Removes an entry from the index, shifting back the entries that
+ * probed past it so that no lookup stops short.
+ */
+
+static void ngx_metrics_topk_unindex(ngx_metrics_topk_table_t * t , ngx_uint_t idx) {
+	ngx_uint_t i , j , k;
+
+	for (i = t->entries[idx].hash & t->mask; t->index[i] != idx + 1; i = (i + 1) & t->mask) { /* void */ }
+
+	for (j = (i + 1) & t->mask; t->index[j] != 0; j = (j + 1) & t->mask) {
+		k = t->entries[t->index[j] - 1].hash & t->mask;
+
+		if (((j - k) & t->mask) >= ((j - i) & t->mask)) {
+			t->index[i] = t->index[j];
+			i = j;
+		}
+	}
+
+	t->index[i] = 0;
+}
+
+static void ngx_metrics_topk_sift_up(ngx_metrics_topk_table_t * t , ngx_uint_t i) {
+	ngx_uint_t parent , idx = t->heap[i];
+
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (t->entries[t->heap[parent]].count <= t->entries[idx].count) {
+			break;
+		}
+
+		t->heap[i] = t->heap[parent];
+		t->pos[t->heap[i]] = (uint32_t)i;
+		i = parent;
+	}
+
+	t->heap[i] = (uint32_t)idx;
+	t->pos[idx] = (uint32_t)i;
+}
+
+static void ngx_metrics_topk_sift_down(ngx_metrics_topk_table_t * t , ngx_uint_t i) {
+	ngx_uint_t child , idx = t->heap[i];
+
+	for ( ;; ) {
+		child = 2 * i + 1;
+		if (child >= t->used) {
+			break;
+		}
+
+		if (child + 1 < t->used && t->entries[t->heap[child + 1]].count < t->entries[t->heap[child]].count) {
+			child++;
+		}
+
+		if (t->entries[idx].count <= t->entries[t->heap[child]].count) {
+			break;
+		}
+
+		t->heap[i] = t->heap[child];
+		t->pos[t->heap[i]] = (uint32_t)i;
+		i = child;
+	}
+
+	t->heap[i] = (uint32_t)idx;
+	t->pos[idx] = (uint32_t)i;
+}
+
+/*
+ * Merges the local table into the shared one under the zone mutex, each
+ * entry as the Space-Saving merge of two tables does, and starts a new
+ * one.
+ */
+
+void ngx_metrics_topk_flush(void) {
+	ngx_metrics_topk_local_t * tl = &ngx_metrics_topk_local;
+	ngx_metrics_sh_t * sh = tl->sh;
+
+	if (tl->table.entries == NULL || tl->table.used == 0) {
+		return;
+	}
+
+	ngx_shmtx_lock(&tl->shpool->mutex);
+	ngx_metrics_topk_merge(&sh->topk , sh->ntopk , &tl->table);
+	ngx_shmtx_unlock(&tl->shpool->mutex);
+
+	tl->table.used = 0;
+	ngx_memzero(tl->table.index , (tl->table.mask + 1) * sizeof(uint32_t));
+}
+
+static void ngx_metrics_topk_merge(ngx_metrics_topk_table_t * t , ngx_uint_t size , ngx_metrics_topk_table_t * from) {
+	ngx_metrics_topk_entry_t * e;
+	ngx_uint_t i;
+
+	for (i = 0; i < from->used; i++) {
+		e = &from->entries[i];
+		ngx_metrics_topk_add(t , size , e->hash , e->uri , e->len , e->status , e->count , e->error);
+	}
+}
+
+/*
+ * Copies the shared table out and empties it, for the next interval.
+ */
+
+ngx_uint_t ngx_metrics_topk_take(ngx_slab_pool_t * shpool , ngx_metrics_sh_t * sh , ngx_metrics_topk_entry_t * out) {
+	ngx_uint_t n;
+
+	ngx_shmtx_lock(&shpool->mutex);
+
+	n = sh->topk.used;
+	ngx_memcpy(out , sh->topk.entries , n * sizeof(ngx_metrics_topk_entry_t));
+	sh->topk.used = 0;
+	ngx_memzero(sh->topk.index , (sh->topk.mask + 1) * sizeof(uint32_t));
+
+	ngx_shmtx_unlock(&shpool->mutex);
+
+	return n;
+}
+
+int ngx_libc_cdecl ngx_metrics_topk_cmp(const void * one , const void * two) {
+	const ngx_metrics_topk_entry_t * a = one , * b = two;
+
+	if (a->count == b->count) {
+		return 0;
+	}
+
+	return a->count < b->count ? 1 : -1;
+}
+
+static void ngx_metrics_topk_flush_handler(ngx_event_t * ev) {
+	ngx_metrics_topk_flush();
+}
+
+#if (NGX_METRICS_BENCH)
+
+#define NGX_METRICS_TOPK_CHECK_SIZE	4
+#define NGX_METRICS_TOPK_CHECK_KEYS	48
+#define NGX_METRICS_TOPK_CHECK_ADDS	20000
+
+/*
+ * For metrics_bench: counts a skewed stream of keys into a local table
+ * and merges it into a shared one half its size, as a flush does.  The
+ * heap and the index are checked after every count, when most of them
+ * replace the least counted entry, and the counts against the bounds of
+ * Space-Saving.  The hashes are cut to three bits, so that the keys
+ * collide in the index.
+ */
+
+ngx_int_t ngx_metrics_topk_check(ngx_log_t * log) {
+	ngx_metrics_topk_table_t local , shared;
+	ngx_metrics_topk_entry_t * e;
+	ngx_uint_t freq[NGX_METRICS_TOPK_CHECK_KEYS] , i , k , n;
+	u_char uri[NGX_INT_T_LEN + 2];
+	uint32_t r;
+	size_t len;
+	ngx_int_t rc;
+
+	ngx_memzero(freq , sizeof(freq));
+	ngx_memzero(&local , sizeof(ngx_metrics_topk_table_t));
+	ngx_memzero(&shared , sizeof(ngx_metrics_topk_table_t));
+
+	rc = NGX_ERROR;
+
+	if (ngx_metrics_topk_alloc(&local , 2 * NGX_METRICS_TOPK_CHECK_SIZE , NULL , log) != NGX_OK
+		|| ngx_metrics_topk_alloc(&shared , NGX_METRICS_TOPK_CHECK_SIZE , NULL , log) != NGX_OK)
+	{
+		goto done;
+	}
+
+	/* half of the stream goes to three keys, the rest to all of them */
+
+	for (r = 1 , n = 0; n < NGX_METRICS_TOPK_CHECK_ADDS; n++) {
+		r = r * 1103515245 + 12345;
+		k = (r & 0x10000) ? (r >> 17) % 3 : (r >> 17) % NGX_METRICS_TOPK_CHECK_KEYS;
+		len = ngx_sprintf(uri , "/%ui" , k) - uri;
+		freq[k]++;
+
+		ngx_metrics_topk_add(&local , 2 * NGX_METRICS_TOPK_CHECK_SIZE , ngx_murmur_hash2(uri , len) & 7 , uri , len ,
+			200 , 1 , 0);
+
+		if (ngx_metrics_topk_check_table(&local , 2 * NGX_METRICS_TOPK_CHECK_SIZE , freq , n + 1 , log) != NGX_OK) {
+			goto done;
+		}
+	}
+
+	ngx_metrics_topk_merge(&shared , NGX_METRICS_TOPK_CHECK_SIZE , &local);
+
+	if (ngx_metrics_topk_check_table(&shared , NGX_METRICS_TOPK_CHECK_SIZE , freq , n , log) != NGX_OK) {
+		goto done;
+	}
+
+	/* the merge keeps what the local table counted of each key for certain */
+
+	for (i = 0; i < shared.used; i++) {
+		e = &shared.entries[i];
+		k = ngx_metrics_topk_slot(&local , e->hash , e->uri , e->len , e->status);
+
+		if (local.index[k] == 0 || e->count - e->error
+			!= local.entries[local.index[k] - 1].count - local.entries[local.index[k] - 1].error)
+		{
+			ngx_log_error(NGX_LOG_EMERG , log , 0 , "metrics bench: top-k merge miscounts \"%*s\"" ,
+				(size_t)e->len , e->uri);
+			goto done;
+		}
+	}
+
+	rc = NGX_OK;
+
+done:
+
+	ngx_free(local.entries);
+	ngx_free(local.heap);
+	ngx_free(local.pos);
+	ngx_free(local.index);
+	ngx_free(shared.entries);
+	ngx_free(shared.heap);
+	ngx_free(shared.pos);
+	ngx_free(shared.index);
+
+	return rc;
+}
+
+/*
+ * The heap is ordered and in step with pos, every entry is found through
+ * the index, which holds nothing else, and the counts add up to the
+ * stream.  Each key was seen at least count - error and at most count
+ * times, and a key left out no more often than the least counted entry.
+ */
+
+static ngx_int_t ngx_metrics_topk_check_table(ngx_metrics_topk_table_t * t , ngx_uint_t size , ngx_uint_t * freq ,
+	ngx_uint_t total , ngx_log_t * log) {
+	ngx_metrics_topk_entry_t * e;
+	u_char seen[NGX_METRICS_TOPK_CHECK_KEYS];
+	ngx_uint_t i , k , n , sum;
+	ngx_int_t key;
+	char * what;
+
+	ngx_memzero(seen , sizeof(seen));
+	sum = 0;
+
+	if (t->used > size) {
+		what = "more entries than its size";
+		goto failed;
+	}
+
+	for (i = 0; i < t->used; i++) {
+		e = &t->entries[t->heap[i]];
+
+		if (t->pos[t->heap[i]] != i) {
+			what = "heap out of step with pos";
+			goto failed;
+		}
+
+		if (i > 0 && t->entries[t->heap[(i - 1) / 2]].count > e->count) {
+			what = "heap out of order";
+			goto failed;
+		}
+
+		k = ngx_metrics_topk_slot(t , e->hash , e->uri , e->len , e->status);
+		if (t->index[k] != t->heap[i] + 1) {
+			what = "entry missing from the index";
+			goto failed;
+		}
+
+		key = ngx_atoi(e->uri + 1 , e->len - 1);
+		if (key == NGX_ERROR || key >= NGX_METRICS_TOPK_CHECK_KEYS || seen[key]) {
+			what = "entry for no key";
+			goto failed;
+		}
+
+		if (e->count - e->error > freq[key] || freq[key] > e->count) {
+			what = "count out of bounds";
+			goto failed;
+		}
+
+		seen[key] = 1;
+		sum += e->count;
+	}
+
+	for (n = 0 , i = 0; i <= t->mask; i++) {
+		n += (t->index[i] != 0);
+	}
+
+	if (n != t->used) {
+		what = "stale index slots";
+		goto failed;
+	}
+
+	if (sum != total) {
+		what = "counts not adding up to the stream";
+		goto failed;
+	}
+
+	for (k = 0; k < NGX_METRICS_TOPK_CHECK_KEYS; k++) {
+		if (!seen[k] && freq[k] > (t->used ? t->entries[t->heap[0]].count : 0)) {
+			what = "frequent key left out";
+			goto failed;
+		}
+	}
+
+	return NGX_OK;
+
+failed:
+
+	ngx_log_error(NGX_LOG_EMERG , log , 0 , "metrics bench: top-k table of %ui after %ui counts: %s" ,
+		size , total , what);
+
+	return NGX_ERROR;
+}
+
+#endif
@@ -0,0 +1,79 @@
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_metrics.h>
+
+/*
+ * Writes the trace into the ring of the worker's shard, over the oldest
+ * one.  The trace is odd while it is copied, so that a reader racing
+ * with the copy sees it change, and then even, numbering its place.
+ */
+
+void ngx_metrics_trace_add(ngx_metrics_trace_t * trace) {
+	ngx_metrics_sh_t * sh = ngx_metrics_sh;
+	ngx_metrics_trace_t * t;
+	ngx_atomic_t * ring;
+	ngx_atomic_uint_t n;
+
+	if (ngx_metrics_shard == NULL || sh->ntraces == 0) {
+		return;
+	}
+
+	ring = ngx_metrics_shard_traces(sh , ngx_metrics_shard);
+	n = *ring;
+	t = ngx_metrics_trace_entry(ring , n % sh->ntraces);
+
+	t->seq = 2 * n + 1;
+	ngx_memory_barrier();
+
+	ngx_memcpy((u_char *)t + sizeof(ngx_atomic_t) , (u_char *)trace + sizeof(ngx_atomic_t) ,
+		sizeof(ngx_metrics_trace_t) - sizeof(ngx_atomic_t));
+
+	ngx_memory_barrier();
+	t->seq = 2 * n + 2;
+
+	*ring = n + 1;
+}
+
+/*
+ * Copies the traces of a shard written since next, at most the ring, into
+ * out, oldest first, and moves next past them.  A trace the owner
+ * overwrote while it was copied is dropped.
+ */
+
+ngx_uint_t ngx_metrics_trace_take(ngx_metrics_sh_t * sh , ngx_uint_t shard , ngx_atomic_uint_t * next ,
+	ngx_metrics_trace_t * out) {
+	ngx_metrics_trace_t * t;
+	ngx_atomic_uint_t head , n , seq;
+	ngx_atomic_t * ring;
+	ngx_uint_t count = 0;
+
+	if (sh->ntraces == 0) {
+		return 0;
+	}
+
+	ring = ngx_metrics_shard_traces(sh , ngx_metrics_get_shard(sh , shard));
+	head = *ring;
+
+	n = (head - *next > sh->ntraces) ? head - sh->ntraces : *next;
+
+	for ( /* void */ ; n < head; n++) {
+		t = ngx_metrics_trace_entry(ring , n % sh->ntraces);
+
+		seq = t->seq;
+		ngx_memory_barrier();
+
+		ngx_memcpy(&out[count] , t , sizeof(ngx_metrics_trace_t));
+
+		ngx_memory_barrier();
+
+		if (seq != 2 * n + 2 || t->seq != seq) {
+			continue;
+		}
+
+		count++;
+	}
+
+	*next = head;
+
+	return count;
+}
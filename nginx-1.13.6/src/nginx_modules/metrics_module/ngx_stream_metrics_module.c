@@ -0,0 +1,310 @@
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_stream.h>
+#include <ngx_metrics.h>
+
+typedef struct tag_ngx_stream_metrics_srv_conf {
+	ngx_uint_t index;
+	ngx_stream_upstream_srv_conf_t * upstream;
+	ngx_uint_t upstream_index;
+} ngx_stream_metrics_srv_conf_t;
+
+static ngx_int_t ngx_stream_metrics_post_conf(ngx_conf_t * cf);
+static ngx_array_t * ngx_stream_metrics_names(ngx_conf_t * cf);
+static void * ngx_stream_metrics_create_srv_conf(ngx_conf_t * cf);
+static ngx_int_t ngx_stream_metrics_init_process(ngx_cycle_t * cycle);
+static ngx_int_t ngx_stream_metrics_log_handler(ngx_stream_session_t * s);
+static ngx_int_t ngx_stream_metrics_upstream_index(ngx_stream_metrics_srv_conf_t * mscf ,
+	ngx_stream_upstream_srv_conf_t * uscf);
+static void ngx_stream_metrics_account(ngx_uint_t n , off_t received , off_t sent , ngx_uint_t failures ,
+	ngx_msec_t ms);
+
+static ngx_uint_t ngx_stream_metrics_nservers = 0;
+
+/* the rows of the servers and upstreams in the zone, NGX_ERROR for those without one */
+
+static ngx_int_t * ngx_stream_metrics_rows = NULL;
+static ngx_uint_t ngx_stream_metrics_nrows = 0;
+
+static ngx_stream_module_t  ngx_stream_metrics_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    ngx_stream_metrics_post_conf,          /* postconfiguration */
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+    ngx_stream_metrics_create_srv_conf,    /* create server configuration */
+    NULL                                   /* merge server configuration */
+};
+
+ngx_module_t ngx_stream_metrics_module = {
+    NGX_MODULE_V1,
+    &ngx_stream_metrics_module_ctx,        /* module context */
+    NULL,                                  /* module directives */
+    NGX_STREAM_MODULE,                     /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    ngx_stream_metrics_init_process,       /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+static void * ngx_stream_metrics_create_srv_conf(ngx_conf_t * cf) {
+	ngx_stream_metrics_srv_conf_t * mscf = ngx_pcalloc(cf->pool , sizeof(ngx_stream_metrics_srv_conf_t));
+	if (mscf == NULL) {
+		return NULL;
+	}
+
+	return mscf;
+}
+
+/*
+ * Numbers the servers in the order of the configuration, the upstreams
+ * following them, names them for their rows in the stream area of the
+ * metrics zone, and accounts the sessions at the log phase, once they
+ * are over.
+ */
+
+static ngx_int_t ngx_stream_metrics_post_conf(ngx_conf_t * cf) {
+	ngx_stream_core_main_conf_t * cmcf = ngx_stream_conf_get_module_main_conf(cf , ngx_stream_core_module);
+	ngx_stream_core_srv_conf_t ** cscfp = cmcf->servers.elts;
+	ngx_stream_metrics_srv_conf_t * mscf;
+	ngx_stream_handler_pt * h;
+	ngx_array_t * names;
+	ngx_uint_t i;
+
+	if (ngx_metrics_add_zone(cf) == NULL) {
+		return NGX_ERROR;
+	}
+
+	for (i = 0; i < cmcf->servers.nelts; i++) {
+		mscf = cscfp[i]->ctx->srv_conf[ngx_stream_metrics_module.ctx_index];
+		mscf->index = i;
+	}
+
+	ngx_stream_metrics_nservers = cmcf->servers.nelts;
+
+	names = ngx_stream_metrics_names(cf);
+	if (names == NULL) {
+		return NGX_ERROR;
+	}
+
+	ngx_metrics_reserve_rows(cf , NGX_METRICS_ROWS_STREAM , names);
+
+	h = ngx_array_push(&cmcf->phases[NGX_STREAM_LOG_PHASE].handlers);
+	if (h == NULL) {
+		return NGX_ERROR;
+	}
+
+	*h = ngx_stream_metrics_log_handler;
+
+	return NGX_OK;
+}
+
+/*
+ * Labels the servers by their first listen address and the upstreams by
+ * their name.
+ */
+
+static ngx_array_t * ngx_stream_metrics_names(ngx_conf_t * cf) {
+	ngx_stream_core_main_conf_t * cmcf = ngx_stream_conf_get_module_main_conf(cf , ngx_stream_core_module);
+	ngx_stream_upstream_main_conf_t * umcf = ngx_stream_conf_get_module_main_conf(cf , ngx_stream_upstream_module);
+	ngx_stream_upstream_srv_conf_t ** uscfp = umcf->upstreams.elts;
+	ngx_stream_core_srv_conf_t ** cscfp = cmcf->servers.elts;
+	ngx_stream_listen_t * ls = cmcf->listen.elts;
+	u_char addr[NGX_SOCKADDR_STRLEN];
+	ngx_array_t * names;
+	ngx_str_t * label;
+	ngx_uint_t i , j;
+	size_t len;
+
+	names = ngx_array_create(cf->pool , cmcf->servers.nelts + umcf->upstreams.nelts + 1 , sizeof(ngx_str_t));
+	if (names == NULL) {
+		return NULL;
+	}
+
+	for (i = 0; i < cmcf->servers.nelts; i++) {
+		for (j = 0; j < cmcf->listen.nelts && ls[j].ctx != cscfp[i]->ctx; j++) { /* void */ }
+
+		len = j < cmcf->listen.nelts
+			? ngx_sock_ntop(&ls[j].sockaddr.sockaddr , ls[j].socklen , addr , NGX_SOCKADDR_STRLEN , 1)
+			: (size_t)(ngx_sprintf(addr , "%ui" , i) - addr);
+
+		label = ngx_array_push(names);
+		if (label == NULL) {
+			return NULL;
+		}
+
+		label->len = sizeof("server=\"\"") - 1 + len;
+		label->data = ngx_pnalloc(cf->pool , label->len);
+		if (label->data == NULL) {
+			return NULL;
+		}
+
+		(void)ngx_sprintf(label->data , "server=\"%*s\"" , len , addr);
+	}
+
+	for (i = 0; i < umcf->upstreams.nelts; i++) {
+		label = ngx_array_push(names);
+		if (label == NULL) {
+			return NULL;
+		}
+
+		label->len = sizeof("upstream=\"\"") - 1 + uscfp[i]->host.len;
+		label->data = ngx_pnalloc(cf->pool , label->len);
+		if (label->data == NULL) {
+			return NULL;
+		}
+
+		(void)ngx_sprintf(label->data , "upstream=\"%V\"" , &uscfp[i]->host);
+	}
+
+	return names;
+}
+
+/*
+ * Finds the rows of the servers and upstreams in the zone, taking new
+ * ones for those met first.
+ */
+
+static ngx_int_t ngx_stream_metrics_init_process(ngx_cycle_t * cycle) {
+	ngx_stream_core_main_conf_t * cmcf = ngx_stream_cycle_get_module_main_conf(cycle , ngx_stream_core_module);
+	ngx_metrics_conf_t * mcf = (ngx_metrics_conf_t *)ngx_get_conf(cycle->conf_ctx , ngx_metrics_module);
+	ngx_str_t * names;
+	ngx_uint_t i , n , dropped = 0;
+
+	if (cmcf == NULL || (ngx_process != NGX_PROCESS_WORKER && ngx_process != NGX_PROCESS_SINGLE)) {
+		return NGX_OK;
+	}
+
+	ngx_metrics_start_export(cycle);
+
+	if (mcf->sh == NULL || mcf->rows[NGX_METRICS_ROWS_STREAM] == NULL) {
+		return NGX_OK;
+	}
+
+	n = mcf->rows[NGX_METRICS_ROWS_STREAM]->nelts;
+	names = mcf->rows[NGX_METRICS_ROWS_STREAM]->elts;
+
+	ngx_stream_metrics_rows = ngx_palloc(cycle->pool , n * sizeof(ngx_int_t));
+	if (ngx_stream_metrics_rows == NULL) {
+		return NGX_ERROR;
+	}
+
+	for (i = 0; i < n; i++) {
+		ngx_stream_metrics_rows[i] = ngx_metrics_row(mcf->shpool , mcf->sh , NGX_METRICS_ROWS_STREAM , names[i].data ,
+			names[i].len);
+
+		if (ngx_stream_metrics_rows[i] == NGX_ERROR) {
+			dropped++;
+		}
+	}
+
+	if (dropped) {
+		ngx_log_error(NGX_LOG_WARN , cycle->log , 0 ,
+			"metrics zone has no room for %ui stream servers and upstreams, not counted" , dropped);
+	}
+
+	ngx_stream_metrics_nrows = n;
+
+	return NGX_OK;
+}
+
+/*
+ * Accounts the session to its server and to the upstream it was proxied
+ * to: the session, the bytes in each direction, the upstream attempts
+ * that never connected and the session time.  Nothing is done on the
+ * proxy data path.
+ */
+
+static ngx_int_t ngx_stream_metrics_log_handler(ngx_stream_session_t * s) {
+	ngx_stream_metrics_srv_conf_t * mscf = ngx_stream_get_module_srv_conf(s , ngx_stream_metrics_module);
+	ngx_stream_upstream_state_t * state;
+	ngx_uint_t i , failures = 0;
+	off_t received = 0 , sent = 0;
+	ngx_msec_int_t ms;
+	ngx_time_t * tp;
+	ngx_int_t n;
+
+	tp = ngx_timeofday();
+	ms = (ngx_msec_int_t)((tp->sec - s->start_sec) * 1000 + (tp->msec - s->start_msec));
+	ms = ngx_max(ms , 0);
+
+	if (s->upstream_states != NULL) {
+		state = s->upstream_states->elts;
+
+		for (i = 0; i < s->upstream_states->nelts; i++) {
+			if (state[i].connect_time == (ngx_msec_t) -1) {
+				failures++;
+			}
+
+			received += state[i].bytes_received;
+			sent += state[i].bytes_sent;
+		}
+	}
+
+	ngx_stream_metrics_account(mscf->index , s->received , s->connection->sent , failures , (ngx_msec_t)ms);
+
+	if (s->upstream == NULL || s->upstream->upstream == NULL) {
+		return NGX_OK;
+	}
+
+	n = ngx_stream_metrics_upstream_index(mscf , s->upstream->upstream);
+	if (n != NGX_ERROR) {
+		ngx_stream_metrics_account(ngx_stream_metrics_nservers + n , received , sent , failures , (ngx_msec_t)ms);
+	}
+
+	return NGX_OK;
+}
+
+/*
+ * A server almost always proxies to the same upstream, so the index of
+ * the last one is kept in the server configuration of the worker.
+ */
+
+static ngx_int_t ngx_stream_metrics_upstream_index(ngx_stream_metrics_srv_conf_t * mscf ,
+	ngx_stream_upstream_srv_conf_t * uscf) {
+	ngx_stream_upstream_main_conf_t * umcf;
+	ngx_stream_upstream_srv_conf_t ** uscfp;
+	ngx_uint_t i;
+
+	if (mscf->upstream == uscf) {
+		return mscf->upstream_index;
+	}
+
+	umcf = ngx_stream_cycle_get_module_main_conf(ngx_cycle , ngx_stream_upstream_module);
+	uscfp = umcf->upstreams.elts;
+
+	for (i = 0; i < umcf->upstreams.nelts; i++) {
+		if (uscfp[i] == uscf) {
+			mscf->upstream = uscf;
+			mscf->upstream_index = i;
+
+			return i;
+		}
+	}
+
+	return NGX_ERROR;
+}
+
+static void ngx_stream_metrics_account(ngx_uint_t i , off_t received , off_t sent , ngx_uint_t failures ,
+	ngx_msec_t ms) {
+	ngx_int_t n;
+
+	if (i >= ngx_stream_metrics_nrows || ngx_stream_metrics_rows[i] == NGX_ERROR) {
+		return;
+	}
+
+	n = ngx_stream_metrics_rows[i];
+
+	ngx_metrics_stream_add(n , NGX_METRICS_STREAM_SESSIONS , 1);
+	ngx_metrics_stream_add(n , NGX_METRICS_STREAM_BYTES_RECEIVED , (ngx_atomic_int_t)received);
+	ngx_metrics_stream_add(n , NGX_METRICS_STREAM_BYTES_SENT , (ngx_atomic_int_t)sent);
+
+	if (failures) {
+		ngx_metrics_stream_add(n , NGX_METRICS_STREAM_CONNECT_FAILURES , (ngx_atomic_int_t)failures);
+	}
+
+	ngx_metrics_stream_observe(n , ms);
+}
@@ -9,6 +9,9 @@
 #include <ngx_core.h>
 #include <ngx_event.h>
 #include <ngx_channel.h>
+#if (NGX_METRICS)
+#include <ngx_metrics.h>
+#endif
 
 
 static void ngx_start_worker_processes(ngx_cycle_t *cycle, ngx_int_t n,
@@ -26,6 +29,10 @@ static void ngx_channel_handler(ngx_event_t *ev);
 static void ngx_cache_manager_process_cycle(ngx_cycle_t *cycle, void *data);
 static void ngx_cache_manager_process_handler(ngx_event_t *ev);
 static void ngx_cache_loader_process_handler(ngx_event_t *ev);
+#if (NGX_METRICS)
+static void ngx_start_metrics_aggregator_process(ngx_cycle_t *cycle,
+    ngx_uint_t respawn);
+#endif
 
 
 ngx_uint_t    ngx_process;
@@ -63,6 +70,12 @@ static ngx_cache_manager_ctx_t  ngx_cache_loader_ctx = {
     ngx_cache_loader_process_handler, "cache loader process", 60000
 };
 
+#if (NGX_METRICS)
+static ngx_cache_manager_ctx_t  ngx_metrics_aggregator_ctx = {
+    ngx_metrics_aggregator_process_handler, "metrics aggregator process", 0
+};
+#endif
+
 
 static ngx_cycle_t      ngx_exit_cycle;
 static ngx_log_t        ngx_exit_log;
@@ -130,6 +143,9 @@ ngx_master_process_cycle(ngx_cycle_t *cycle)
     ngx_start_worker_processes(cycle, ccf->worker_processes,
                                NGX_PROCESS_RESPAWN);
     ngx_start_cache_manager_processes(cycle, 0);
+#if (NGX_METRICS)
+    ngx_start_metrics_aggregator_process(cycle, 0);
+#endif
 
     ngx_new_binary = 0;
     delay = 0;
@@ -224,6 +240,9 @@ ngx_master_process_cycle(ngx_cycle_t *cycle)
                 ngx_start_worker_processes(cycle, ccf->worker_processes,
                                            NGX_PROCESS_RESPAWN);
                 ngx_start_cache_manager_processes(cycle, 0);
+#if (NGX_METRICS)
+                ngx_start_metrics_aggregator_process(cycle, 0);
+#endif
                 ngx_noaccepting = 0;
 
                 continue;
@@ -243,6 +262,9 @@ ngx_master_process_cycle(ngx_cycle_t *cycle)
             ngx_start_worker_processes(cycle, ccf->worker_processes,
                                        NGX_PROCESS_JUST_RESPAWN);
             ngx_start_cache_manager_processes(cycle, 1);
+#if (NGX_METRICS)
+            ngx_start_metrics_aggregator_process(cycle, 1);
+#endif
 
             /* allow new processes to start */
             ngx_msleep(100);
@@ -257,6 +279,9 @@ ngx_master_process_cycle(ngx_cycle_t *cycle)
             ngx_start_worker_processes(cycle, ccf->worker_processes,
                                        NGX_PROCESS_RESPAWN);
             ngx_start_cache_manager_processes(cycle, 0);
+#if (NGX_METRICS)
+            ngx_start_metrics_aggregator_process(cycle, 0);
+#endif
             live = 1;
         }
 
@@ -423,6 +448,34 @@ ngx_start_cache_manager_processes(ngx_cycle_t *cycle, ngx_uint_t respawn)
 }
 
 
+#if (NGX_METRICS)
+
+static void
+ngx_start_metrics_aggregator_process(ngx_cycle_t *cycle, ngx_uint_t respawn)
+{
+    ngx_channel_t  ch;
+
+    if (!ngx_metrics_aggregator_enabled(cycle)) {
+        return;
+    }
+
+    ngx_spawn_process(cycle, ngx_cache_manager_process_cycle,
+                      &ngx_metrics_aggregator_ctx, "metrics aggregator process",
+                      respawn ? NGX_PROCESS_JUST_RESPAWN : NGX_PROCESS_RESPAWN);
+
+    ngx_memzero(&ch, sizeof(ngx_channel_t));
+
+    ch.command = NGX_CMD_OPEN_CHANNEL;
+    ch.pid = ngx_processes[ngx_process_slot].pid;
+    ch.slot = ngx_process_slot;
+    ch.fd = ngx_processes[ngx_process_slot].channel[0];
+
+    ngx_pass_open_channel(cycle, &ch);
+}
+
+#endif
+
+
 static void
 ngx_pass_open_channel(ngx_cycle_t *cycle, ngx_channel_t *ch)
 {
@@ -1127,6 +1180,11 @@ ngx_cache_manager_process_cycle(ngx_cycle_t *cycle, void *data)
 
         if (ngx_terminate || ngx_quit) {
             ngx_log_error(NGX_LOG_NOTICE, cycle->log, 0, "exiting");
+#if (NGX_METRICS)
+            if (ctx == &ngx_metrics_aggregator_ctx) {
+                ngx_metrics_aggregator_process_exit(cycle);
+            }
+#endif
             exit(0);
         }
 